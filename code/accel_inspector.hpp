@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "vkutils.hpp"
+
+// Queries the properties of built acceleration structures and prints
+// them as a table sorted by memory
+class AccelInspector {
+public:
+    struct Entry {
+        std::string name;
+        vk::AccelerationStructureKHR accel;
+        vk::AccelerationStructureTypeKHR type;
+        uint32_t primitiveCount = 0;
+        vk::BuildAccelerationStructureFlagsKHR flags;
+
+        // Size of the buffer holding the AS
+        vk::DeviceSize memorySize = 0;
+
+        // 0 if not queried
+        vk::DeviceSize compactedSize = 0;
+        vk::DeviceSize serializationSize = 0;
+
+        // Only with VK_KHR_ray_tracing_maintenance1
+        vk::DeviceSize bottomLevelPointerCount = 0;
+    };
+
+    void add(const std::string& name,
+             vk::AccelerationStructureKHR accel,
+             vk::AccelerationStructureTypeKHR type,
+             uint32_t primitiveCount,
+             vk::BuildAccelerationStructureFlagsKHR flags,
+             vk::DeviceSize memorySize) {
+        Entry entry{};
+        entry.name = name;
+        entry.accel = accel;
+        entry.type = type;
+        entry.primitiveCount = primitiveCount;
+        entry.flags = flags;
+        entry.memorySize = memorySize;
+        entries.push_back(entry);
+    }
+
+    // All structures must have been built.
+    // Compacted sizes are only queried for structures built with
+    // eAllowCompaction.
+    void query(vk::Device device,
+               vk::CommandPool commandPool,
+               vk::Queue queue,
+               bool maintenance1Supported) {
+        this->maintenance1Supported = maintenance1Supported;
+        if (entries.empty()) {
+            return;
+        }
+
+        std::vector<uint32_t> compactable;
+        for (uint32_t i = 0; i < entries.size(); i++) {
+            if (entries[i].flags &
+                vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction) {
+                compactable.push_back(i);
+            }
+        }
+        std::vector<uint32_t> all(entries.size());
+        for (uint32_t i = 0; i < all.size(); i++) {
+            all[i] = i;
+        }
+
+        std::vector<Query> queries;
+        queries.push_back(createQuery(
+            device, vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+            compactable, &Entry::compactedSize));
+        queries.push_back(createQuery(
+            device, vk::QueryType::eAccelerationStructureSerializationSizeKHR,
+            all, &Entry::serializationSize));
+        if (maintenance1Supported) {
+            queries.push_back(createQuery(
+                device,
+                vk::QueryType::
+                    eAccelerationStructureSerializationBottomLevelPointersKHR,
+                all, &Entry::bottomLevelPointerCount));
+        }
+
+        vkutils::oneTimeSubmit(
+            device, commandPool, queue, [&](vk::CommandBuffer commandBuffer) {
+                for (const auto& query : queries) {
+                    if (query.indices.empty()) {
+                        continue;
+                    }
+                    uint32_t count =
+                        static_cast<uint32_t>(query.indices.size());
+                    std::vector<vk::AccelerationStructureKHR> accels;
+                    for (uint32_t index : query.indices) {
+                        accels.push_back(entries[index].accel);
+                    }
+                    commandBuffer.resetQueryPool(*query.pool, 0, count);
+                    commandBuffer.writeAccelerationStructuresPropertiesKHR(
+                        accels, query.type, *query.pool, 0);
+                }
+            });
+
+        for (const auto& query : queries) {
+            if (query.indices.empty()) {
+                continue;
+            }
+            uint32_t count = static_cast<uint32_t>(query.indices.size());
+            std::vector<vk::DeviceSize> values(count);
+            vk::Result result = device.getQueryPoolResults(
+                *query.pool, 0, count, sizeof(vk::DeviceSize) * count,
+                values.data(), sizeof(vk::DeviceSize),
+                vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+            if (result != vk::Result::eSuccess) {
+                std::cerr << "Failed to get AS property queries.\n";
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                entries[query.indices[i]].*query.member = values[i];
+            }
+        }
+    }
+
+    // Largest structures first
+    void printTable() const {
+        std::vector<const Entry*> sorted;
+        for (const auto& entry : entries) {
+            sorted.push_back(&entry);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const Entry* a, const Entry* b) {
+                             return a->memorySize > b->memorySize;
+                         });
+
+        auto toKiB = [](vk::DeviceSize size) {
+            return static_cast<double>(size) / 1024.0;
+        };
+        auto printSize = [&](vk::DeviceSize size) {
+            if (size == 0) {
+                std::cout << std::setw(12) << "-";
+            } else {
+                std::cout << std::setw(12) << toKiB(size);
+            }
+        };
+
+        std::cout << std::left << std::setw(20) << "name" << std::setw(6)
+                  << "type" << std::right << std::setw(10) << "prims"
+                  << std::setw(12) << "memory KiB" << std::setw(12)
+                  << "compact KiB" << std::setw(12) << "serial KiB"
+                  << std::setw(8) << "ptrs"
+                  << "  flags\n";
+
+        vk::DeviceSize totalMemory = 0;
+        vk::DeviceSize totalCompacted = 0;
+        std::cout << std::fixed << std::setprecision(1);
+        for (const Entry* entry : sorted) {
+            bool topLevel =
+                entry->type == vk::AccelerationStructureTypeKHR::eTopLevel;
+            std::cout << std::left << std::setw(20) << entry->name.substr(0, 19)
+                      << std::setw(6) << (topLevel ? "TLAS" : "BLAS")
+                      << std::right << std::setw(10) << entry->primitiveCount;
+            printSize(entry->memorySize);
+            printSize(entry->compactedSize);
+            printSize(entry->serializationSize);
+            if (maintenance1Supported) {
+                std::cout << std::setw(8) << entry->bottomLevelPointerCount;
+            } else {
+                std::cout << std::setw(8) << "-";
+            }
+            std::cout << "  " << getFlagNames(entry->flags) << "\n";
+
+            totalMemory += entry->memorySize;
+            totalCompacted += entry->compactedSize ? entry->compactedSize
+                                                   : entry->memorySize;
+        }
+        std::cout << entries.size() << " structures, " << toKiB(totalMemory)
+                  << " KiB (" << toKiB(totalCompacted)
+                  << " KiB if all compactable ones were compacted)\n";
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+private:
+    struct Query {
+        vk::UniqueQueryPool pool;
+        vk::QueryType type;
+        std::vector<uint32_t> indices;
+        vk::DeviceSize Entry::*member;
+    };
+
+    std::vector<Entry> entries;
+    bool maintenance1Supported = false;
+
+    static Query createQuery(vk::Device device,
+                             vk::QueryType type,
+                             const std::vector<uint32_t>& indices,
+                             vk::DeviceSize Entry::*member) {
+        Query query{};
+        query.type = type;
+        query.indices = indices;
+        query.member = member;
+        if (!indices.empty()) {
+            vk::QueryPoolCreateInfo createInfo{};
+            createInfo.setQueryType(type);
+            createInfo.setQueryCount(static_cast<uint32_t>(indices.size()));
+            query.pool = device.createQueryPoolUnique(createInfo);
+        }
+        return query;
+    }
+
+    static std::string getFlagNames(
+        vk::BuildAccelerationStructureFlagsKHR flags) {
+        using Bits = vk::BuildAccelerationStructureFlagBitsKHR;
+        std::string names;
+        auto append = [&](Bits bit, const char* name) {
+            if (flags & bit) {
+                names += names.empty() ? name : std::string{"|"} + name;
+            }
+        };
+        append(Bits::ePreferFastTrace, "fast-trace");
+        append(Bits::ePreferFastBuild, "fast-build");
+        append(Bits::eAllowUpdate, "update");
+        append(Bits::eAllowCompaction, "compaction");
+        append(Bits::eLowMemory, "low-memory");
+        return names;
+    }
+};
@@ -0,0 +1,4020 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <numeric>
+#include <random>
+
+#include "accel_inspector.hpp"
+#include "batch_render.hpp"
+#include "bvh_report.hpp"
+#include "camera.hpp"
+#include "curves.hpp"
+#include "frame_export.hpp"
+#include "frame_graph.hpp"
+#include "frame_stream.hpp"
+#include "gpu_profiler.hpp"
+#include "jobs.hpp"
+#include "memory_manager.hpp"
+#include "mesh.hpp"
+#include "morton.hpp"
+#include "options.hpp"
+#include "profiler.hpp"
+#include "render_server.hpp"
+#include "scene.hpp"
+#include "scene_graph.hpp"
+#include "skinning.hpp"
+#include "stats.hpp"
+#include "tracer.hpp"
+#include "transforms.hpp"
+#include "vkutils.hpp"
+#include "voxels.hpp"
+
+constexpr uint32_t WIDTH = 800;
+constexpr uint32_t HEIGHT = 600;
+
+// Offscreen render target of the server and the exporter
+constexpr vk::Format RENDER_TARGET_FORMAT = vk::Format::eR8G8B8A8Unorm;
+constexpr vk::ImageUsageFlags RENDER_TARGET_USAGE =
+    vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc;
+
+// Pass names shared by debug labels and profilers
+constexpr const char* PASS_BUILD_BLAS = "Build BLAS";
+constexpr const char* PASS_BUILD_TLAS = "Build TLAS";
+constexpr const char* PASS_COMPACT_BLAS = "Compact BLAS";
+constexpr const char* PASS_UPLOAD_INSTANCES = "Upload instances";
+constexpr const char* PASS_SKIN = "Skin vertices";
+constexpr const char* PASS_REFIT_BLAS = "Refit BLAS";
+constexpr const char* PASS_UPDATE_TLAS = "Update TLAS";
+constexpr const char* PASS_RESET_COUNTERS = "Reset counters";
+constexpr const char* PASS_TRACE = "Trace rays";
+constexpr const char* PASS_READBACK = "Readback";
+constexpr const char* PASS_COPY_IMAGE = "Copy image";
+constexpr const char* PASS_COPY_STREAM = "Copy stream frame";
+constexpr const char* PASS_CONVERT_STREAM = "Convert stream frame";
+
+// vkutils::oneTimeSubmit with the blocking submit shown in the CPU trace
+inline void tracedSubmit(vk::Device device,
+                         vk::CommandPool commandPool,
+                         vk::Queue queue,
+                         const std::function<void(vk::CommandBuffer)>& func) {
+    trace::Scope traceScope{"oneTimeSubmit"};
+    vkutils::oneTimeSubmit(device, commandPool, queue, func);
+}
+
+// Host-visible buffers streamed frames are read back into
+constexpr uint32_t STREAM_SLOT_COUNT = 3;
+
+// Hit group records: triangles, voxel bricks, curves
+constexpr uint32_t TRIANGLE_SBT_RECORD = 0;
+constexpr uint32_t VOXEL_SBT_RECORD = 1;
+constexpr uint32_t CURVE_SBT_RECORD = 2;
+
+static_assert(sizeof(Aabb) == sizeof(vk::AabbPositionsKHR),
+              "Aabb is not usable as AABB geometry");
+
+struct Buffer {
+    vk::UniqueBuffer buffer;
+    DeviceMemory memory;
+    vk::DeviceAddress address{};
+
+    void init(MemoryManager& memoryManager,
+              vk::Device device,
+              vk::DeviceSize size,
+              vk::BufferUsageFlags usage,
+              vk::MemoryPropertyFlags memoryProperty,
+              const char* name,
+              const void* data = nullptr) {
+        // Create buffer
+        vk::BufferCreateInfo createInfo{};
+        createInfo.setSize(size);
+        createInfo.setUsage(usage);
+        buffer = device.createBufferUnique(createInfo);
+        vkutils::setObjectName(device, *buffer, name);
+
+        // Allocate memory
+        vk::MemoryRequirements memoryReq =
+            device.getBufferMemoryRequirements(*buffer);
+        vk::MemoryAllocateFlags allocateFlags;
+        if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
+            allocateFlags = vk::MemoryAllocateFlagBits::eDeviceAddress;
+        }
+        memory = memoryManager.allocate(device, memoryReq, memoryProperty,
+                                        name, allocateFlags);
+
+        // Bind buffer to memory
+        device.bindBufferMemory(*buffer, *memory, 0);
+
+        // Copy data
+        if (data) {
+            void* mappedPtr = device.mapMemory(*memory, 0, size);
+            memcpy(mappedPtr, data, size);
+            device.unmapMemory(*memory);
+        }
+
+        // Get address
+        if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
+            vk::BufferDeviceAddressInfoKHR addressInfo{};
+            addressInfo.setBuffer(*buffer);
+            address = device.getBufferAddressKHR(&addressInfo);
+        }
+    }
+};
+
+// Must match PushConstants in shaders/camera.glsl
+struct PushConstants {
+    uint32_t debugMode = 0;  // 0: off, 1: heatmap
+    float heatmapScale = 1.0f;
+    uint32_t sampleCount = 1;
+
+    // Varies the jitter of samples between frames
+    uint32_t sampleSeed = 0;
+
+    // Primary rays go through forward + right * x + down * y for x, y in
+    // [-1, 1] from the top left of the image
+    float cameraOrigin[4] = {0.0f, 0.0f, 5.0f, 0.0f};
+    float cameraForward[4] = {0.0f, 0.0f, -3.0f, 0.0f};
+    float cameraRight[4] = {1.0f, 0.0f, 0.0f, 0.0f};
+    float cameraDown[4] = {0.0f, 1.0f, 0.0f, 0.0f};
+
+    // Buffers read by the intersection shaders: GpuBrick array of the
+    // voxel grid, CurveSegment and CurvePiece arrays of the curves
+    vk::DeviceAddress voxelBricks = 0;
+    vk::DeviceAddress curveSegments = 0;
+    vk::DeviceAddress curvePieces = 0;
+
+    // Thin lens: primary rays start on a disk of lensRadius around the
+    // origin and meet at focusDistance along the view direction
+    float lensRadius = 0.0f;
+    float focusDistance = 5.0f;
+
+    // Without motion instances, the TLAS holds the instances at this many
+    // times of the shutter, time i with mask 1 << i
+    uint32_t timeSliceCount = 1;
+
+    // EyeCamera[eyeCount * 2] of stereo and motion blurred frames, eye i
+    // at shutter open and close at 2 * i and 2 * i + 1
+    vk::DeviceAddress cameras = 0;
+};
+
+// Vulkan only guarantees 128 bytes of push constants
+static_assert(sizeof(PushConstants) <= 128, "push constants too large");
+
+// Must match EyeCamera in shaders/camera.glsl
+struct EyeCamera {
+    float origin[4];
+    float forward[4];
+    float right[4];
+    float down[4];
+};
+
+// Instances of a TLAS built with motion are 160 bytes apart
+struct MotionInstance {
+    vk::AccelerationStructureMotionInstanceNV instance;
+    uint8_t padding[8];
+};
+static_assert(sizeof(MotionInstance) == 160, "motion instance stride");
+
+// Matrix motion instance that stays at the transform of instance
+inline MotionInstance toMotionInstance(
+    const vk::AccelerationStructureInstanceKHR& instance) {
+    vk::AccelerationStructureMatrixMotionInstanceNV motion{};
+    motion.transformT0 = instance.transform;
+    motion.transformT1 = instance.transform;
+    motion.instanceCustomIndex = instance.instanceCustomIndex;
+    motion.mask = instance.mask;
+    motion.instanceShaderBindingTableRecordOffset =
+        instance.instanceShaderBindingTableRecordOffset;
+    motion.flags = instance.flags;
+    motion.accelerationStructureReference =
+        instance.accelerationStructureReference;
+    MotionInstance result{};
+    result.instance.type =
+        vk::AccelerationStructureMotionInstanceTypeNV::eMatrixMotion;
+    result.instance.data.matrixMotionInstance = motion;
+    return result;
+}
+
+// Must match PushConstants in shaders/nv12.comp
+struct StreamConvertPushConstants {
+    vk::DeviceAddress pixels;
+    vk::DeviceAddress frame;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Must match the header of HitCounters in shaders
+struct HitCounters {
+    uint32_t closestHits;
+    uint32_t anyHits;
+    uint32_t rays;
+    uint32_t traversalTicksLow;  // 64-bit sum of realtime clock ticks
+    uint32_t traversalTicksHigh;
+};
+
+struct AccelStruct {
+    vk::UniqueAccelerationStructureKHR accel;
+    Buffer buffer;
+
+    // Build inputs, kept until the build has been executed
+    vk::AccelerationStructureGeometryKHR geometry;
+    vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+    vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo;
+    vk::AccelerationStructureBuildSizesInfoKHR buildSizes;
+    Buffer scratchBuffer;
+
+    // Current size of the AS, smaller than the build size once compacted
+    vk::DeviceSize size = 0;
+
+    // Destination of a pending compacting copy
+    vk::UniqueAccelerationStructureKHR compactedAccel;
+    Buffer compactedBuffer;
+    vk::DeviceSize compactedSize = 0;
+
+    // Creates the AS without building it
+    void create(MemoryManager& memoryManager,
+                vk::Device device,
+                vk::AccelerationStructureTypeKHR type,
+                vk::AccelerationStructureGeometryKHR geometry,
+                uint32_t primitiveCount,
+                const char* name,
+                vk::BuildAccelerationStructureFlagsKHR flags =
+                    vk::BuildAccelerationStructureFlagBitsKHR::
+                        ePreferFastTrace) {
+        this->geometry = geometry;
+
+        // Get build info
+        buildInfo = vk::AccelerationStructureBuildGeometryInfoKHR{};
+        buildInfo.setType(type);
+        buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+        buildInfo.setFlags(flags);
+        buildInfo.setGeometries(geometry);
+
+        buildSizes = device.getAccelerationStructureBuildSizesKHR(
+                vk::AccelerationStructureBuildTypeKHR::eDevice, buildInfo,
+                primitiveCount);
+
+        // Create buffer for AS
+        size = buildSizes.accelerationStructureSize;
+        buffer.init(memoryManager, device,
+                    buildSizes.accelerationStructureSize,
+                    vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR,
+                    vk::MemoryPropertyFlagBits::eDeviceLocal, name);
+
+        // Create AS
+        // A TLAS with motion needs its instance count up front
+        vk::AccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.setBuffer(*buffer.buffer);
+        createInfo.setSize(buildSizes.accelerationStructureSize);
+        createInfo.setType(type);
+        vk::AccelerationStructureMotionInfoNV motionInfo{};
+        if (flags & vk::BuildAccelerationStructureFlagBitsKHR::eMotionNV) {
+            motionInfo.setMaxInstances(primitiveCount);
+            createInfo.setCreateFlags(
+                vk::AccelerationStructureCreateFlagBitsKHR::eMotionNV);
+            createInfo.setPNext(&motionInfo);
+        }
+        accel = device.createAccelerationStructureKHRUnique(createInfo);
+        vkutils::setObjectName(device, *accel, name);
+
+        buildInfo.setDstAccelerationStructure(*accel);
+
+        buildRangeInfo = vk::AccelerationStructureBuildRangeInfoKHR{};
+        buildRangeInfo.setPrimitiveCount(primitiveCount);
+        buildRangeInfo.setPrimitiveOffset(0);
+        buildRangeInfo.setFirstVertex(0);
+        buildRangeInfo.setTransformOffset(0);
+
+        // Get address
+        vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
+        addressInfo.setAccelerationStructure(*accel);
+        buffer.address = device.getAccelerationStructureAddressKHR(addressInfo);
+    }
+
+    // Creates a scratch buffer for a build of this AS only
+    void allocateScratch(MemoryManager& memoryManager, vk::Device device) {
+        scratchBuffer.init(memoryManager, device, buildSizes.buildScratchSize,
+                           vk::BufferUsageFlagBits::eStorageBuffer |
+                               vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                           vk::MemoryPropertyFlagBits::eDeviceLocal,
+                           "AS scratch");
+    }
+
+    // The geometry buffers and the scratch memory must stay alive
+    // until the build has completed
+    void recordBuild(vk::CommandBuffer commandBuffer,
+                     vk::DeviceAddress scratchAddress) const {
+        // Point to the geometry of this object even if it has been moved
+        vk::AccelerationStructureBuildGeometryInfoKHR info = buildInfo;
+        info.setGeometries(geometry);
+        info.setScratchData(scratchAddress);
+        commandBuffer.buildAccelerationStructuresKHR(info, &buildRangeInfo);
+    }
+
+    // Refits the AS in place with the current contents of the geometry
+    // buffers. Requires eAllowUpdate and buildSizes.updateScratchSize
+    // bytes of scratch memory.
+    void recordUpdate(vk::CommandBuffer commandBuffer,
+                      vk::DeviceAddress scratchAddress) const {
+        vk::AccelerationStructureBuildGeometryInfoKHR info = buildInfo;
+        info.setMode(vk::BuildAccelerationStructureModeKHR::eUpdate);
+        info.setSrcAccelerationStructure(*accel);
+        info.setScratchData(scratchAddress);
+        info.setGeometries(geometry);
+        commandBuffer.buildAccelerationStructuresKHR(info, &buildRangeInfo);
+    }
+
+    void releaseScratch() { scratchBuffer = Buffer{}; }
+
+    // Records a copy into a new AS of compactedSize bytes.
+    // Requires eAllowCompaction. Call finishCompaction() once the copy
+    // has executed.
+    void recordCompaction(MemoryManager& memoryManager,
+                          vk::Device device,
+                          vk::CommandBuffer commandBuffer,
+                          vk::DeviceSize compactedSize,
+                          const char* name) {
+        this->compactedSize = compactedSize;
+        compactedBuffer.init(
+            memoryManager, device, compactedSize,
+            vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR,
+            vk::MemoryPropertyFlagBits::eDeviceLocal, name);
+
+        vk::AccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.setBuffer(*compactedBuffer.buffer);
+        createInfo.setSize(compactedSize);
+        createInfo.setType(buildInfo.type);
+        compactedAccel =
+            device.createAccelerationStructureKHRUnique(createInfo);
+        vkutils::setObjectName(device, *compactedAccel, name);
+
+        vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
+        addressInfo.setAccelerationStructure(*compactedAccel);
+        compactedBuffer.address =
+            device.getAccelerationStructureAddressKHR(addressInfo);
+
+        vk::CopyAccelerationStructureInfoKHR copyInfo{};
+        copyInfo.setSrc(*accel);
+        copyInfo.setDst(*compactedAccel);
+        copyInfo.setMode(vk::CopyAccelerationStructureModeKHR::eCompact);
+        commandBuffer.copyAccelerationStructureKHR(copyInfo);
+    }
+
+    // Replaces the AS with its compacted copy and frees the original
+    void finishCompaction() {
+        accel = std::move(compactedAccel);
+        buffer = std::move(compactedBuffer);
+        size = compactedSize;
+        buildInfo.setDstAccelerationStructure(*accel);
+    }
+
+    // Creates and builds the AS with a one-time submit
+    void init(MemoryManager& memoryManager,
+              vk::Device device,
+              vk::CommandPool commandPool,
+              vk::Queue queue,
+              vk::AccelerationStructureTypeKHR type,
+              vk::AccelerationStructureGeometryKHR geometry,
+              uint32_t primitiveCount,
+              const char* name,
+              GpuProfiler* profiler = nullptr,
+              vk::BuildAccelerationStructureFlagsKHR flags =
+                  vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace) {
+        trace::Scope traceScope{"AccelStruct::init"};
+
+        create(memoryManager, device, type, geometry, primitiveCount, name,
+               flags);
+        allocateScratch(memoryManager, device);
+
+        // Build
+        tracedSubmit(
+            device, commandPool, queue,
+            [&](vk::CommandBuffer commandBuffer) {
+                GpuProfiler::Scope scope{
+                    profiler, commandBuffer,
+                    type == vk::AccelerationStructureTypeKHR::eBottomLevel
+                        ? PASS_BUILD_BLAS
+                        : PASS_BUILD_TLAS};
+                recordBuild(commandBuffer, scratchBuffer.address);
+            });
+        if (profiler) {
+            profiler->resolve();
+        }
+        releaseScratch();
+    }
+};
+
+// Consecutive builds [begin, end) that share one scratch buffer
+struct BuildWave {
+    uint32_t begin;
+    uint32_t end;
+    vk::DeviceSize scratchSize;
+};
+
+// Splits builds into waves whose total scratch size fits in the budget.
+// A build larger than the budget gets a wave of its own.
+inline std::vector<BuildWave> planBuildWaves(
+    const std::vector<vk::DeviceSize>& scratchSizes,
+    vk::DeviceSize scratchBudget) {
+    std::vector<BuildWave> waves;
+    uint32_t count = static_cast<uint32_t>(scratchSizes.size());
+    for (uint32_t i = 0; i < count; i++) {
+        if (waves.empty() ||
+            waves.back().scratchSize + scratchSizes[i] > scratchBudget) {
+            waves.push_back({i, i, 0});
+        }
+        waves.back().end = i + 1;
+        waves.back().scratchSize += scratchSizes[i];
+    }
+    return waves;
+}
+
+// Records secondary command buffers with a command pool owned by one thread
+struct ThreadRecorder {
+    vk::UniqueCommandPool commandPool;
+    std::vector<vk::UniqueCommandBuffer> commandBuffers;
+    uint32_t usedCount = 0;
+
+    void init(vk::Device device, uint32_t queueFamilyIndex) {
+        commandPool = vkutils::createCommandPool(device, queueFamilyIndex);
+    }
+
+    // All command buffers must have completed execution
+    void reset(vk::Device device) {
+        device.resetCommandPool(*commandPool);
+        usedCount = 0;
+    }
+
+    // Returns a secondary command buffer in the recording state
+    vk::CommandBuffer begin(vk::Device device) {
+        if (usedCount == commandBuffers.size()) {
+            commandBuffers.push_back(vkutils::createCommandBuffer(
+                device, *commandPool, vk::CommandBufferLevel::eSecondary));
+        }
+        vk::CommandBuffer commandBuffer = *commandBuffers[usedCount++];
+
+        vk::CommandBufferInheritanceInfo inheritanceInfo{};
+        vk::CommandBufferBeginInfo beginInfo{};
+        beginInfo.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+        beginInfo.setPInheritanceInfo(&inheritanceInfo);
+        commandBuffer.begin(beginInfo);
+        return commandBuffer;
+    }
+};
+
+// Command buffers of a frame that stays in flight while the next frames
+// are recorded, see runStream()
+struct InFlightFrame {
+    vk::UniqueCommandBuffer commandBuffer;
+    std::vector<ThreadRecorder> threadRecorders;
+    vk::UniqueFence fence;
+};
+
+class Application {
+public:
+    explicit Application(Options options = {}) : options{options} {}
+
+    void run() {
+        trace::Tracer::get().setEnabled(!options.tracePath.empty());
+        trace::Tracer::get().setThreadName("Main");
+
+        // The server, the exporter, the stream and the batch renderer
+        // render offscreen without a window
+        exporting = !options.exportSocketPath.empty();
+        streaming = !options.streamPath.empty();
+        batching = !options.batchDirectory.empty();
+        headless = !options.serverSocketPath.empty() || exporting ||
+                   streaming || batching || options.voxelBenchmark ||
+                   options.curveBenchmark || options.stereoBenchmark;
+        if (options.stereo && !batching) {
+            std::cerr << "--stereo requires --batch.\n";
+            std::abort();
+        }
+        stereo = options.stereo || options.stereoBenchmark;
+        eyeCount = stereo ? 2 : 1;
+        if (options.timeSliceCount == 0 ||
+            options.timeSliceCount > MAX_TIME_SLICES ||
+            !(options.shutter >= 0.0f && options.shutter <= 1.0f)) {
+            std::cerr << "Motion blur needs 1 to " << MAX_TIME_SLICES
+                      << " time slices and a shutter of 0 to 1 frames.\n";
+            std::abort();
+        }
+        // Jobs of the server and the benchmarks have no time
+        motionBlur = options.timeSliceCount > 1;
+        if (motionBlur && headless && !batching && !exporting &&
+            !streaming) {
+            std::cerr << "--motion-blur requires a window, --batch, "
+                         "--export or --stream.\n";
+            std::abort();
+        }
+        if (batching || motionBlur) {
+            timeline = createDefaultTimeline();
+            if (!options.timelinePath.empty() &&
+                !loadTimeline(options.timelinePath, timeline)) {
+                std::abort();
+            }
+        }
+        if (options.apertureRadius < 0.0f || !(options.focusDistance > 0.0f)) {
+            std::cerr << "Aperture must not be negative and focus distance "
+                         "must be positive.\n";
+            std::abort();
+        }
+        pushConstants.lensRadius = options.apertureRadius;
+        pushConstants.focusDistance = options.focusDistance;
+        if (options.voxelBenchmark) {
+            runVoxelBenchmark();
+            return;
+        }
+        if (options.curveBenchmark) {
+            runCurveBenchmark();
+            return;
+        }
+        if (options.stereoBenchmark) {
+            runStereoBenchmark();
+            return;
+        }
+        if (batching) {
+            runBatch();
+            return;
+        }
+        if (exporting) {
+            runExport();
+            return;
+        }
+        if (streaming) {
+            runStream();
+            return;
+        }
+        if (headless) {
+            runServer();
+            return;
+        }
+
+        runWindow();
+    }
+
+private:
+    Options options;
+    StartupProfiler startupProfiler;
+    GLFWwindow* window = nullptr;
+    bool headless = false;
+    bool exporting = false;
+    bool streaming = false;
+    bool batching = false;
+    uint64_t frame = 0;
+
+    // Stereo frames trace eyeCount eyes in one launch of that depth into
+    // the layers of a 2-layer render target
+    bool stereo = false;
+    uint32_t eyeCount = 1;
+
+    // Time of the frame being recorded in seconds. Frames are 1/60 s
+    // apart, except in batch mode where the timeline sets it.
+    float animationTime = 0.0f;
+
+    // Camera and instances of batch and motion blurred frames
+    Timeline timeline;
+
+    // Motion blurred frames trace the instances and the camera over the
+    // shutter interval. With motion instances the TLAS interpolates the
+    // instances itself, otherwise it holds time slices of them.
+    bool motionBlur = false;
+    bool motionInstances = false;
+
+    // Instance, Device, Queue
+    vk::UniqueInstance instance;
+    vk::UniqueDebugUtilsMessengerEXT debugMessenger;
+    vk::UniqueSurfaceKHR surface;
+    vk::PhysicalDevice physicalDevice;
+    vk::UniqueDevice device;
+    vk::Queue queue;
+    uint32_t queueFamilyIndex{};
+    bool shaderClockSupported = false;
+    bool calibratedTimestampsSupported = false;
+    bool rayTracingMaintenance1Supported = false;
+    bool memoryBudgetSupported = false;
+
+    // All device memory is allocated through the memory manager
+    MemoryManager memoryManager;
+
+    // Cameras of each eye at shutter open and close, see PushConstants
+    Buffer cameraBuffer{};
+    EyeCamera* camerasMapped = nullptr;
+    EyeCamera shutterCameras[2]{};
+
+    // Command buffer
+    vk::UniqueCommandPool commandPool;
+    vk::UniqueCommandBuffer commandBuffer;
+
+    // Jobs
+    // Command pools are not thread-safe, so each job thread has its own
+    std::unique_ptr<JobSystem> jobSystem;
+    std::vector<ThreadRecorder> threadRecorders;
+
+    // Swapchain
+    vk::SurfaceFormatKHR surfaceFormat;
+    vk::UniqueSwapchainKHR swapchain;
+    std::vector<vk::Image> swapchainImages;
+    std::vector<vk::UniqueImageView> swapchainImageViews;
+
+    // Offscreen render target of the server and the exporter, copied to
+    // the readback buffer at the end of frames that read it back. Frames
+    // of renderExtent fill the top-left corner of an image that keeps the
+    // largest size so far.
+    vk::Extent2D renderExtent{WIDTH, HEIGHT};
+    vk::Extent2D renderImageExtent{};
+    vk::UniqueImage renderImage;
+    DeviceMemory renderImageMemory;
+    uint32_t renderImageMemoryType = 0;
+    vk::UniqueImageView renderImageView;
+    Buffer renderReadback{};
+    const uint32_t* renderReadbackMapped = nullptr;
+    bool readBackRenderImage = true;
+
+    // Exported frames: the render target is shared with the consumer,
+    // ready is signaled for the consumer and released by it
+    vk::UniqueSemaphore exportReadySemaphore;
+    vk::UniqueSemaphore exportReleasedSemaphore;
+
+    // Streamed frames are copied, or converted to NV12, into the current
+    // slot and written from it by the writer thread
+    std::array<Buffer, STREAM_SLOT_COUNT> streamSlots{};
+    std::array<const uint8_t*, STREAM_SLOT_COUNT> streamSlotsMapped{};
+    std::array<InFlightFrame, STREAM_SLOT_COUNT> streamFrames{};
+    uint32_t streamSlot = 0;
+    vk::UniqueShaderModule streamShaderModule;
+    vk::UniquePipelineLayout streamPipelineLayout;
+    vk::UniquePipeline streamPipeline;
+#ifdef FRAME_STREAM_SUPPORTED
+    FrameStreamWriter streamWriter;
+#endif
+
+    // Scene
+    std::vector<std::string> scenePaths;
+    std::vector<Mesh> meshes;
+    std::vector<Buffer> vertexBuffers;
+    std::vector<Buffer> indexBuffers;
+
+    // Voxel grid, traced as one AABB per brick
+    VoxelGrid voxelGrid;
+    Buffer voxelAabbBuffer{};
+    Buffer voxelBrickBuffer{};
+    AccelStruct voxelAccel{};
+    double voxelBuildMs = 0.0;
+
+    // Curves, traced as one AABB per piece of a segment
+    Curves curves;
+    Buffer curveAabbBuffer{};
+    Buffer curveSegmentBuffer{};
+    Buffer curvePieceBuffer{};
+    AccelStruct curveAccel{};
+    double curveBuildMs = 0.0;
+
+    // Acceleration structure
+    std::vector<AccelStruct> bottomAccels;
+    AccelStruct topAccel{};
+
+    // Instances are written to the staging buffer and uploaded to the
+    // device-local instance buffer before the TLAS is refit.
+    // Each instance is a node of the scene graph; only the ranges of
+    // instances that moved are uploaded.
+    TransformSystem instanceTransforms;
+    SceneGraph sceneGraph;
+    bool sceneGraphUpdated = false;
+    // 3 per node animated by timelines. The voxel and curve nodes come
+    // after them and have none.
+    std::vector<float> restPositions;
+    // The staging buffer holds MotionInstances instead when the TLAS is
+    // built with motion.
+    Buffer instanceBuffer{};
+    Buffer instanceStagingBuffer{};
+    vk::AccelerationStructureInstanceKHR* instanceStagingMapped = nullptr;
+    MotionInstance* motionStagingMapped = nullptr;
+    vk::DeviceSize instanceStride = 0;
+    std::vector<InstanceRange> instanceUploadRanges;
+
+    // Motion blur without motion instances: the instance buffer holds
+    // timeSliceCount copies of the sliceInstanceCount instances, each
+    // evaluated at its own time of the shutter and only visible to rays
+    // with its mask bit.
+    // The transforms of the next frame at each key of the shutter, the
+    // slices or the two ends of the motion instances, are kept here
+    // while the GPU may still read the staging buffer, and written when
+    // it is recorded.
+    static constexpr uint32_t MAX_TIME_SLICES = 8;
+    uint32_t timeSliceCount = 1;
+    uint32_t sliceInstanceCount = 0;
+    std::vector<vk::TransformMatrixKHR> sliceTransforms;
+    std::vector<InstanceRange> sliceRanges;
+    std::vector<uint32_t> sliceInstances;
+
+    // Skinned characters
+    // Each character is a skinned copy of the first mesh with its own
+    // BLAS, refit every frame and rebuilt when it has deformed too much
+    // since its last build
+    static constexpr uint32_t JOINT_COUNT = 4;
+    uint32_t characterCount = 0;
+    uint32_t skinVertexCount = 0;
+    Buffer skinVertexBuffer{};
+    Buffer jointBuffer{};
+    vk::TransformMatrixKHR* jointsMapped = nullptr;
+    Buffer skinnedVertexBuffer{};
+    std::vector<AccelStruct> characterAccels;
+    std::vector<vk::TransformMatrixKHR> builtJoints;
+    std::vector<uint8_t> characterRebuilds;
+    uint32_t characterRebuildCount = 0;
+    vk::DeviceSize characterScratchStride = 0;
+    vk::DeviceAddress characterScratchAddress = 0;
+    vk::UniqueShaderModule skinShaderModule;
+    vk::UniquePipelineLayout skinPipelineLayout;
+    vk::UniquePipeline skinPipeline;
+
+    // Descriptor
+    vk::UniqueDescriptorPool descPool;
+    vk::UniqueDescriptorSetLayout descSetLayout;
+    vk::UniqueDescriptorSet descSet;
+
+    // Pipeline
+    vk::UniquePipeline pipeline;
+    vk::UniquePipelineLayout pipelineLayout;
+
+    // Shader binding table
+    std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
+    std::vector<vk::UniqueShaderModule> shaderModules;
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> shaderGroups;
+
+    Buffer sbt{};
+    vk::StridedDeviceAddressRegionKHR raygenRegion{};
+    vk::StridedDeviceAddressRegionKHR heatmapRaygenRegion{};
+    vk::StridedDeviceAddressRegionKHR missRegion{};
+    vk::StridedDeviceAddressRegionKHR hitRegion{};
+
+    // Debug visualization
+    PushConstants pushConstants{};
+    Buffer hitCounterReadback{};
+    HitCounters hitCounters{};
+    bool hitCountersValid = false;  // a heatmap frame has been drawn
+    uint32_t hitCounterPixelCount = 0;
+
+    // Stats
+    GpuProfiler gpuProfiler;
+    FrameStatsRing frameStats;
+#ifdef ENABLE_RAY_STATS
+    // Counters are read back this many frames after they are written
+    static constexpr uint32_t RAY_STATS_LATENCY = 3;
+    bool rayStatsEnabled = false;
+    std::array<Buffer, RAY_STATS_LATENCY> rayStatsReadback{};
+    std::array<const uint32_t*, RAY_STATS_LATENCY> rayStatsMapped{};
+#endif
+
+    // Frame graph
+    // Per-frame buffers (TLAS update scratch, counters) are transient
+    FrameGraph frameGraph;
+    FrameResource targetImageResource = 0;
+    FrameResource instanceStagingResource = 0;
+    FrameResource instanceBufferResource = 0;
+    FrameResource tlasResource = 0;
+    FrameResource tlasScratchResource = 0;
+    FrameResource skinnedVertexResource = 0;
+    FrameResource characterAccelResource = 0;
+    FrameResource characterScratchResource = 0;
+    FrameResource hitCounterResource = 0;
+    FrameResource hitReadbackResource = 0;
+    FrameResource renderReadbackResource = 0;
+    FrameResource streamPixelsResource = 0;
+    FrameResource streamReadbackResource = 0;
+#ifdef ENABLE_RAY_STATS
+    FrameResource rayStatsResource = 0;
+    FrameResource rayStatsReadbackResource = 0;
+#endif
+    uint32_t uploadInstancesPass = 0;
+    uint32_t skinPass = 0;
+    uint32_t refitBlasPass = 0;
+    uint32_t updateTlasPass = 0;
+    uint32_t resetCountersPass = 0;
+    uint32_t tracePass = 0;
+    uint32_t readbackPass = 0;
+    uint32_t copyImagePass = 0;
+    vk::DeviceAddress tlasScratchAddress = 0;
+
+    void initWindow() {
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+    }
+
+    void initVulkan() {
+        std::vector<const char*> layers = {
+            "VK_LAYER_KHRONOS_validation",
+        };
+
+        std::vector<const char*> deviceExtensions = {
+            // For ray tracing
+            VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME,
+            VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+            VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+            VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+            VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
+        };
+        if (!headless) {
+            deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        }
+        if (exporting) {
+            deviceExtensions.push_back(
+                VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME);
+            deviceExtensions.push_back(
+                VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME);
+        }
+
+        // Create instance, device, queue
+        // Ray tracing requires Vulkan 1.2 or later
+        startupProfiler.begin("Create instance");
+        instance =
+            vkutils::createInstance(VK_API_VERSION_1_2, layers, headless);
+        debugMessenger = vkutils::createDebugMessenger(*instance);
+        if (!headless) {
+            surface = vkutils::createSurface(*instance, window);
+        }
+
+        startupProfiler.begin("Pick device");
+        physicalDevice = vkutils::pickPhysicalDevice(  //
+            *instance, *surface, deviceExtensions);
+
+        queueFamilyIndex = vkutils::findGeneralQueueFamily(  //
+            physicalDevice, *surface);
+
+        // Optional features are chained into additionalFeatures
+        void* additionalFeatures = nullptr;
+
+        // Shader clock is optional and only used by the heatmap mode
+        vk::PhysicalDeviceShaderClockFeaturesKHR shaderClockFeatures{};
+        shaderClockSupported = vkutils::checkShaderClockSupport(physicalDevice);
+        if (shaderClockSupported) {
+            deviceExtensions.push_back(VK_KHR_SHADER_CLOCK_EXTENSION_NAME);
+            shaderClockFeatures.setShaderDeviceClock(VK_TRUE);
+            shaderClockFeatures.setPNext(additionalFeatures);
+            additionalFeatures = &shaderClockFeatures;
+        }
+
+        // Maintenance1 adds the BLAS pointer count query to the inspector
+        vk::PhysicalDeviceRayTracingMaintenance1FeaturesKHR
+            maintenance1Features{};
+        rayTracingMaintenance1Supported =
+            vkutils::checkRayTracingMaintenance1Support(physicalDevice);
+        if (rayTracingMaintenance1Supported) {
+            deviceExtensions.push_back(
+                VK_KHR_RAY_TRACING_MAINTENANCE_1_EXTENSION_NAME);
+            maintenance1Features.setRayTracingMaintenance1(VK_TRUE);
+            maintenance1Features.setPNext(additionalFeatures);
+            additionalFeatures = &maintenance1Features;
+        }
+
+        // Motion blur traces motion instances with the NV extension if
+        // the device has it, otherwise time slices
+        vk::PhysicalDeviceRayTracingMotionBlurFeaturesNV motionBlurFeatures{};
+        motionInstances =
+            motionBlur &&
+            vkutils::checkRayTracingMotionBlurSupport(physicalDevice);
+        if (motionInstances) {
+            deviceExtensions.push_back(
+                VK_NV_RAY_TRACING_MOTION_BLUR_EXTENSION_NAME);
+            motionBlurFeatures.setRayTracingMotionBlur(VK_TRUE);
+            motionBlurFeatures.setPNext(additionalFeatures);
+            additionalFeatures = &motionBlurFeatures;
+        }
+
+        // Calibrated timestamps align GPU passes with CPU work in traces
+        calibratedTimestampsSupported = vkutils::checkDeviceExtensionSupport(
+            physicalDevice, {VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME});
+        if (calibratedTimestampsSupported) {
+            deviceExtensions.push_back(
+                VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+        }
+
+        // Memory budget reports heap usage including other processes
+        memoryBudgetSupported = vkutils::checkDeviceExtensionSupport(
+            physicalDevice, {VK_EXT_MEMORY_BUDGET_EXTENSION_NAME});
+        if (memoryBudgetSupported) {
+            deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        }
+
+        startupProfiler.begin("Create device");
+        device = vkutils::createLogicalDevice(  //
+            physicalDevice, queueFamilyIndex, deviceExtensions,
+            additionalFeatures);
+
+        queue = device->getQueue(queueFamilyIndex, 0);
+
+        MemoryPolicy memoryPolicy{};
+        memoryPolicy.deviceLocalBudget =
+            vk::DeviceSize{options.memoryBudgetMiB} * 1024 * 1024;
+        memoryManager.init(physicalDevice, memoryBudgetSupported,
+                           memoryPolicy);
+        memoryManager.addBudgetCallback(
+            [](uint32_t heapIndex, const HeapBudget& heap) {
+                std::cerr << "Memory heap " << heapIndex << " at "
+                          << static_cast<int>(heap.getUsageRatio() * 100.0f)
+                          << "% of its budget.\n";
+            });
+
+        // Create command buffers
+        commandPool = vkutils::createCommandPool(*device, queueFamilyIndex);
+        commandBuffer = vkutils::createCommandBuffer(*device, *commandPool);
+
+        gpuProfiler.init(physicalDevice, *device, *commandPool, queue,
+                         queueFamilyIndex, calibratedTimestampsSupported);
+
+        // Create job threads
+        jobSystem = std::make_unique<JobSystem>(options.getWorkerCount());
+        threadRecorders.resize(jobSystem->getThreadCount());
+        for (auto& recorder : threadRecorders) {
+            recorder.init(*device, queueFamilyIndex);
+        }
+
+        // Create swapchain
+        // Specify images as storage images
+        if (!headless) {
+            startupProfiler.begin("Create swapchain");
+            surfaceFormat =
+                vkutils::chooseSurfaceFormat(physicalDevice, *surface);
+            swapchain = vkutils::createSwapchain(  //
+                physicalDevice, *device, *surface, queueFamilyIndex,
+                vk::ImageUsageFlagBits::eStorage, surfaceFormat,  //
+                WIDTH, HEIGHT);
+            swapchainImages = device->getSwapchainImagesKHR(*swapchain);
+            createSwapchainImageViews();
+        }
+
+        // Debug visualization
+        startupProfiler.begin("Create counters");
+        createHitCounterBuffers();
+#ifdef ENABLE_RAY_STATS
+        createRayStatsBuffers();
+#endif
+        if (stereo || motionBlur) {
+            createCameraBuffer();
+        }
+
+        // DescSet
+        startupProfiler.begin("Create desc set");
+        createDescriptorPool();
+        createDescSetLayout();
+        createDescriptorSet();
+
+        // Shader, pipeline and SBT are created by a job
+        // while the scene is loaded and AS are built
+        auto pipelineTask = jobSystem->run([this] {
+            trace::Scope scope{"Create pipeline"};
+            auto start = StartupProfiler::Clock::now();
+            prepareShaders();
+            auto loaded = StartupProfiler::Clock::now();
+            startupProfiler.record("Load shaders", start, loaded);
+            createRayTracingPipeline();
+            startupProfiler.record("Compile pipeline", loaded,
+                                   StartupProfiler::Clock::now());
+        });
+        auto sbtTask = jobSystem->then(pipelineTask, [this] {
+            trace::Scope scope{"Create SBT"};
+            auto start = StartupProfiler::Clock::now();
+            createShaderBindingTable();
+            startupProfiler.record("Create SBT", start,
+                                   StartupProfiler::Clock::now());
+        });
+
+        // Scene, AS
+        startupProfiler.begin("Load scene");
+        scenePaths = options.meshPaths;
+        meshes = loadScene(*jobSystem, scenePaths);
+        startupProfiler.begin("Create BLAS");
+        createBottomLevelAS();
+        if (!options.voxelPath.empty()) {
+            startupProfiler.begin("Create voxel BLAS");
+            createVoxelAS();
+        }
+        if (!options.curvePath.empty()) {
+            startupProfiler.begin("Create curve BLAS");
+            createCurveAS();
+        }
+        startupProfiler.begin("Create characters");
+        createCharacters();
+        startupProfiler.begin("Create TLAS");
+        createTopLevelAS();
+        startupProfiler.begin("Create frame graph");
+        createFrameGraph();
+        if (options.inspectAccels) {
+            inspectAccels();
+        }
+
+        startupProfiler.begin("Wait pipeline");
+        jobSystem->wait(sbtTask);
+        startupProfiler.end();
+
+        memoryManager.updateBudget();
+        memoryManager.printSummary();
+    }
+
+    void createSwapchainImageViews() {
+        for (auto image : swapchainImages) {
+            vkutils::setObjectName(*device, image, "Swapchain image");
+
+            vk::ImageViewCreateInfo createInfo{};
+            createInfo.setImage(image);
+            createInfo.setViewType(vk::ImageViewType::e2D);
+            createInfo.setFormat(surfaceFormat.format);
+            createInfo.setComponents(
+                {vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eG,
+                 vk::ComponentSwizzle::eB, vk::ComponentSwizzle::eA});
+            createInfo.setSubresourceRange(
+                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+            swapchainImageViews.push_back(
+                device->createImageViewUnique(createInfo));
+            vkutils::setObjectName(*device, *swapchainImageViews.back(),
+                                   "Swapchain image view");
+        }
+
+        tracedSubmit(
+            *device, *commandPool, queue, [&](vk::CommandBuffer commandBuffer) {
+                for (auto image : swapchainImages) {
+                    vkutils::setImageLayout(commandBuffer, image,  //
+                                            vk::ImageLayout::eUndefined,
+                                            vk::ImageLayout::ePresentSrcKHR);
+                }
+            });
+    }
+
+    void createBottomLevelAS(uint32_t meshIndex) {
+        const Mesh& mesh = meshes[meshIndex];
+
+        // Create vertex buffer and index buffer
+        vk::BufferUsageFlags bufferUsage{
+            vk::BufferUsageFlagBits::
+                eAccelerationStructureBuildInputReadOnlyKHR |
+            vk::BufferUsageFlagBits::eShaderDeviceAddress};
+        vk::MemoryPropertyFlags memoryProperty{
+            vk::MemoryPropertyFlagBits::eHostVisible |
+            vk::MemoryPropertyFlagBits::eHostCoherent};
+        Buffer& vertexBuffer = vertexBuffers[meshIndex];
+        Buffer& indexBuffer = indexBuffers[meshIndex];
+        vertexBuffer.init(memoryManager, *device,                 //
+                          mesh.vertices.size() * sizeof(Vertex),  //
+                          bufferUsage, memoryProperty,            //
+                          "Vertex buffer", mesh.vertices.data());
+        indexBuffer.init(memoryManager, *device,                  //
+                         mesh.indices.size() * sizeof(uint32_t),  //
+                         bufferUsage, memoryProperty,             //
+                         "Index buffer", mesh.indices.data());
+
+        // Create geometry
+        vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+        triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+        triangles.setVertexData(vertexBuffer.address);
+        triangles.setVertexStride(sizeof(Vertex));
+        triangles.setMaxVertex(static_cast<uint32_t>(mesh.vertices.size()));
+        triangles.setIndexType(vk::IndexType::eUint32);
+        triangles.setIndexData(indexBuffer.address);
+
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+        geometry.setGeometry({triangles});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+        // Create BLAS (built later)
+        bottomAccels[meshIndex].create(
+            memoryManager, *device,
+            vk::AccelerationStructureTypeKHR::eBottomLevel, geometry,
+            mesh.getTriangleCount(), "BLAS",
+            vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+                vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction);
+    }
+
+    // Builds all BLAS in waves that fit in the scratch budget. Each wave
+    // reuses one scratch buffer, and the previous wave is compacted in the
+    // same submission, so peak memory does not grow with the scene.
+    void createBottomLevelAS() {
+        uint32_t meshCount = static_cast<uint32_t>(meshes.size());
+        vertexBuffers.resize(meshCount);
+        indexBuffers.resize(meshCount);
+        bottomAccels.resize(meshCount);
+
+        // Create geometry buffers and BLAS in parallel
+        jobSystem->parallelFor(meshCount, 1, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                trace::Scope scope{"Create BLAS"};
+                createBottomLevelAS(i);
+            }
+        });
+
+        // Plan waves
+        vk::DeviceSize scratchAlignment =
+            vkutils::getAccelStructProps(physicalDevice)
+                .minAccelerationStructureScratchOffsetAlignment;
+        std::vector<vk::DeviceSize> scratchOffsets(meshCount);
+        std::vector<vk::DeviceSize> scratchSizes(meshCount);
+        for (uint32_t i = 0; i < meshCount; i++) {
+            scratchSizes[i] = vkutils::alignUp(
+                bottomAccels[i].buildSizes.buildScratchSize, scratchAlignment);
+        }
+        vk::DeviceSize scratchBudget =
+            vk::DeviceSize{options.scratchBudgetMiB} << 20;
+        std::vector<BuildWave> waves =
+            planBuildWaves(scratchSizes, scratchBudget);
+
+        vk::DeviceSize scratchSize = 0;
+        for (const auto& wave : waves) {
+            scratchSize = std::max(scratchSize, wave.scratchSize);
+            vk::DeviceSize offset = 0;
+            for (uint32_t i = wave.begin; i < wave.end; i++) {
+                scratchOffsets[i] = offset;
+                offset += scratchSizes[i];
+            }
+        }
+        Buffer scratchBuffer;
+        scratchBuffer.init(memoryManager, *device,
+                           scratchSize + scratchAlignment,
+                           vk::BufferUsageFlagBits::eStorageBuffer |
+                               vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                           vk::MemoryPropertyFlagBits::eDeviceLocal,
+                           "BLAS scratch");
+        vk::DeviceAddress scratchAddress =
+            vkutils::alignUp(scratchBuffer.address, scratchAlignment);
+
+        // Memory of all BLAS and scratch, for the summary
+        vk::DeviceSize residentSize = scratchSize + scratchAlignment;
+        vk::DeviceSize peakSize = residentSize;
+        vk::DeviceSize originalTotalSize = 0;
+        vk::DeviceSize compactedTotalSize = 0;
+
+        // The last iteration only compacts the last wave
+        BuildWave compactingWave{0, 0, 0};
+        std::vector<vk::DeviceSize> compactedSizes;
+        for (uint32_t w = 0; w <= waves.size(); w++) {
+            trace::Scope waveScope{"BLAS wave"};
+            BuildWave wave = w < waves.size() ? waves[w] : BuildWave{0, 0, 0};
+            uint32_t buildCount = wave.end - wave.begin;
+
+            // Record builds in parallel, using the pool of each job thread
+            std::vector<vk::CommandBuffer> buildCommandBuffers(buildCount);
+            jobSystem->parallelFor(
+                buildCount, 1, [&](uint32_t begin, uint32_t end) {
+                    ThreadRecorder& recorder =
+                        threadRecorders[JobSystem::getThreadIndex()];
+                    for (uint32_t i = begin; i < end; i++) {
+                        uint32_t index = wave.begin + i;
+                        vk::CommandBuffer commandBuffer =
+                            recorder.begin(*device);
+                        bottomAccels[index].recordBuild(
+                            commandBuffer,
+                            scratchAddress + scratchOffsets[index]);
+                        commandBuffer.end();
+                        buildCommandBuffers[i] = commandBuffer;
+                    }
+                });
+
+            vk::UniqueQueryPool queryPool;
+            std::vector<vk::AccelerationStructureKHR> builtAccels;
+            if (buildCount > 0) {
+                vk::QueryPoolCreateInfo createInfo{};
+                createInfo.setQueryType(
+                    vk::QueryType::eAccelerationStructureCompactedSizeKHR);
+                createInfo.setQueryCount(buildCount);
+                queryPool = device->createQueryPoolUnique(createInfo);
+            }
+            for (uint32_t i = wave.begin; i < wave.end; i++) {
+                builtAccels.push_back(*bottomAccels[i].accel);
+                residentSize +=
+                    bottomAccels[i].buildSizes.accelerationStructureSize;
+                originalTotalSize +=
+                    bottomAccels[i].buildSizes.accelerationStructureSize;
+            }
+            for (vk::DeviceSize compactedSize : compactedSizes) {
+                residentSize += compactedSize;
+                compactedTotalSize += compactedSize;
+            }
+            peakSize = std::max(peakSize, residentSize);
+
+            tracedSubmit(
+                *device, *commandPool, queue,
+                [&](vk::CommandBuffer commandBuffer) {
+                    // Compact the previous wave while this one builds
+                    if (!compactedSizes.empty()) {
+                        GpuProfiler::Scope scope{&gpuProfiler, commandBuffer,
+                                                 PASS_COMPACT_BLAS};
+                        for (uint32_t i = compactingWave.begin;
+                             i < compactingWave.end; i++) {
+                            bottomAccels[i].recordCompaction(
+                                memoryManager, *device, commandBuffer,
+                                compactedSizes[i - compactingWave.begin],
+                                "BLAS");
+                        }
+                    }
+                    if (buildCount == 0) {
+                        return;
+                    }
+
+                    GpuProfiler::Scope scope{&gpuProfiler, commandBuffer,
+                                             PASS_BUILD_BLAS};
+                    commandBuffer.resetQueryPool(*queryPool, 0, buildCount);
+                    commandBuffer.executeCommands(buildCommandBuffers);
+
+                    // Builds must finish before their sizes are queried and
+                    // before the next wave reuses the scratch buffer
+                    vk::MemoryBarrier barrier{
+                        vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+                        vk::AccessFlagBits::eAccelerationStructureReadKHR |
+                            vk::AccessFlagBits::
+                                eAccelerationStructureWriteKHR};
+                    commandBuffer.pipelineBarrier(
+                        vk::PipelineStageFlagBits::
+                            eAccelerationStructureBuildKHR,
+                        vk::PipelineStageFlagBits::
+                            eAccelerationStructureBuildKHR,  //
+                        {}, barrier, {}, {});
+                    commandBuffer.writeAccelerationStructuresPropertiesKHR(
+                        builtAccels,
+                        vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+                        *queryPool, 0);
+                });
+            gpuProfiler.resolve();
+            for (auto& recorder : threadRecorders) {
+                recorder.reset(*device);
+            }
+
+            // Free the originals of the compacted wave
+            for (uint32_t i = compactingWave.begin; i < compactingWave.end;
+                 i++) {
+                residentSize -=
+                    bottomAccels[i].buildSizes.accelerationStructureSize;
+                bottomAccels[i].finishCompaction();
+            }
+
+            compactingWave = wave;
+            compactedSizes.assign(buildCount, 0);
+            if (buildCount > 0) {
+                vk::Result result = device->getQueryPoolResults(
+                    *queryPool, 0, buildCount,
+                    sizeof(vk::DeviceSize) * buildCount, compactedSizes.data(),
+                    sizeof(vk::DeviceSize),
+                    vk::QueryResultFlagBits::e64 |
+                        vk::QueryResultFlagBits::eWait);
+                if (result != vk::Result::eSuccess) {
+                    std::cerr << "Failed to get compacted BLAS sizes.\n";
+                    std::abort();
+                }
+            }
+        }
+
+        auto toMiB = [](vk::DeviceSize size) {
+            return static_cast<double>(size) / (1024.0 * 1024.0);
+        };
+        std::cout << "BLAS build: " << meshCount << " BLAS in "
+                  << waves.size() << " waves, scratch " << toMiB(scratchSize)
+                  << " MiB, peak " << toMiB(peakSize) << " MiB, compacted "
+                  << toMiB(originalTotalSize) << " -> "
+                  << toMiB(compactedTotalSize) << " MiB\n";
+    }
+
+    // Builds the BLAS of the voxel grid from the AABBs of its bricks.
+    // The intersection shader finds the voxel hit inside a brick.
+    void createVoxelAS() {
+        trace::Scope traceScope{"createVoxelAS"};
+        voxelGrid = loadBricks(options.voxelPath);
+        if (voxelGrid.bricks.empty()) {
+            std::cerr << options.voxelPath << " has no voxels.\n";
+            std::abort();
+        }
+
+        // Brick i is primitive i
+        std::vector<Aabb> boxes = voxelGrid.computeBrickBounds();
+        std::vector<GpuBrick> bricks = voxelGrid.getGpuBricks();
+        vk::MemoryPropertyFlags memoryProperty{
+            vk::MemoryPropertyFlagBits::eHostVisible |
+            vk::MemoryPropertyFlagBits::eHostCoherent};
+        voxelAabbBuffer.init(
+            memoryManager, *device, boxes.size() * sizeof(Aabb),
+            vk::BufferUsageFlagBits::
+                    eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            memoryProperty, "Voxel AABB buffer", boxes.data());
+        voxelBrickBuffer.init(
+            memoryManager, *device, bricks.size() * sizeof(GpuBrick),
+            vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            memoryProperty, "Voxel brick buffer", bricks.data());
+        pushConstants.voxelBricks = voxelBrickBuffer.address;
+
+        vk::AccelerationStructureGeometryAabbsDataKHR aabbs{};
+        aabbs.setData(voxelAabbBuffer.address);
+        aabbs.setStride(sizeof(Aabb));
+
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eAabbs);
+        geometry.setGeometry({aabbs});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+        uint32_t brickCount = static_cast<uint32_t>(boxes.size());
+        voxelAccel.init(memoryManager, *device, *commandPool, queue,
+                        vk::AccelerationStructureTypeKHR::eBottomLevel,
+                        geometry, brickCount, "Voxel BLAS", &gpuProfiler);
+        voxelBuildMs = gpuProfiler.getDurationMs(PASS_BUILD_BLAS);
+        std::cout << "Voxel BLAS: " << voxelGrid.getVoxelCount()
+                  << " voxels in " << brickCount << " bricks, "
+                  << voxelAccel.size / 1024 << " KiB in " << voxelBuildMs
+                  << " ms\n";
+    }
+
+    // Builds the BLAS of the curves from the AABBs of their pieces.
+    // The intersection shader finds the strand hit inside a piece.
+    void createCurveAS() {
+        trace::Scope traceScope{"createCurveAS"};
+        curves = loadCurves(options.curvePath);
+        if (curves.segments.empty()) {
+            std::cerr << options.curvePath << " has no curves.\n";
+            std::abort();
+        }
+
+        // Subdivide chunks of segments in parallel, piece i is primitive i
+        constexpr uint32_t CHUNK_SIZE = 16384;
+        uint32_t segmentCount = static_cast<uint32_t>(curves.segments.size());
+        uint32_t chunkCount = (segmentCount + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::vector<std::vector<CurvePiece>> chunkPieces(chunkCount);
+        std::vector<std::vector<Aabb>> chunkBoxes(chunkCount);
+        jobSystem->parallelFor(
+            chunkCount, 1, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; i++) {
+                    trace::Scope scope{"subdivideCurves"};
+                    uint32_t last =
+                        std::min(segmentCount, (i + 1) * CHUNK_SIZE);
+                    subdivideCurves(curves, i * CHUNK_SIZE, last,
+                                    chunkPieces[i], chunkBoxes[i]);
+                }
+            });
+        std::vector<CurvePiece> pieces;
+        std::vector<Aabb> boxes;
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            pieces.insert(pieces.end(), chunkPieces[i].begin(),
+                          chunkPieces[i].end());
+            boxes.insert(boxes.end(), chunkBoxes[i].begin(),
+                         chunkBoxes[i].end());
+        }
+
+        vk::MemoryPropertyFlags memoryProperty{
+            vk::MemoryPropertyFlagBits::eHostVisible |
+            vk::MemoryPropertyFlagBits::eHostCoherent};
+        vk::BufferUsageFlags shaderUsage{
+            vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eShaderDeviceAddress};
+        curveAabbBuffer.init(
+            memoryManager, *device, boxes.size() * sizeof(Aabb),
+            vk::BufferUsageFlagBits::
+                    eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            memoryProperty, "Curve AABB buffer", boxes.data());
+        curveSegmentBuffer.init(
+            memoryManager, *device, segmentCount * sizeof(CurveSegment),
+            shaderUsage, memoryProperty, "Curve segment buffer",
+            curves.segments.data());
+        curvePieceBuffer.init(memoryManager, *device,
+                              pieces.size() * sizeof(CurvePiece),
+                              shaderUsage, memoryProperty,
+                              "Curve piece buffer", pieces.data());
+        pushConstants.curveSegments = curveSegmentBuffer.address;
+        pushConstants.curvePieces = curvePieceBuffer.address;
+
+        vk::AccelerationStructureGeometryAabbsDataKHR aabbs{};
+        aabbs.setData(curveAabbBuffer.address);
+        aabbs.setStride(sizeof(Aabb));
+
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eAabbs);
+        geometry.setGeometry({aabbs});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+        uint32_t pieceCount = static_cast<uint32_t>(pieces.size());
+        curveAccel.init(memoryManager, *device, *commandPool, queue,
+                        vk::AccelerationStructureTypeKHR::eBottomLevel,
+                        geometry, pieceCount, "Curve BLAS", &gpuProfiler);
+        curveBuildMs = gpuProfiler.getDurationMs(PASS_BUILD_BLAS);
+        std::cout << "Curve BLAS: " << segmentCount << " segments in "
+                  << pieceCount << " pieces, " << curveAccel.size / 1024
+                  << " KiB in " << curveBuildMs << " ms\n";
+    }
+
+    void createTopLevelAS() {
+        // Create instances (one per mesh by default)
+        std::vector<Aabb> instanceBounds = createInstanceBounds();
+        uint32_t instanceCount = static_cast<uint32_t>(instanceBounds.size());
+
+        // Buffer slot -> instance. Instances keep their index as custom
+        // index, so shaders see the same ids whichever order is used.
+        std::vector<uint32_t> instanceOrder(instanceCount);
+        std::iota(instanceOrder.begin(), instanceOrder.end(), 0);
+        if (options.mortonSort) {
+            trace::Scope scope{"Morton sort"};
+            auto start = std::chrono::steady_clock::now();
+            instanceOrder = computeMortonOrder(instanceBounds);
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            std::cout << "Morton sort: " << instanceCount << " instances in "
+                      << elapsed.count() << " ms\n";
+        }
+
+        uint32_t meshCount = static_cast<uint32_t>(bottomAccels.size());
+        const float rotation[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+        const float scale[3] = {1.0f, 1.0f, 1.0f};
+        for (uint32_t slot = 0; slot < instanceCount; slot++) {
+            uint32_t instance = instanceOrder[slot];
+            const AccelStruct& accel = bottomAccels[instance % meshCount];
+            const Aabb& meshBounds = meshes[instance % meshCount].bounds;
+            float position[3];
+            for (int axis = 0; axis < 3; axis++) {
+                position[axis] =
+                    instanceBounds[instance].min[axis] - meshBounds.min[axis];
+            }
+
+            instanceTransforms.add(accel.buffer.address, instance,
+                                   TRIANGLE_SBT_RECORD);
+            instanceTransforms.setPosition(slot, position[0], position[1],
+                                           position[2]);
+            uint32_t node = sceneGraph.addNode(SceneGraph::NONE, slot);
+            sceneGraph.setLocalTransform(node, position, rotation, scale);
+            restPositions.insert(restPositions.end(), position, position + 3);
+        }
+
+        // Characters stand on a grid behind the scene
+        const Aabb& characterBounds = meshes[0].bounds;
+        float spacing = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            spacing = std::max(spacing, characterBounds.max[axis] -
+                                            characterBounds.min[axis]);
+        }
+        spacing *= 1.5f;
+        uint32_t side = static_cast<uint32_t>(std::ceil(
+            std::sqrt(static_cast<float>(std::max(1u, characterCount)))));
+        for (uint32_t i = 0; i < characterCount; i++) {
+            uint32_t slot = instanceTransforms.size();
+            float position[3] = {
+                (float(i % side) - 0.5f * side) * spacing,
+                0.0f,
+                -float(i / side + 1) * spacing,
+            };
+            instanceTransforms.add(characterAccels[i].buffer.address,
+                                   instanceCount + i);
+            instanceTransforms.setPosition(slot, position[0], position[1],
+                                           position[2]);
+            uint32_t node = sceneGraph.addNode(SceneGraph::NONE, slot);
+            sceneGraph.setLocalTransform(node, position, rotation, scale);
+            restPositions.insert(restPositions.end(), position, position + 3);
+        }
+
+        // Voxels and curves stay where their files put them, so they have
+        // no rest position for timelines to animate
+        const std::pair<const AccelStruct*, uint32_t> proceduralAccels[] = {
+            {&voxelAccel, VOXEL_SBT_RECORD},
+            {&curveAccel, CURVE_SBT_RECORD},
+        };
+        for (const auto& [accel, sbtRecord] : proceduralAccels) {
+            if (!accel->accel) {
+                continue;
+            }
+            uint32_t slot = instanceTransforms.size();
+            const float position[3] = {0.0f, 0.0f, 0.0f};
+            instanceTransforms.add(accel->buffer.address, slot, sbtRecord);
+            uint32_t node = sceneGraph.addNode(SceneGraph::NONE, slot);
+            sceneGraph.setLocalTransform(node, position, rotation, scale);
+        }
+
+        timeSliceCount =
+            motionBlur && !motionInstances ? options.timeSliceCount : 1;
+        sliceInstanceCount = instanceTransforms.size();
+        uint32_t totalInstanceCount = sliceInstanceCount * timeSliceCount;
+        instanceStride = motionInstances
+                             ? sizeof(MotionInstance)
+                             : sizeof(vk::AccelerationStructureInstanceKHR);
+        vk::DeviceSize instancesSize = instanceStride * totalInstanceCount;
+        instanceStagingBuffer.init(
+            memoryManager, *device, instancesSize,
+            vk::BufferUsageFlagBits::eTransferSrc,
+            vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent,
+            "Instance staging buffer");
+        void* stagingMapped =
+            device->mapMemory(*instanceStagingBuffer.memory, 0, instancesSize);
+        if (motionInstances) {
+            // Motion instances start at rest between both ends
+            std::vector<vk::AccelerationStructureInstanceKHR> instances(
+                sliceInstanceCount);
+            instanceTransforms.writeInstances(*jobSystem, instances.data());
+            motionStagingMapped = static_cast<MotionInstance*>(stagingMapped);
+            for (uint32_t i = 0; i < sliceInstanceCount; i++) {
+                motionStagingMapped[i] = toMotionInstance(instances[i]);
+            }
+        } else {
+            // Time slices start as copies that only differ in their mask
+            instanceStagingMapped =
+                static_cast<vk::AccelerationStructureInstanceKHR*>(
+                    stagingMapped);
+            for (uint32_t slice = 0; slice < timeSliceCount; slice++) {
+                if (timeSliceCount > 1) {
+                    instanceTransforms.mask = 1u << slice;
+                }
+                instanceTransforms.writeInstances(
+                    *jobSystem,
+                    instanceStagingMapped + slice * sliceInstanceCount);
+            }
+            instanceTransforms.mask = 0xFF;
+        }
+        sliceTransforms.resize(
+            sliceInstanceCount * (motionInstances ? 2 : timeSliceCount));
+        pushConstants.timeSliceCount = timeSliceCount;
+        sceneGraph.update();
+        instanceBuffer.init(
+            memoryManager, *device, instancesSize,
+            vk::BufferUsageFlagBits::
+                    eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                vk::BufferUsageFlagBits::eTransferDst,
+            vk::MemoryPropertyFlagBits::eDeviceLocal, "Instance buffer");
+        tracedSubmit(
+            *device, *commandPool, queue, [&](vk::CommandBuffer commandBuffer) {
+                recordInstanceUpload(commandBuffer, {{0, totalInstanceCount}});
+
+                // AS builds read their inputs with shader read access
+                vk::MemoryBarrier barrier{vk::AccessFlagBits::eTransferWrite,
+                                          vk::AccessFlagBits::eShaderRead};
+                commandBuffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                    {}, barrier, {}, {});
+            });
+
+        // Create geometry
+        vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
+        instancesData.setArrayOfPointers(false);
+        instancesData.setData(instanceBuffer.address);
+
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+        geometry.setGeometry({instancesData});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+        // Create and build TLAS
+        // It is refit when instances change
+        uint32_t primitiveCount = totalInstanceCount;
+        vk::BuildAccelerationStructureFlagsKHR flags =
+            vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+            vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+        if (motionInstances) {
+            flags |= vk::BuildAccelerationStructureFlagBitsKHR::eMotionNV;
+        }
+        topAccel.init(memoryManager, *device, *commandPool, queue,
+                      vk::AccelerationStructureTypeKHR::eTopLevel, geometry,
+                      primitiveCount, "TLAS", &gpuProfiler, flags);
+        std::cout << "TLAS build: " << primitiveCount << " instances"
+                  << (options.mortonSort ? " (Morton sorted)" : "");
+        if (motionInstances) {
+            std::cout << " (motion instances)";
+        }
+        if (timeSliceCount > 1) {
+            std::cout << " (" << timeSliceCount << " time slices)";
+        }
+        std::cout << " in " << gpuProfiler.getDurationMs(PASS_BUILD_TLAS)
+                  << " ms\n";
+    }
+
+    // Returns the world bounds of every instance. Instance i uses mesh
+    // i % meshCount. With --instances the copies are placed on a grid in
+    // front of the camera in random order, so the insertion order has no
+    // spatial coherence.
+    std::vector<Aabb> createInstanceBounds() const {
+        uint32_t meshCount = static_cast<uint32_t>(meshes.size());
+        if (options.instanceCount == 0) {
+            std::vector<Aabb> bounds(meshCount);
+            for (uint32_t i = 0; i < meshCount; i++) {
+                bounds[i] = meshes[i].bounds;
+            }
+            return bounds;
+        }
+
+        float spacing = 0.0f;
+        for (const auto& mesh : meshes) {
+            for (int axis = 0; axis < 3; axis++) {
+                spacing = std::max(
+                    spacing, mesh.bounds.max[axis] - mesh.bounds.min[axis]);
+            }
+        }
+        spacing *= 1.5f;
+
+        uint32_t count = options.instanceCount;
+        uint32_t side = static_cast<uint32_t>(std::ceil(std::cbrt(count)));
+        std::vector<uint32_t> cells(count);
+        std::iota(cells.begin(), cells.end(), 0);
+        std::shuffle(cells.begin(), cells.end(), std::mt19937{1234});
+
+        std::vector<Aabb> bounds(count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t cell = cells[i];
+            float offset[3] = {
+                (float(cell % side) - 0.5f * side) * spacing,
+                (float(cell / side % side) - 0.5f * side) * spacing,
+                -float(cell / (side * side)) * spacing,
+            };
+            const Aabb& meshBounds = meshes[i % meshCount].bounds;
+            for (int axis = 0; axis < 3; axis++) {
+                bounds[i].min[axis] = meshBounds.min[axis] + offset[axis];
+                bounds[i].max[axis] = meshBounds.max[axis] + offset[axis];
+            }
+        }
+        return bounds;
+    }
+
+    // Prints the queried properties of every AS, largest first
+    void inspectAccels() {
+        AccelInspector inspector;
+        for (uint32_t i = 0; i < bottomAccels.size(); i++) {
+            const AccelStruct& accel = bottomAccels[i];
+            const std::string& path = meshes[i].name;
+            inspector.add(path.substr(path.find_last_of("/\\") + 1),
+                          *accel.accel, accel.buildInfo.type,
+                          accel.buildRangeInfo.primitiveCount,
+                          accel.buildInfo.flags, accel.size);
+        }
+        inspector.add("TLAS", *topAccel.accel, topAccel.buildInfo.type,
+                      topAccel.buildRangeInfo.primitiveCount,
+                      topAccel.buildInfo.flags, topAccel.size);
+        inspector.query(*device, *commandPool, queue,
+                        rayTracingMaintenance1Supported);
+        inspector.printTable();
+    }
+
+    // Creates the skinning pipeline and one BLAS per character, then
+    // skins and builds them in the rest pose of frame 0
+    void createCharacters() {
+        characterCount = options.characterCount;
+        if (characterCount == 0) {
+            return;
+        }
+        const Mesh& mesh = meshes[0];
+        skinVertexCount = static_cast<uint32_t>(mesh.vertices.size());
+
+        // Create buffers
+        std::vector<SkinVertex> skinVertices =
+            createSkinVertices(mesh, JOINT_COUNT);
+        skinVertexBuffer.init(
+            memoryManager, *device, sizeof(SkinVertex) * skinVertices.size(),
+            vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent,
+            "Skin vertices", skinVertices.data());
+        vk::DeviceSize jointsSize =
+            sizeof(vk::TransformMatrixKHR) * characterCount * JOINT_COUNT;
+        jointBuffer.init(memoryManager, *device, jointsSize,
+                         vk::BufferUsageFlagBits::eStorageBuffer |
+                             vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                         vk::MemoryPropertyFlagBits::eHostVisible |
+                             vk::MemoryPropertyFlagBits::eHostCoherent,
+                         "Joint transforms");
+        jointsMapped = static_cast<vk::TransformMatrixKHR*>(
+            device->mapMemory(*jointBuffer.memory, 0, jointsSize));
+        skinnedVertexBuffer.init(
+            memoryManager, *device,
+            sizeof(Vertex) * skinVertexCount * characterCount,
+            vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                vk::BufferUsageFlagBits::
+                    eAccelerationStructureBuildInputReadOnlyKHR,
+            vk::MemoryPropertyFlagBits::eDeviceLocal, "Skinned vertices");
+
+        // Create pipeline
+        // Buffers are passed as device addresses in push constants
+        skinShaderModule = vkutils::createShaderModule(
+            *device, SHADER_DIR + "skinning.comp.spv");
+        vk::PushConstantRange pushRange{};
+        pushRange.setOffset(0);
+        pushRange.setSize(sizeof(SkinPushConstants));
+        pushRange.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+        vk::PipelineLayoutCreateInfo layoutCreateInfo{};
+        layoutCreateInfo.setPushConstantRanges(pushRange);
+        skinPipelineLayout =
+            device->createPipelineLayoutUnique(layoutCreateInfo);
+        vk::ComputePipelineCreateInfo pipelineCreateInfo{};
+        pipelineCreateInfo.setLayout(*skinPipelineLayout);
+        pipelineCreateInfo.setStage({{},
+                                     vk::ShaderStageFlagBits::eCompute,
+                                     *skinShaderModule,
+                                     "main"});
+        auto result =
+            device->createComputePipelineUnique(nullptr, pipelineCreateInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to create skinning pipeline.\n";
+            std::abort();
+        }
+        skinPipeline = std::move(result.value);
+        vkutils::setObjectName(*device, *skinPipeline, "Skinning pipeline");
+
+        // Create BLAS
+        // Characters share the index buffer of the mesh
+        characterAccels.resize(characterCount);
+        vk::DeviceSize scratchAlignment =
+            vkutils::getAccelStructProps(physicalDevice)
+                .minAccelerationStructureScratchOffsetAlignment;
+        for (uint32_t i = 0; i < characterCount; i++) {
+            vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+            triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+            triangles.setVertexData(skinnedVertexBuffer.address +
+                                    sizeof(Vertex) * skinVertexCount * i);
+            triangles.setVertexStride(sizeof(Vertex));
+            triangles.setMaxVertex(skinVertexCount);
+            triangles.setIndexType(vk::IndexType::eUint32);
+            triangles.setIndexData(indexBuffers[0].address);
+
+            vk::AccelerationStructureGeometryKHR geometry{};
+            geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+            geometry.setGeometry({triangles});
+            geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+            AccelStruct& accel = characterAccels[i];
+            accel.create(
+                memoryManager, *device,
+                vk::AccelerationStructureTypeKHR::eBottomLevel, geometry,
+                mesh.getTriangleCount(), "Character BLAS",
+                vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace |
+                    vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
+            characterScratchStride = std::max(
+                {characterScratchStride,
+                 vkutils::alignUp(accel.buildSizes.buildScratchSize,
+                                  scratchAlignment),
+                 vkutils::alignUp(accel.buildSizes.updateScratchSize,
+                                  scratchAlignment)});
+        }
+
+        // Initial build
+        // Frames use transient scratch memory from the frame graph
+        builtJoints.resize(characterCount * JOINT_COUNT);
+        characterRebuilds.assign(characterCount, 1);
+        updateCharacters();
+        Buffer scratchBuffer;
+        scratchBuffer.init(memoryManager, *device,
+                           characterScratchStride * characterCount +
+                               scratchAlignment,
+                           vk::BufferUsageFlagBits::eStorageBuffer |
+                               vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                           vk::MemoryPropertyFlagBits::eDeviceLocal,
+                           "Character BLAS scratch");
+        tracedSubmit(
+            *device, *commandPool, queue, [&](vk::CommandBuffer commandBuffer) {
+                recordSkinning(commandBuffer);
+                vk::MemoryBarrier barrier{vk::AccessFlagBits::eShaderWrite,
+                                          vk::AccessFlagBits::eShaderRead};
+                commandBuffer.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eComputeShader,
+                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                    {}, barrier, {}, {});
+                recordCharacterRefit(
+                    commandBuffer,
+                    vkutils::alignUp(scratchBuffer.address, scratchAlignment));
+            });
+        std::cout << "Characters: " << characterCount << " x "
+                  << mesh.getTriangleCount() << " triangles, "
+                  << JOINT_COUNT << " joints\n";
+    }
+
+    // Poses the characters for the current frame and picks the ones to
+    // rebuild: those that moved more than the threshold from the pose
+    // their BLAS was built in, since refitting stretches its boxes
+    void updateCharacters() {
+        if (characterCount == 0) {
+            return;
+        }
+        trace::Scope traceScope{"updateCharacters"};
+        characterRebuildCount = 0;
+        for (uint32_t i = 0; i < characterCount; i++) {
+            vk::TransformMatrixKHR* joints = jointsMapped + i * JOINT_COUNT;
+            vk::TransformMatrixKHR* built = &builtJoints[i * JOINT_COUNT];
+            computeJointTransforms(meshes[0].bounds, JOINT_COUNT,
+                                   animationTime, 0.7f * i, joints);
+            if (!characterRebuilds[i]) {
+                characterRebuilds[i] =
+                    measureDeformation(meshes[0].bounds, JOINT_COUNT, joints,
+                                       built) > options.rebuildThreshold;
+            }
+            if (characterRebuilds[i]) {
+                std::copy(joints, joints + JOINT_COUNT, built);
+                characterRebuildCount++;
+            }
+        }
+    }
+
+    void recordSkinning(vk::CommandBuffer commandBuffer) {
+        SkinPushConstants constants{};
+        constants.vertices = skinVertexBuffer.address;
+        constants.joints = jointBuffer.address;
+        constants.positions = skinnedVertexBuffer.address;
+        constants.vertexCount = skinVertexCount;
+        constants.characterCount = characterCount;
+        constants.jointCount = JOINT_COUNT;
+
+        commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                   *skinPipeline);
+        commandBuffer.pushConstants(*skinPipelineLayout,
+                                    vk::ShaderStageFlagBits::eCompute, 0,
+                                    sizeof(SkinPushConstants), &constants);
+        uint32_t threadCount = skinVertexCount * characterCount;
+        commandBuffer.dispatch((threadCount + 63) / 64, 1, 1);
+    }
+
+    // Each character uses its own part of the scratch memory, so the
+    // builds do not need barriers between them
+    void recordCharacterRefit(vk::CommandBuffer commandBuffer,
+                              vk::DeviceAddress scratchAddress) {
+        for (uint32_t i = 0; i < characterCount; i++) {
+            vk::DeviceAddress scratch =
+                scratchAddress + characterScratchStride * i;
+            if (characterRebuilds[i]) {
+                characterAccels[i].recordBuild(commandBuffer, scratch);
+                characterRebuilds[i] = 0;
+            } else {
+                characterAccels[i].recordUpdate(commandBuffer, scratch);
+            }
+        }
+    }
+
+    // Recomputes moved scene graph nodes and writes their instances to
+    // the staging buffer, along with the shutter keys prepared ahead
+    // The scene graph may already have been updated ahead of recording,
+    // its dirty ranges stay valid until the next update
+    void updateInstances() {
+        uint32_t sliceCount = static_cast<uint32_t>(sliceInstances.size());
+        jobSystem->parallelFor(
+            sliceCount, SceneGraph::CHUNK_SIZE,
+            [&](uint32_t begin, uint32_t end) {
+                for (uint32_t k = begin; k < end; k++) {
+                    uint32_t i = sliceInstances[k];
+                    if (!motionInstances) {
+                        streamTransform(sliceTransforms[i],
+                                        instanceStagingMapped[i].transform);
+                        continue;
+                    }
+                    // Keys 0 and 1 are the ends of the motion instances
+                    auto& motion =
+                        motionStagingMapped[i % sliceInstanceCount]
+                            .instance.data.matrixMotionInstance;
+                    streamTransform(sliceTransforms[i],
+                                    i < sliceInstanceCount
+                                        ? motion.transformT0
+                                        : motion.transformT1);
+                }
+                finishStreamingStores();
+            });
+        instanceUploadRanges.insert(instanceUploadRanges.end(),
+                                    sliceRanges.begin(), sliceRanges.end());
+        sliceRanges.clear();
+        sliceInstances.clear();
+
+        // Motion instances only move through the shutter keys
+        if (motionInstances ||
+            (!sceneGraphUpdated && sceneGraph.update() == 0)) {
+            return;
+        }
+        sceneGraphUpdated = false;
+        sceneGraph.writeDirtyInstances(*jobSystem, instanceStagingMapped);
+        const auto& ranges = sceneGraph.getDirtyInstanceRanges();
+        instanceUploadRanges.insert(instanceUploadRanges.end(),
+                                    ranges.begin(), ranges.end());
+    }
+
+    void recordInstanceUpload(vk::CommandBuffer commandBuffer,
+                              const std::vector<InstanceRange>& ranges) {
+        std::vector<vk::BufferCopy> regions;
+        for (const InstanceRange& range : ranges) {
+            vk::DeviceSize offset = instanceStride * range.first;
+            regions.push_back({offset, offset, instanceStride * range.count});
+        }
+        commandBuffer.copyBuffer(*instanceStagingBuffer.buffer,
+                                 *instanceBuffer.buffer, regions);
+    }
+
+    void recordTopLevelASUpdate(vk::CommandBuffer commandBuffer) {
+        topAccel.recordUpdate(commandBuffer, tlasScratchAddress);
+    }
+
+    // Declares the passes of a frame and what they access; barriers
+    // between them are derived by the frame graph
+    void createFrameGraph() {
+        using Stage = vk::PipelineStageFlagBits;
+        using Access = vk::AccessFlagBits;
+        using Usage = vk::BufferUsageFlagBits;
+
+        // Resources
+        // The server renders to an offscreen image and reads it back.
+        // Exported frames are released to the consumer in the general
+        // layout. Streamed frames are read back into a ring slot.
+        if (headless) {
+            targetImageResource = frameGraph.importImage(
+                "Render target", vk::ImageLayout::eUndefined,
+                exporting ? vk::ImageLayout::eGeneral
+                          : vk::ImageLayout::eTransferSrcOptimal,
+                getRenderLayerCount());
+            if (exporting) {
+                frameGraph.setImageRelease(targetImageResource,
+                                           queueFamilyIndex,
+                                           VK_QUEUE_FAMILY_EXTERNAL);
+            }
+            renderReadbackResource = frameGraph.importBuffer(
+                "Render target readback", Stage::eHost, Access::eHostRead);
+            if (streaming) {
+                streamReadbackResource = frameGraph.importBuffer(
+                    "Stream readback", Stage::eHost, Access::eHostRead);
+                streamPixelsResource = frameGraph.createBuffer(
+                    "Stream pixels",
+                    vk::DeviceSize{sizeof(uint32_t)} * options.streamWidth *
+                        options.streamHeight,
+                    Usage::eStorageBuffer | Usage::eTransferDst);
+            }
+        } else {
+            targetImageResource = frameGraph.importImage(
+                "Swapchain image", vk::ImageLayout::ePresentSrcKHR,
+                vk::ImageLayout::ePresentSrcKHR);
+        }
+        instanceStagingResource =
+            frameGraph.importBuffer("Instance staging buffer");
+        instanceBufferResource = frameGraph.importBuffer("Instance buffer");
+        tlasResource = frameGraph.importBuffer("TLAS");
+        vk::DeviceSize scratchAlignment =
+            vkutils::getAccelStructProps(physicalDevice)
+                .minAccelerationStructureScratchOffsetAlignment;
+        tlasScratchResource = frameGraph.createBuffer(
+            "TLAS update scratch",
+            topAccel.buildSizes.updateScratchSize + scratchAlignment,
+            Usage::eStorageBuffer);
+        skinnedVertexResource = frameGraph.importBuffer("Skinned vertices");
+        characterAccelResource = frameGraph.importBuffer("Character BLAS");
+        characterScratchResource = frameGraph.createBuffer(
+            "Character BLAS scratch",
+            characterScratchStride * characterCount + scratchAlignment,
+            Usage::eStorageBuffer);
+
+        // Header followed by 2 counters per pixel of the largest render
+        // target so far
+        hitCounterPixelCount = std::max(
+            hitCounterPixelCount, renderExtent.width * renderExtent.height);
+        hitCounterResource = frameGraph.createBuffer(
+            "Hit counters",
+            sizeof(HitCounters) +
+                sizeof(uint32_t) * 2 * vk::DeviceSize{hitCounterPixelCount},
+            Usage::eStorageBuffer | Usage::eTransferSrc | Usage::eTransferDst);
+        hitReadbackResource = frameGraph.importBuffer(
+            "Hit counter readback", Stage::eHost, Access::eHostRead);
+#ifdef ENABLE_RAY_STATS
+        rayStatsResource = frameGraph.createBuffer(
+            "Ray stats", sizeof(uint32_t) * RAY_TYPE_COUNT,
+            Usage::eStorageBuffer | Usage::eTransferSrc | Usage::eTransferDst);
+        rayStatsReadbackResource = frameGraph.importBuffer(
+            "Ray stats readback", Stage::eHost, Access::eHostRead);
+#endif
+
+        // Passes
+        uploadInstancesPass = frameGraph.addPass(
+            PASS_UPLOAD_INSTANCES,
+            {{instanceStagingResource, Stage::eTransfer, Access::eTransferRead},
+             {instanceBufferResource, Stage::eTransfer,
+              Access::eTransferWrite}},
+            [this](auto cb) {
+                recordInstanceUpload(cb, instanceUploadRanges);
+            });
+
+        // Characters are skinned and refit before the TLAS update,
+        // which reads the bounds of their BLAS
+        std::vector<ResourceAccess> updateTlasAccesses = {
+            {instanceBufferResource, Stage::eAccelerationStructureBuildKHR,
+             Access::eShaderRead},
+            {tlasResource, Stage::eAccelerationStructureBuildKHR,
+             Access::eAccelerationStructureWriteKHR},
+            {tlasScratchResource, Stage::eAccelerationStructureBuildKHR,
+             Access::eAccelerationStructureReadKHR |
+                 Access::eAccelerationStructureWriteKHR}};
+        if (characterCount > 0) {
+            skinPass = frameGraph.addPass(
+                PASS_SKIN,
+                {{skinnedVertexResource, Stage::eComputeShader,
+                  Access::eShaderWrite}},
+                [this](auto cb) { recordSkinning(cb); });
+            refitBlasPass = frameGraph.addPass(
+                PASS_REFIT_BLAS,
+                {{skinnedVertexResource, Stage::eAccelerationStructureBuildKHR,
+                  Access::eShaderRead},
+                 {characterAccelResource,
+                  Stage::eAccelerationStructureBuildKHR,
+                  Access::eAccelerationStructureWriteKHR},
+                 {characterScratchResource,
+                  Stage::eAccelerationStructureBuildKHR,
+                  Access::eAccelerationStructureReadKHR |
+                      Access::eAccelerationStructureWriteKHR}},
+                [this](auto cb) {
+                    recordCharacterRefit(cb, characterScratchAddress);
+                });
+            updateTlasAccesses.push_back(
+                {characterAccelResource, Stage::eAccelerationStructureBuildKHR,
+                 Access::eAccelerationStructureReadKHR});
+        }
+        updateTlasPass =
+            frameGraph.addPass(PASS_UPDATE_TLAS, updateTlasAccesses,
+                               [this](auto cb) { recordTopLevelASUpdate(cb); });
+
+        std::vector<ResourceAccess> resetAccesses = {
+            {hitCounterResource, Stage::eTransfer, Access::eTransferWrite}};
+        std::vector<ResourceAccess> traceAccesses = {
+            {tlasResource, Stage::eRayTracingShaderKHR,
+             Access::eAccelerationStructureReadKHR},
+            {targetImageResource, Stage::eRayTracingShaderKHR,
+             Access::eShaderWrite, vk::ImageLayout::eGeneral},
+            {hitCounterResource, Stage::eRayTracingShaderKHR,
+             Access::eShaderRead | Access::eShaderWrite}};
+        std::vector<ResourceAccess> readbackAccesses = {
+            {hitCounterResource, Stage::eTransfer, Access::eTransferRead},
+            {hitReadbackResource, Stage::eTransfer, Access::eTransferWrite}};
+        if (characterCount > 0) {
+            traceAccesses.push_back({characterAccelResource,
+                                     Stage::eRayTracingShaderKHR,
+                                     Access::eAccelerationStructureReadKHR});
+        }
+#ifdef ENABLE_RAY_STATS
+        resetAccesses.push_back(
+            {rayStatsResource, Stage::eTransfer, Access::eTransferWrite});
+        traceAccesses.push_back({rayStatsResource, Stage::eRayTracingShaderKHR,
+                                 Access::eShaderRead | Access::eShaderWrite});
+        readbackAccesses.push_back(
+            {rayStatsResource, Stage::eTransfer, Access::eTransferRead});
+        readbackAccesses.push_back({rayStatsReadbackResource, Stage::eTransfer,
+                                    Access::eTransferWrite});
+#endif
+        resetCountersPass =
+            frameGraph.addPass(PASS_RESET_COUNTERS, resetAccesses,
+                               [this](auto cb) { recordCounterReset(cb); });
+        tracePass = frameGraph.addPass(PASS_TRACE, traceAccesses,
+                                       [this](auto cb) { recordTrace(cb); });
+        readbackPass =
+            frameGraph.addPass(PASS_READBACK, readbackAccesses,
+                               [this](auto cb) { recordReadback(cb); });
+        if (headless) {
+            copyImagePass = frameGraph.addPass(
+                PASS_COPY_IMAGE,
+                {{targetImageResource, Stage::eTransfer, Access::eTransferRead,
+                  vk::ImageLayout::eTransferSrcOptimal},
+                 {renderReadbackResource, Stage::eTransfer,
+                  Access::eTransferWrite}},
+                [this](auto cb) {
+                    recordImageCopy(cb, *renderReadback.buffer);
+                });
+        }
+
+        // RGBA frames are copied straight into the stream slot, NV12
+        // frames are converted from a copy of the image
+        if (streaming && options.streamFormat == StreamFormat::RGBA) {
+            frameGraph.addPass(
+                PASS_COPY_STREAM,
+                {{targetImageResource, Stage::eTransfer, Access::eTransferRead,
+                  vk::ImageLayout::eTransferSrcOptimal},
+                 {streamReadbackResource, Stage::eTransfer,
+                  Access::eTransferWrite}},
+                [this](auto cb) {
+                    recordImageCopy(cb, *streamSlots[streamSlot].buffer);
+                });
+        } else if (streaming) {
+            frameGraph.addPass(
+                PASS_COPY_STREAM,
+                {{targetImageResource, Stage::eTransfer, Access::eTransferRead,
+                  vk::ImageLayout::eTransferSrcOptimal},
+                 {streamPixelsResource, Stage::eTransfer,
+                  Access::eTransferWrite}},
+                [this](auto cb) {
+                    recordImageCopy(cb,
+                                    frameGraph.getBuffer(streamPixelsResource));
+                });
+            frameGraph.addPass(
+                PASS_CONVERT_STREAM,
+                {{streamPixelsResource, Stage::eComputeShader,
+                  Access::eShaderRead},
+                 {streamReadbackResource, Stage::eComputeShader,
+                  Access::eShaderWrite}},
+                [this](auto cb) { recordStreamConversion(cb); });
+        }
+
+        frameGraph.compile(memoryManager, *device);
+        if (options.frameGraphReport) {
+            frameGraph.printSummary();
+        }
+        tlasScratchAddress =
+            vkutils::alignUp(frameGraph.getBufferAddress(tlasScratchResource),
+                             scratchAlignment);
+        if (characterCount > 0) {
+            characterScratchAddress = vkutils::alignUp(
+                frameGraph.getBufferAddress(characterScratchResource),
+                scratchAlignment);
+        }
+    }
+
+    // Totals of the last heatmap frame
+    void printHitCounters() const {
+        if (!hitCountersValid) {
+            return;
+        }
+        uint64_t ticks = uint64_t{hitCounters.traversalTicksHigh} << 32 |
+                         hitCounters.traversalTicksLow;
+        std::cout << "rays: " << hitCounters.rays
+                  << ", closest hits: " << hitCounters.closestHits
+                  << ", any hits: " << hitCounters.anyHits
+                  << ", traversal ticks: " << ticks << '\n';
+    }
+
+    // The counters themselves are transient frame graph buffers
+    void createHitCounterBuffers() {
+        hitCounterReadback.init(memoryManager, *device, sizeof(HitCounters),
+                                vk::BufferUsageFlagBits::eTransferDst,
+                                vk::MemoryPropertyFlagBits::eHostVisible |
+                                    vk::MemoryPropertyFlagBits::eHostCoherent,
+                                "Hit counter readback");
+
+        // Cost is measured in clock ticks if available, otherwise in hits
+        // including the candidate triangles of the any-hit shader
+        pushConstants.heatmapScale =
+            shaderClockSupported ? 1.0f / 20000.0f : 1.0f / 32.0f;
+    }
+
+    void createCameraBuffer() {
+        vk::DeviceSize size = sizeof(EyeCamera) * eyeCount * 2;
+        cameraBuffer.init(memoryManager, *device, size,
+                          vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                          vk::MemoryPropertyFlagBits::eHostVisible |
+                              vk::MemoryPropertyFlagBits::eHostCoherent,
+                          "Cameras");
+        camerasMapped = static_cast<EyeCamera*>(
+            device->mapMemory(*cameraBuffer.memory, 0, size));
+        pushConstants.cameras = cameraBuffer.address;
+    }
+
+    // Stereo eyes look in parallel from eyeDistance apart along the
+    // camera right. Without motion blur the camera of the push constants
+    // is used at both ends of the shutter. Written when a frame is
+    // recorded, as the previous frame has finished reading them by then.
+    void updateCameras() {
+        EyeCamera center{};
+        std::copy(pushConstants.cameraOrigin, pushConstants.cameraOrigin + 4,
+                  center.origin);
+        std::copy(pushConstants.cameraForward,
+                  pushConstants.cameraForward + 4, center.forward);
+        std::copy(pushConstants.cameraRight, pushConstants.cameraRight + 4,
+                  center.right);
+        std::copy(pushConstants.cameraDown, pushConstants.cameraDown + 4,
+                  center.down);
+        for (uint32_t eye = 0; eye < eyeCount; eye++) {
+            for (uint32_t end = 0; end < 2; end++) {
+                EyeCamera& camera = camerasMapped[eye * 2 + end];
+                camera = motionBlur ? shutterCameras[end] : center;
+                if (!stereo) {
+                    continue;
+                }
+                const float* right = camera.right;
+                float rightLength = std::sqrt(right[0] * right[0] +
+                                              right[1] * right[1] +
+                                              right[2] * right[2]);
+                float offset = (eye == 0 ? -0.5f : 0.5f) *
+                               options.eyeDistance / rightLength;
+                for (int axis = 0; axis < 3; axis++) {
+                    camera.origin[axis] += right[axis] * offset;
+                }
+            }
+        }
+    }
+
+#ifdef ENABLE_RAY_STATS
+    void createRayStatsBuffers() {
+        // Counters are aggregated with subgroup operations in raygen shaders
+        rayStatsEnabled = vkutils::checkSubgroupSupport(
+            physicalDevice, vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::SubgroupFeatureFlagBits::eBasic |
+                vk::SubgroupFeatureFlagBits::eArithmetic);
+        if (!rayStatsEnabled) {
+            std::cerr << "Ray stats disabled: subgroup arithmetic is not "
+                         "supported in raygen shaders.\n";
+            return;
+        }
+
+        vk::DeviceSize size = sizeof(uint32_t) * RAY_TYPE_COUNT;
+        for (uint32_t i = 0; i < RAY_STATS_LATENCY; i++) {
+            rayStatsReadback[i].init(
+                memoryManager, *device, size,
+                vk::BufferUsageFlagBits::eTransferDst,
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                    vk::MemoryPropertyFlagBits::eHostCoherent,
+                "Ray stats readback");
+            rayStatsMapped[i] = static_cast<const uint32_t*>(
+                device->mapMemory(*rayStatsReadback[i].memory, 0, size));
+        }
+    }
+
+    void readRayStats() {
+        if (!rayStatsEnabled || frame + 1 < RAY_STATS_LATENCY) {
+            return;
+        }
+
+        // The oldest slot was written RAY_STATS_LATENCY - 1 frames ago
+        uint64_t readFrame = frame + 1 - RAY_STATS_LATENCY;
+        FrameStats* stats = frameStats.find(readFrame);
+        if (!stats) {
+            return;
+        }
+        const uint32_t* counters =
+            rayStatsMapped[readFrame % RAY_STATS_LATENCY];
+        for (uint32_t type = 0; type < RAY_TYPE_COUNT; type++) {
+            stats->rays[type] = counters[type];
+        }
+        stats->raysValid = true;
+    }
+#endif
+
+    void addShader(uint32_t shaderIndex,
+                   const std::string& filename,
+                   vk::ShaderStageFlagBits stage) {
+        shaderModules[shaderIndex] =
+            vkutils::createShaderModule(*device, SHADER_DIR + filename);
+        shaderStages[shaderIndex].setStage(stage);
+        shaderStages[shaderIndex].setModule(*shaderModules[shaderIndex]);
+        shaderStages[shaderIndex].setPName("main");
+    }
+
+    void prepareShaders() {
+        // Create shader modules and shader stages
+        uint32_t raygenShader = 0;
+        uint32_t missShader = 1;
+        uint32_t chitShader = 2;
+        uint32_t ahitShader = 3;
+        uint32_t heatmapShader = 4;
+        uint32_t voxelIntShader = 5;
+        uint32_t proceduralChitShader = 6;
+        uint32_t curveIntShader = 7;
+        shaderStages.resize(8);
+        shaderModules.resize(8);
+
+        std::string raygenFile = "app_raygen.rgen.spv";
+#ifdef ENABLE_RAY_STATS
+        if (rayStatsEnabled) {
+            raygenFile = "app_raygen_stats.rgen.spv";
+        }
+#endif
+        // Stereo and motion instance frames are not counted by ray stats
+        if (stereo) {
+            raygenFile = motionInstances ? "app_raygen_stereo_motion.rgen.spv"
+                                         : "app_raygen_stereo.rgen.spv";
+        } else if (motionInstances) {
+            raygenFile = "app_raygen_motion.rgen.spv";
+        }
+        addShader(raygenShader, raygenFile,  //
+                  vk::ShaderStageFlagBits::eRaygenKHR);
+        addShader(missShader, "miss.rmiss.spv",  //
+                  vk::ShaderStageFlagBits::eMissKHR);
+        addShader(chitShader, "app_closesthit.rchit.spv",
+                  vk::ShaderStageFlagBits::eClosestHitKHR);
+        addShader(ahitShader, "anyhit.rahit.spv",
+                  vk::ShaderStageFlagBits::eAnyHitKHR);
+        addShader(heatmapShader,
+                  shaderClockSupported ? "heatmap_clock.rgen.spv"
+                                       : "heatmap.rgen.spv",
+                  vk::ShaderStageFlagBits::eRaygenKHR);
+        addShader(voxelIntShader, "voxels.rint.spv",
+                  vk::ShaderStageFlagBits::eIntersectionKHR);
+        addShader(proceduralChitShader, "procedural.rchit.spv",
+                  vk::ShaderStageFlagBits::eClosestHitKHR);
+        addShader(curveIntShader, "curves.rint.spv",
+                  vk::ShaderStageFlagBits::eIntersectionKHR);
+
+        // Create shader groups
+        // Hit groups are in the order of their SBT records
+        uint32_t raygenGroup = 0;
+        uint32_t missGroup = 1;
+        uint32_t hitGroup = 2 + TRIANGLE_SBT_RECORD;
+        uint32_t voxelHitGroup = 2 + VOXEL_SBT_RECORD;
+        uint32_t curveHitGroup = 2 + CURVE_SBT_RECORD;
+        uint32_t heatmapGroup = 5;
+        shaderGroups.resize(6);
+
+        // Raygen group
+        shaderGroups[raygenGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eGeneral);
+        shaderGroups[raygenGroup].setGeneralShader(raygenShader);
+        shaderGroups[raygenGroup].setClosestHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[raygenGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[raygenGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
+
+        // Miss group
+        shaderGroups[missGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eGeneral);
+        shaderGroups[missGroup].setGeneralShader(missShader);
+        shaderGroups[missGroup].setClosestHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[missGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[missGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
+
+        // Hit group
+        shaderGroups[hitGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup);
+        shaderGroups[hitGroup].setGeneralShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[hitGroup].setClosestHitShader(chitShader);
+        shaderGroups[hitGroup].setAnyHitShader(ahitShader);
+        shaderGroups[hitGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
+
+        // Voxel hit group
+        shaderGroups[voxelHitGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup);
+        shaderGroups[voxelHitGroup].setGeneralShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[voxelHitGroup].setClosestHitShader(proceduralChitShader);
+        shaderGroups[voxelHitGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[voxelHitGroup].setIntersectionShader(voxelIntShader);
+
+        // Curve hit group
+        shaderGroups[curveHitGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup);
+        shaderGroups[curveHitGroup].setGeneralShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[curveHitGroup].setClosestHitShader(proceduralChitShader);
+        shaderGroups[curveHitGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[curveHitGroup].setIntersectionShader(curveIntShader);
+
+        // Heatmap raygen group
+        shaderGroups[heatmapGroup].setType(
+            vk::RayTracingShaderGroupTypeKHR::eGeneral);
+        shaderGroups[heatmapGroup].setGeneralShader(heatmapShader);
+        shaderGroups[heatmapGroup].setClosestHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[heatmapGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
+        shaderGroups[heatmapGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
+    }
+
+    void createDescriptorPool() {
+        std::vector<vk::DescriptorPoolSize> poolSizes = {
+            {vk::DescriptorType::eAccelerationStructureKHR, 1},
+            {vk::DescriptorType::eStorageImage, 1},
+            {vk::DescriptorType::eStorageBuffer, 2},
+        };
+
+        vk::DescriptorPoolCreateInfo createInfo{};
+        createInfo.setPoolSizes(poolSizes);
+        createInfo.setMaxSets(1);
+        createInfo.setFlags(
+            vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+        descPool = device->createDescriptorPoolUnique(createInfo);
+    }
+
+    void createDescSetLayout() {
+        std::vector<vk::DescriptorSetLayoutBinding> bindings(3);
+        // [0]: For AS
+        bindings[0].setBinding(0);
+        bindings[0].setDescriptorType(
+            vk::DescriptorType::eAccelerationStructureKHR);
+        bindings[0].setDescriptorCount(1);
+        bindings[0].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+        // [1]: For storage image
+        bindings[1].setBinding(1);
+        bindings[1].setDescriptorType(vk::DescriptorType::eStorageImage);
+        bindings[1].setDescriptorCount(1);
+        bindings[1].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+        // [2]: For hit counters
+        bindings[2].setBinding(2);
+        bindings[2].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+        bindings[2].setDescriptorCount(1);
+        bindings[2].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR |
+                                  vk::ShaderStageFlagBits::eClosestHitKHR |
+                                  vk::ShaderStageFlagBits::eAnyHitKHR);
+#ifdef ENABLE_RAY_STATS
+        // [3]: For ray stats
+        if (rayStatsEnabled) {
+            bindings.emplace_back();
+            bindings[3].setBinding(3);
+            bindings[3].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+            bindings[3].setDescriptorCount(1);
+            bindings[3].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+        }
+#endif
+
+        vk::DescriptorSetLayoutCreateInfo createInfo{};
+        createInfo.setBindings(bindings);
+        descSetLayout = device->createDescriptorSetLayoutUnique(createInfo);
+    }
+
+    void createDescriptorSet() {
+        vk::DescriptorSetAllocateInfo allocateInfo{};
+        allocateInfo.setDescriptorPool(*descPool);
+        allocateInfo.setSetLayouts(*descSetLayout);
+        descSet = std::move(
+            device->allocateDescriptorSetsUnique(allocateInfo).front());
+    }
+
+    void createRayTracingPipeline() {
+        // Create pipeline layout
+        vk::PushConstantRange pushRange{};
+        pushRange.setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR |
+                                vk::ShaderStageFlagBits::eClosestHitKHR |
+                                vk::ShaderStageFlagBits::eAnyHitKHR |
+                                vk::ShaderStageFlagBits::eIntersectionKHR);
+        pushRange.setSize(sizeof(PushConstants));
+
+        vk::PipelineLayoutCreateInfo layoutCreateInfo{};
+        layoutCreateInfo.setSetLayouts(*descSetLayout);
+        layoutCreateInfo.setPushConstantRanges(pushRange);
+        pipelineLayout = device->createPipelineLayoutUnique(layoutCreateInfo);
+        vkutils::setObjectName(*device, *pipelineLayout,
+                               "Ray tracing pipeline layout");
+
+        // Create pipeline
+        vk::RayTracingPipelineCreateInfoKHR pipelineCreateInfo{};
+        if (motionInstances) {
+            pipelineCreateInfo.setFlags(
+                vk::PipelineCreateFlagBits::eRayTracingAllowMotionNV);
+        }
+        pipelineCreateInfo.setLayout(*pipelineLayout);
+        pipelineCreateInfo.setStages(shaderStages);
+        pipelineCreateInfo.setGroups(shaderGroups);
+        pipelineCreateInfo.setMaxPipelineRayRecursionDepth(1);
+        auto result = device->createRayTracingPipelineKHRUnique(
+            nullptr, nullptr, pipelineCreateInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to create ray tracing pipeline.\n";
+            std::abort();
+        }
+        pipeline = std::move(result.value);
+        vkutils::setObjectName(*device, *pipeline, "Ray tracing pipeline");
+    }
+
+    void createShaderBindingTable() {
+        // Get RT props
+        vk::PhysicalDeviceRayTracingPipelinePropertiesKHR rtProperties =
+            vkutils::getRayTracingProps(physicalDevice);
+        uint32_t handleSize = rtProperties.shaderGroupHandleSize;
+        uint32_t handleAlignment = rtProperties.shaderGroupHandleAlignment;
+        uint32_t baseAlignment = rtProperties.shaderGroupBaseAlignment;
+        uint32_t handleSizeAligned =
+            vkutils::alignUp(handleSize, handleAlignment);
+
+        // Set strides and sizes
+        uint32_t raygenShaderCount = 2;  // default and heatmap
+        uint32_t missShaderCount = 1;
+        uint32_t hitShaderCount = 3;  // triangles, voxels and curves
+
+        // Each raygen region must contain exactly 1 record,
+        // so raygen shaders are placed in separate regions
+        raygenRegion.setStride(
+            vkutils::alignUp(handleSizeAligned, baseAlignment));
+        raygenRegion.setSize(raygenRegion.stride);
+        heatmapRaygenRegion.setStride(raygenRegion.stride);
+        heatmapRaygenRegion.setSize(raygenRegion.size);
+
+        missRegion.setStride(handleSizeAligned);
+        missRegion.setSize(vkutils::alignUp(missShaderCount * handleSizeAligned,
+                                            baseAlignment));
+
+        hitRegion.setStride(handleSizeAligned);
+        hitRegion.setSize(vkutils::alignUp(hitShaderCount * handleSizeAligned,
+                                           baseAlignment));
+
+        // Create SBT
+        vk::DeviceSize sbtSize = raygenRegion.size + heatmapRaygenRegion.size +
+                                 missRegion.size + hitRegion.size;
+        sbt.init(memoryManager, *device, sbtSize,
+                 vk::BufferUsageFlagBits::eShaderBindingTableKHR |
+                     vk::BufferUsageFlagBits::eTransferSrc |
+                     vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                 vk::MemoryPropertyFlagBits::eHostVisible |
+                     vk::MemoryPropertyFlagBits::eHostCoherent,
+                 "SBT");
+
+        // Get shader group handles
+        uint32_t handleCount =
+            raygenShaderCount + missShaderCount + hitShaderCount;
+        uint32_t handleStorageSize = handleCount * handleSize;
+        std::vector<uint8_t> handleStorage(handleStorageSize);
+        auto result = device->getRayTracingShaderGroupHandlesKHR(
+            *pipeline, 0, handleCount, handleStorageSize, handleStorage.data());
+        if (result != vk::Result::eSuccess) {
+            std::cerr << "Failed to get ray tracing shader group handles.\n";
+            std::abort();
+        }
+
+        // Copy handles
+        uint32_t handleIndex = 0;
+        uint8_t* sbtHead =
+            static_cast<uint8_t*>(device->mapMemory(*sbt.memory, 0, sbtSize));
+
+        uint8_t* dstPtr = sbtHead;
+        auto copyHandle = [&](uint32_t index) {
+            std::memcpy(dstPtr, handleStorage.data() + handleSize * index,
+                        handleSize);
+        };
+
+        // SBT layout: raygen | heatmap raygen | miss | hit
+        vk::DeviceSize heatmapOffset = raygenRegion.size;
+        vk::DeviceSize missOffset = heatmapOffset + heatmapRaygenRegion.size;
+        vk::DeviceSize hitOffset = missOffset + missRegion.size;
+
+        // Raygen
+        copyHandle(handleIndex++);
+
+        // Miss
+        dstPtr = sbtHead + missOffset;
+        for (uint32_t c = 0; c < missShaderCount; c++) {
+            copyHandle(handleIndex++);
+            dstPtr += missRegion.stride;
+        }
+
+        // Hit
+        dstPtr = sbtHead + hitOffset;
+        for (uint32_t c = 0; c < hitShaderCount; c++) {
+            copyHandle(handleIndex++);
+            dstPtr += hitRegion.stride;
+        }
+
+        // Heatmap raygen (last shader group)
+        dstPtr = sbtHead + heatmapOffset;
+        copyHandle(handleIndex++);
+
+        device->unmapMemory(*sbt.memory);
+
+        raygenRegion.setDeviceAddress(sbt.address);
+        heatmapRaygenRegion.setDeviceAddress(sbt.address + heatmapOffset);
+        missRegion.setDeviceAddress(sbt.address + missOffset);
+        hitRegion.setDeviceAddress(sbt.address + hitOffset);
+    }
+
+    void updateDescriptorSet(vk::ImageView imageView) {
+        std::vector<vk::WriteDescriptorSet> writes(3);
+
+        // [0]: For AS
+        vk::WriteDescriptorSetAccelerationStructureKHR accelInfo{};
+        accelInfo.setAccelerationStructures(*topAccel.accel);
+        writes[0].setDstSet(*descSet);
+        writes[0].setDstBinding(0);
+        writes[0].setDescriptorCount(1);
+        writes[0].setDescriptorType(
+            vk::DescriptorType::eAccelerationStructureKHR);
+        writes[0].setPNext(&accelInfo);
+
+        // [0]: For storage image
+        vk::DescriptorImageInfo imageInfo{};
+        imageInfo.setImageView(imageView);
+        imageInfo.setImageLayout(vk::ImageLayout::eGeneral);
+        writes[1].setDstSet(*descSet);
+        writes[1].setDstBinding(1);
+        writes[1].setDescriptorType(vk::DescriptorType::eStorageImage);
+        writes[1].setImageInfo(imageInfo);
+
+        // [2]: For hit counters
+        vk::DescriptorBufferInfo counterInfo{};
+        counterInfo.setBuffer(frameGraph.getBuffer(hitCounterResource));
+        counterInfo.setOffset(0);
+        counterInfo.setRange(VK_WHOLE_SIZE);
+        writes[2].setDstSet(*descSet);
+        writes[2].setDstBinding(2);
+        writes[2].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+        writes[2].setBufferInfo(counterInfo);
+
+#ifdef ENABLE_RAY_STATS
+        // [3]: For ray stats
+        vk::DescriptorBufferInfo rayStatsInfo{};
+        if (rayStatsEnabled) {
+            rayStatsInfo.setBuffer(frameGraph.getBuffer(rayStatsResource));
+            rayStatsInfo.setOffset(0);
+            rayStatsInfo.setRange(VK_WHOLE_SIZE);
+            writes.emplace_back();
+            writes[3].setDstSet(*descSet);
+            writes[3].setDstBinding(3);
+            writes[3].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+            writes[3].setBufferInfo(rayStatsInfo);
+        }
+#endif
+
+        // Update
+        device->updateDescriptorSets(writes, nullptr);
+    }
+
+    bool useCounters() const {
+#ifdef ENABLE_RAY_STATS
+        if (rayStatsEnabled) {
+            return true;
+        }
+#endif
+        return pushConstants.debugMode != 0;
+    }
+
+    void recordCounterReset(vk::CommandBuffer commandBuffer) {
+        if (pushConstants.debugMode != 0) {
+            commandBuffer.fillBuffer(frameGraph.getBuffer(hitCounterResource),
+                                     0, sizeof(HitCounters), 0);
+        }
+#ifdef ENABLE_RAY_STATS
+        if (rayStatsEnabled) {
+            commandBuffer.fillBuffer(frameGraph.getBuffer(rayStatsResource),
+                                     0, VK_WHOLE_SIZE, 0);
+        }
+#endif
+    }
+
+    void recordTrace(vk::CommandBuffer commandBuffer) {
+        // Bind pipeline
+        commandBuffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR,
+                                   *pipeline);
+
+        // Bind desc set
+        commandBuffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eRayTracingKHR,  // pipelineBindPoint
+            *pipelineLayout,                        // layout
+            0,                                      // firstSet
+            *descSet,                               // descSets
+            nullptr                                 // dynamicOffsets
+        );
+
+        // Push constants
+        commandBuffer.pushConstants(
+            *pipelineLayout,
+            vk::ShaderStageFlagBits::eRaygenKHR |
+                vk::ShaderStageFlagBits::eClosestHitKHR |
+                vk::ShaderStageFlagBits::eAnyHitKHR |
+                vk::ShaderStageFlagBits::eIntersectionKHR,
+            0, sizeof(PushConstants), &pushConstants);
+
+        // Trace rays
+        bool heatmap = pushConstants.debugMode != 0;
+        commandBuffer.traceRaysKHR(                          //
+            heatmap ? heatmapRaygenRegion : raygenRegion,  // raygen
+            missRegion,                                    // miss
+            hitRegion,                                     // hit
+            {},                                            // callable
+            renderExtent.width, renderExtent.height,       // width, height
+            eyeCount                                       // depth
+        );
+    }
+
+    void recordReadback(vk::CommandBuffer commandBuffer) {
+        if (pushConstants.debugMode != 0) {
+            vk::BufferCopy region{0, 0, sizeof(HitCounters)};
+            commandBuffer.copyBuffer(frameGraph.getBuffer(hitCounterResource),
+                                     *hitCounterReadback.buffer, region);
+        }
+#ifdef ENABLE_RAY_STATS
+        if (rayStatsEnabled) {
+            vk::BufferCopy region{0, 0, sizeof(uint32_t) * RAY_TYPE_COUNT};
+            commandBuffer.copyBuffer(
+                frameGraph.getBuffer(rayStatsResource),
+                *rayStatsReadback[frame % RAY_STATS_LATENCY].buffer, region);
+        }
+#endif
+    }
+
+    // Copies the render target into buffer as tightly packed rows, one
+    // layer after the other
+    void recordImageCopy(vk::CommandBuffer commandBuffer, vk::Buffer buffer) {
+        vk::BufferImageCopy region{};
+        region.setImageSubresource(
+            {vk::ImageAspectFlagBits::eColor, 0, 0, getRenderLayerCount()});
+        region.setImageExtent({renderExtent.width, renderExtent.height, 1});
+        commandBuffer.copyImageToBuffer(
+            *renderImage, vk::ImageLayout::eTransferSrcOptimal, buffer, region);
+    }
+
+    void recordStreamConversion(vk::CommandBuffer commandBuffer) {
+        StreamConvertPushConstants constants{};
+        constants.pixels = frameGraph.getBufferAddress(streamPixelsResource);
+        constants.frame = streamSlots[streamSlot].address;
+        constants.width = renderExtent.width;
+        constants.height = renderExtent.height;
+
+        commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                   *streamPipeline);
+        commandBuffer.pushConstants(*streamPipelineLayout,
+                                    vk::ShaderStageFlagBits::eCompute, 0,
+                                    sizeof(StreamConvertPushConstants),
+                                    &constants);
+        uint32_t threadCount =
+            (renderExtent.width / 4) * (renderExtent.height / 2);
+        commandBuffer.dispatch((threadCount + 63) / 64, 1, 1);
+    }
+
+    // Records each pass into a secondary command buffer on the job threads
+    void recordPasses(const std::vector<FramePass*>& passes,
+                      std::vector<ThreadRecorder>& recorders) {
+        for (auto& recorder : recorders) {
+            recorder.reset(*device);
+        }
+        uint32_t passCount = static_cast<uint32_t>(passes.size());
+        jobSystem->parallelFor(passCount, 1, [&](uint32_t begin, uint32_t end) {
+            ThreadRecorder& recorder = recorders[JobSystem::getThreadIndex()];
+            for (uint32_t i = begin; i < end; i++) {
+                FramePass& pass = *passes[i];
+                trace::Scope scope{pass.name};
+                pass.commandBuffer = recorder.begin(*device);
+                pass.record(pass.commandBuffer);
+                pass.commandBuffer.end();
+            }
+        });
+    }
+
+    // A frame in flight records into its own command buffers and takes no
+    // timestamps, which the frames in flight would overwrite
+    void recordCommandBuffer(vk::Image image, InFlightFrame* inFlight) {
+        vk::CommandBuffer frameCommandBuffer =
+            inFlight ? *inFlight->commandBuffer : *commandBuffer;
+        bool upload = !instanceUploadRanges.empty();
+        frameGraph.setPassEnabled(uploadInstancesPass, upload);
+        frameGraph.setPassEnabled(updateTlasPass,
+                                  upload || characterCount > 0);
+        frameGraph.setPassEnabled(resetCountersPass, useCounters());
+        frameGraph.setPassEnabled(readbackPass, useCounters());
+        if (headless) {
+            frameGraph.setPassEnabled(copyImagePass, readBackRenderImage);
+        }
+        frameGraph.setImage(targetImageResource, image);
+        recordPasses(frameGraph.getEnabledPasses(),
+                     inFlight ? inFlight->threadRecorders : threadRecorders);
+
+        // Begin
+        frameCommandBuffer.begin(vk::CommandBufferBeginInfo{});
+
+        // The frames in flight share the render target and the counters,
+        // so each one waits for the previous frame on the queue
+        if (inFlight) {
+            vk::MemoryBarrier barrier{
+                vk::AccessFlagBits::eMemoryWrite,
+                vk::AccessFlagBits::eMemoryRead |
+                    vk::AccessFlagBits::eMemoryWrite};
+            frameCommandBuffer.pipelineBarrier(
+                vk::PipelineStageFlagBits::eAllCommands,
+                vk::PipelineStageFlagBits::eAllCommands, {}, barrier, {}, {});
+        }
+
+        // Execute passes in order with the barriers between them,
+        // including the swapchain image layout transitions
+        frameGraph.execute(frameCommandBuffer,
+                           inFlight ? nullptr : &gpuProfiler);
+
+        // End
+        frameCommandBuffer.end();
+        instanceUploadRanges.clear();
+    }
+
+    // Measures CPU recording time of 1 to 64 trace passes,
+    // on the main thread only and on all job threads
+    void benchmarkRecording() {
+        constexpr uint32_t repeatCount = 20;
+        std::cout << "passes  serial ms  parallel ms  speedup\n";
+        for (uint32_t passCount = 1; passCount <= 64; passCount *= 2) {
+            std::vector<FramePass> passes(
+                passCount, {PASS_TRACE, [this](auto cb) { recordTrace(cb); }});
+            std::vector<FramePass*> passPointers;
+            for (auto& pass : passes) {
+                passPointers.push_back(&pass);
+            }
+
+            double serialMs = 0.0;
+            double parallelMs = 0.0;
+            for (uint32_t i = 0; i < repeatCount; i++) {
+                auto start = std::chrono::steady_clock::now();
+                threadRecorders[0].reset(*device);
+                for (auto& pass : passes) {
+                    pass.commandBuffer = threadRecorders[0].begin(*device);
+                    pass.record(pass.commandBuffer);
+                    pass.commandBuffer.end();
+                }
+                auto middle = std::chrono::steady_clock::now();
+                recordPasses(passPointers, threadRecorders);
+                auto end = std::chrono::steady_clock::now();
+
+                serialMs += std::chrono::duration<double, std::milli>(
+                                middle - start)
+                                .count();
+                parallelMs +=
+                    std::chrono::duration<double, std::milli>(end - middle)
+                        .count();
+            }
+            serialMs /= repeatCount;
+            parallelMs /= repeatCount;
+            std::cout << std::setw(6) << passCount << std::fixed
+                      << std::setprecision(3) << std::setw(11) << serialMs
+                      << std::setw(13) << parallelMs << std::setw(9)
+                      << serialMs / parallelMs << "\n";
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+    // Updates the scene and records the frame rendering to image. The
+    // descriptor set of a frame in flight must already be written, as the
+    // previous frames may still use it.
+    void recordFrame(vk::Image image,
+                     vk::ImageView imageView,
+                     InFlightFrame* inFlight = nullptr) {
+        trace::Scope scope{"Record"};
+        if (!batching) {
+            animationTime = frame / 60.0f;
+            if (motionBlur) {
+                prepareAnimatedFrame();
+            }
+        }
+        memoryManager.updateBudget();
+        updateInstances();
+        updateCharacters();
+        if (stereo || motionBlur) {
+            updateCameras();
+        }
+        if (!inFlight) {
+            updateDescriptorSet(imageView);
+        }
+        recordCommandBuffer(image, inFlight);
+    }
+
+    void drawFrame() {
+        trace::Scope frameScope{"drawFrame"};
+        std::cout << frame << '\n';
+        auto frameStart = std::chrono::steady_clock::now();
+
+        // Create semaphore
+        vk::UniqueSemaphore imageAvailableSemaphore =
+            device->createSemaphoreUnique({});
+
+        // Acquire next image
+        uint32_t imageIndex = 0;
+        {
+            trace::Scope scope{"Acquire"};
+            auto result = device->acquireNextImageKHR(
+                *swapchain, std::numeric_limits<uint64_t>::max(),
+                *imageAvailableSemaphore);
+            if (result.result != vk::Result::eSuccess) {
+                std::cerr << "Failed to acquire next image.\n";
+                std::abort();
+            }
+            imageIndex = result.value;
+        }
+
+        recordFrame(swapchainImages[imageIndex],
+                    *swapchainImageViews[imageIndex]);
+
+        // Submit command buffer
+        {
+            trace::Scope scope{"Submit"};
+            vk::PipelineStageFlags waitStage{
+                vk::PipelineStageFlagBits::eTopOfPipe};
+            vk::SubmitInfo submitInfo{};
+            submitInfo.setWaitDstStageMask(waitStage);
+            submitInfo.setCommandBuffers(*commandBuffer);
+            submitInfo.setWaitSemaphores(*imageAvailableSemaphore);
+            queue.submit(submitInfo);
+        }
+
+        // Wait
+        {
+            trace::Scope scope{"Wait"};
+            queue.waitIdle();
+        }
+        gpuProfiler.resolve();
+
+        // Keep the heatmap totals of the frame, printed on request
+        if (pushConstants.debugMode != 0) {
+            void* mappedPtr = device->mapMemory(*hitCounterReadback.memory, 0,
+                                                sizeof(HitCounters));
+            std::memcpy(&hitCounters, mappedPtr, sizeof(HitCounters));
+            device->unmapMemory(*hitCounterReadback.memory);
+            hitCountersValid = true;
+        }
+
+        // Present
+        {
+            trace::Scope scope{"Present"};
+            vk::PresentInfoKHR presentInfo{};
+            presentInfo.setSwapchains(*swapchain);
+            presentInfo.setImageIndices(imageIndex);
+            if (queue.presentKHR(presentInfo) != vk::Result::eSuccess) {
+                std::cerr << "Failed to present.\n";
+                std::abort();
+            }
+        }
+
+        // Report startup once the first frame is presented
+        if (!startupProfiler.firstFrameMarked()) {
+            startupProfiler.markFirstFrame();
+            startupProfiler.printSummary();
+            if (!options.startupTracePath.empty()) {
+                startupProfiler.writeChromeTrace(options.startupTracePath);
+            }
+        }
+
+        // Record frame stats
+        std::chrono::duration<double, std::milli> frameTime =
+            std::chrono::steady_clock::now() - frameStart;
+        FrameStats& stats = frameStats.push(frame);
+        stats.cpuTimeMs = frameTime.count();
+        stats.gpuTimeMs = gpuProfiler.getDurationMs(PASS_TRACE);
+        stats.deformGpuTimeMs = gpuProfiler.getDurationMs(PASS_SKIN) +
+                                gpuProfiler.getDurationMs(PASS_REFIT_BLAS);
+        stats.blasRebuildCount = characterRebuildCount;
+        const FrameGraphStats& graphStats = frameGraph.getStats();
+        stats.barrierCount = graphStats.barrierCount;
+        stats.dependencyCount = graphStats.dependencyCount;
+        stats.transientBytes = graphStats.transientSize;
+        stats.dedicatedBytes = graphStats.dedicatedSize;
+#ifdef ENABLE_RAY_STATS
+        readRayStats();
+#endif
+
+        frame++;
+    }
+
+    // Renders to the window until it is closed or --frames is reached.
+    // H toggles the heatmap and C prints its totals.
+    void runWindow() {
+        startupProfiler.begin("Init window");
+        initWindow();
+        initVulkan();
+        if (options.recordBenchmark) {
+            benchmarkRecording();
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            return;
+        }
+        startupProfiler.begin("First frame");
+
+        bool heatmapKeyDown = false;
+        bool countersKeyDown = false;
+        while (!glfwWindowShouldClose(window)) {
+            if (options.frameCount > 0 && frame >= options.frameCount) {
+                break;
+            }
+
+            glfwPollEvents();
+
+            // Toggle heatmap mode with H key
+            bool keyDown = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+            if (keyDown && !heatmapKeyDown) {
+                pushConstants.debugMode ^= 1;
+            }
+            heatmapKeyDown = keyDown;
+
+            // Print the heatmap totals of the last frame with C key
+            keyDown = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+            if (keyDown && !countersKeyDown) {
+                printHitCounters();
+            }
+            countersKeyDown = keyDown;
+
+            drawFrame();
+        }
+        device->waitIdle();
+        printHitCounters();
+
+        if (!options.benchmarkPath.empty()) {
+            frameStats.writeBenchmarkJson(options.benchmarkPath);
+        }
+        if (!options.tracePath.empty()) {
+            trace::Tracer::get().writeChromeTrace(options.tracePath);
+        }
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+
+    // Initializes Vulkan for the modes without a window and reports how
+    // long startup took
+    void initHeadless() {
+        initVulkan();
+        startupProfiler.end();
+        startupProfiler.printSummary();
+        if (!options.startupTracePath.empty()) {
+            startupProfiler.writeChromeTrace(options.startupTracePath);
+        }
+    }
+
+    // Initializes Vulkan without a window and serves render jobs.
+    // Startup, pipeline creation and AS builds happen before the first
+    // job, so they are not part of any job latency.
+    void runServer() {
+#ifdef SOCKETS_SUPPORTED
+        initHeadless();
+        serveRenderJobs(options.serverSocketPath, [this](const RenderJob& job) {
+            return renderJob(job);
+        });
+#else
+        std::cerr << "Server mode requires POSIX sockets.\n";
+        std::abort();
+#endif
+    }
+
+    // Initializes Vulkan without a window and exports frames to one
+    // consumer process. The render target and two semaphores are shared
+    // with the consumer, so frames reach it without a copy through host
+    // memory, and the next frame is traced once the consumer released the
+    // image. Every few frames the image is also read back here to check
+    // the checksum computed by the consumer. With --export-check the
+    // consumer is started here and every frame is checked.
+    void runExport() {
+#ifdef SOCKETS_SUPPORTED
+        constexpr uint64_t CHECK_FRAMES = 60;
+        uint64_t verifyInterval = options.exportCheck ? 1 : 30;
+        uint64_t frameCount = options.frameCount;
+        if (options.exportCheck && frameCount == 0) {
+            frameCount = CHECK_FRAMES;
+        }
+        initHeadless();
+        if (!vkutils::checkExternalFdSupport(
+                physicalDevice, RENDER_TARGET_FORMAT, RENDER_TARGET_USAGE)) {
+            std::cerr << "Failed to export the render target as a file "
+                         "descriptor.\n";
+            std::abort();
+        }
+        resizeRenderTarget(WIDTH, HEIGHT);
+        vk::ExportSemaphoreCreateInfo exportInfo{
+            vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd};
+        vk::SemaphoreCreateInfo semaphoreCreateInfo{};
+        semaphoreCreateInfo.setPNext(&exportInfo);
+        exportReadySemaphore =
+            device->createSemaphoreUnique(semaphoreCreateInfo);
+        exportReleasedSemaphore =
+            device->createSemaphoreUnique(semaphoreCreateInfo);
+
+        Socket server = Socket::listen(options.exportSocketPath);
+        std::cout << "Waiting for a consumer on " << options.exportSocketPath
+                  << "\n";
+        pid_t consumerPid = -1;
+        if (options.exportCheck) {
+            consumerPid = spawnFrameConsumer(options.executablePath,
+                                             options.exportSocketPath);
+            if (consumerPid < 0) {
+                std::abort();
+            }
+        }
+        Socket consumer = server.accept();
+        if (!consumer.isOpen() || !sendExportSetup(consumer)) {
+            std::cerr << "Failed to send the render target to the "
+                         "consumer.\n";
+            std::abort();
+        }
+
+        uint64_t exportedCount = 0;
+        uint64_t verifiedCount = 0;
+        uint64_t mismatchCount = 0;
+        MessageHeader header{};
+        std::vector<uint8_t> payload;
+        auto start = std::chrono::steady_clock::now();
+        while (frameCount == 0 || exportedCount < frameCount) {
+            trace::Scope frameScope{"exportFrame"};
+            readBackRenderImage = exportedCount % verifyInterval == 0;
+            recordFrame(*renderImage, *renderImageView);
+
+            // Nothing touches the image before the consumer is done with
+            // the previous frame
+            FrameReady ready{exportedCount, getSteadyTimeNs()};
+            {
+                trace::Scope scope{"Submit"};
+                vk::PipelineStageFlags waitStage{
+                    vk::PipelineStageFlagBits::eAllCommands};
+                vk::SubmitInfo submitInfo{};
+                if (exportedCount > 0) {
+                    submitInfo.setWaitSemaphores(*exportReleasedSemaphore);
+                    submitInfo.setWaitDstStageMask(waitStage);
+                }
+                submitInfo.setCommandBuffers(*commandBuffer);
+                submitInfo.setSignalSemaphores(*exportReadySemaphore);
+                queue.submit(submitInfo);
+            }
+            if (!sendMessage(consumer, MessageType::FrameReady,
+                             {{&ready, sizeof(ready)}})) {
+                break;
+            }
+            {
+                trace::Scope scope{"Wait"};
+                queue.waitIdle();
+            }
+            gpuProfiler.resolve();
+
+            FrameReleased released{};
+            if (!receiveMessage(consumer, header, payload) ||
+                header.type != MessageType::FrameReleased ||
+                payload.size() != sizeof(released)) {
+                break;
+            }
+            std::memcpy(&released, payload.data(), sizeof(released));
+            if (readBackRenderImage) {
+                verifiedCount++;
+                uint64_t checksum = hashPixels(
+                    renderReadbackMapped,
+                    size_t{renderExtent.width} * renderExtent.height);
+                if (released.frame != exportedCount ||
+                    released.checksum != checksum) {
+                    std::cerr << "Frame " << exportedCount
+                              << " differs in the consumer.\n";
+                    mismatchCount++;
+                }
+            }
+            exportedCount++;
+            frame++;
+        }
+        device->waitIdle();
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "Exported " << exportedCount << " frames at "
+                  << exportedCount / elapsed.count() << " fps, verified "
+                  << verifiedCount << " in the consumer\n";
+        if (mismatchCount > 0) {
+            std::cerr << mismatchCount
+                      << " frames differ between producer and consumer.\n";
+            std::abort();
+        }
+        if (options.exportCheck) {
+            consumer.close();
+            if (!waitFrameConsumer(consumerPid) ||
+                exportedCount != frameCount) {
+                std::cerr << "Export round trip failed after "
+                          << exportedCount << " frames.\n";
+                std::abort();
+            }
+            std::cout << "Export round trip passed: " << exportedCount
+                      << " frames\n";
+        }
+#else
+        std::cerr << "Frame export requires POSIX file descriptors.\n";
+        std::abort();
+#endif
+    }
+
+    // Initializes Vulkan without a window and writes raw frames to the
+    // stream. Each frame is read back into the next slot of a ring of
+    // host-visible buffers and handed to the writer thread, which writes
+    // it while the following frames are traced into the other slots.
+    // Up to STREAM_SLOT_COUNT frames are in flight, each recorded into the
+    // command buffers of its slot; the CPU only waits for the fence of the
+    // oldest one, never for the queue to go idle.
+    void runStream() {
+#ifdef FRAME_STREAM_SUPPORTED
+        uint32_t width = options.streamWidth;
+        uint32_t height = options.streamHeight;
+        bool nv12 = options.streamFormat == StreamFormat::NV12;
+        if (width == 0 || height == 0 ||
+            (nv12 && (width % 4 != 0 || height % 2 != 0))) {
+            std::cerr << "Stream size must be nonzero, NV12 needs a width "
+                         "multiple of 4 and an even height.\n";
+            std::abort();
+        }
+
+        // A reader closing the pipe fails the write instead of raising
+        // SIGPIPE
+        std::signal(SIGPIPE, SIG_IGN);
+        int fd = openFrameStream(options.streamPath);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << options.streamPath << ".\n";
+            std::abort();
+        }
+
+        initHeadless();
+        resizeRenderTarget(width, height);
+        readBackRenderImage = false;
+        if (nv12) {
+            createStreamPipeline();
+        }
+
+        // Cached memory makes the copy out of the slots in write() fast,
+        // it may not be coherent and is invalidated after each frame
+        size_t frameSize = getStreamFrameSize(options.streamFormat, width,
+                                              height);
+        for (uint32_t i = 0; i < STREAM_SLOT_COUNT; i++) {
+            streamSlots[i].init(
+                memoryManager, *device, frameSize,
+                vk::BufferUsageFlagBits::eTransferDst |
+                    vk::BufferUsageFlagBits::eStorageBuffer |
+                    vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                    vk::MemoryPropertyFlagBits::eHostCached,
+                "Stream slot");
+            streamSlotsMapped[i] = static_cast<const uint8_t*>(
+                device->mapMemory(*streamSlots[i].memory, 0, frameSize));
+        }
+        for (InFlightFrame& inFlight : streamFrames) {
+            inFlight.commandBuffer =
+                vkutils::createCommandBuffer(*device, *commandPool);
+            inFlight.threadRecorders.resize(jobSystem->getThreadCount());
+            for (auto& recorder : inFlight.threadRecorders) {
+                recorder.init(*device, queueFamilyIndex);
+            }
+            inFlight.fence = device->createFenceUnique({});
+        }
+        streamWriter.init(fd, STREAM_SLOT_COUNT);
+
+        // The joints of characters, and the instances and cameras of motion
+        // blur, are written to one host-visible buffer for the next frame,
+        // so they allow one frame in flight only. Nothing else the CPU
+        // writes changes after the first frame.
+        uint32_t maxInFlight =
+            characterCount > 0 || motionBlur ? 1 : STREAM_SLOT_COUNT;
+        updateDescriptorSet(*renderImageView);
+
+        // Hands the oldest frame in flight to the writer once it is done
+        uint64_t submittedCount = 0;
+        uint64_t streamedCount = 0;
+        auto finishFrame = [&] {
+            uint32_t slot =
+                static_cast<uint32_t>(streamedCount % STREAM_SLOT_COUNT);
+            {
+                trace::Scope scope{"Wait"};
+                if (device->waitForFences(*streamFrames[slot].fence, true,
+                                          UINT64_MAX) !=
+                    vk::Result::eSuccess) {
+                    std::cerr << "Failed to wait for a streamed frame.\n";
+                    std::abort();
+                }
+            }
+            device->invalidateMappedMemoryRanges(vk::MappedMemoryRange{
+                *streamSlots[slot].memory, 0, VK_WHOLE_SIZE});
+            streamWriter.submit(slot, streamSlotsMapped[slot], frameSize);
+            streamedCount++;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        while (options.frameCount == 0 ||
+               submittedCount < options.frameCount) {
+            trace::Scope frameScope{"streamFrame"};
+            streamSlot =
+                static_cast<uint32_t>(submittedCount % STREAM_SLOT_COUNT);
+
+            // The last frame of the slot has been handed to the writer,
+            // so its command buffers are free once it has been written
+            {
+                trace::Scope scope{"Wait for slot"};
+                if (!streamWriter.acquireSlot(streamSlot)) {
+                    std::cerr << "Stream closed by the reader.\n";
+                    break;
+                }
+            }
+            InFlightFrame& inFlight = streamFrames[streamSlot];
+            recordFrame(*renderImage, *renderImageView, &inFlight);
+            {
+                trace::Scope scope{"Submit"};
+                device->resetFences(*inFlight.fence);
+                vk::SubmitInfo submitInfo{};
+                submitInfo.setCommandBuffers(*inFlight.commandBuffer);
+                queue.submit(submitInfo, *inFlight.fence);
+            }
+            submittedCount++;
+            frame++;
+            if (submittedCount - streamedCount == maxInFlight) {
+                finishFrame();
+            }
+        }
+        while (streamedCount < submittedCount) {
+            finishFrame();
+        }
+        streamWriter.finish();
+        device->waitIdle();
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        double writtenMiB =
+            static_cast<double>(streamWriter.getWrittenBytes()) /
+            (1024.0 * 1024.0);
+        std::cout << "Streamed " << streamedCount << " frames of " << width
+                  << "x" << height << " at "
+                  << streamedCount / elapsed.count() << " fps with up to "
+                  << maxInFlight << " in flight, "
+                  << writtenMiB / elapsed.count() << " MiB/s, "
+                  << streamWriter.getWriteMs() << " ms in write, waited "
+                  << streamWriter.getStallMs() << " ms for free slots\n";
+#else
+        std::cerr << "Frame streaming requires POSIX file descriptors.\n";
+        std::abort();
+#endif
+    }
+
+    // Creates the compute pipeline converting streamed frames to NV12
+    void createStreamPipeline() {
+        streamShaderModule = vkutils::createShaderModule(
+            *device, SHADER_DIR + "nv12.comp.spv");
+        vk::PushConstantRange pushRange{};
+        pushRange.setOffset(0);
+        pushRange.setSize(sizeof(StreamConvertPushConstants));
+        pushRange.setStageFlags(vk::ShaderStageFlagBits::eCompute);
+        vk::PipelineLayoutCreateInfo layoutCreateInfo{};
+        layoutCreateInfo.setPushConstantRanges(pushRange);
+        streamPipelineLayout =
+            device->createPipelineLayoutUnique(layoutCreateInfo);
+        vk::ComputePipelineCreateInfo pipelineCreateInfo{};
+        pipelineCreateInfo.setLayout(*streamPipelineLayout);
+        pipelineCreateInfo.setStage({{},
+                                     vk::ShaderStageFlagBits::eCompute,
+                                     *streamShaderModule,
+                                     "main"});
+        auto result =
+            device->createComputePipelineUnique(nullptr, pipelineCreateInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to create NV12 pipeline.\n";
+            std::abort();
+        }
+        streamPipeline = std::move(result.value);
+        vkutils::setObjectName(*device, *streamPipeline, "NV12 pipeline");
+    }
+
+    // Initializes Vulkan without a window and renders the frames of the
+    // timeline into numbered PPM images. The camera, instances and
+    // characters of each frame only depend on its time and the samples on
+    // its index, so runs give the same images bit for bit; the hash of
+    // each frame is printed to compare them. The next frame is updated on
+    // the CPU while the GPU traces the current one, and images are written
+    // on the job threads.
+    void runBatch() {
+        uint32_t width = options.batchWidth;
+        uint32_t height = options.batchHeight;
+        if (width == 0 || height == 0 || options.sampleCount == 0) {
+            std::cerr << "Batch size and sample count must be nonzero.\n";
+            std::abort();
+        }
+        std::error_code error;
+        std::filesystem::create_directories(options.batchDirectory, error);
+        if (error) {
+            std::cerr << "Failed to create " << options.batchDirectory
+                      << ".\n";
+            std::abort();
+        }
+
+        initHeadless();
+        resizeRenderTarget(width, height);
+        readBackRenderImage = true;
+        pushConstants.sampleCount = options.sampleCount;
+
+        uint32_t frameCount = options.frameCount > 0
+                                  ? options.frameCount
+                                  : timeline.getFrameCount();
+        std::vector<JobSystem::TaskPtr> writeTasks;
+        std::vector<uint8_t> written(frameCount);
+        double traceMs = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        prepareBatchFrame(0);
+        for (uint32_t i = 0; i < frameCount; i++) {
+            trace::Scope frameScope{"batchFrame"};
+            recordFrame(*renderImage, *renderImageView);
+            {
+                trace::Scope scope{"Submit"};
+                vk::SubmitInfo submitInfo{};
+                submitInfo.setCommandBuffers(*commandBuffer);
+                queue.submit(submitInfo);
+            }
+            if (i + 1 < frameCount) {
+                prepareBatchFrame(i + 1);
+            }
+            {
+                trace::Scope scope{"Wait"};
+                queue.waitIdle();
+            }
+            gpuProfiler.resolve();
+            traceMs += gpuProfiler.getDurationMs(PASS_TRACE);
+
+            // Stereo frames hash both eyes and write an image per eye
+            size_t layerSize = size_t{width} * height;
+            std::vector<uint32_t> pixels(
+                renderReadbackMapped,
+                renderReadbackMapped + layerSize * getRenderLayerCount());
+            std::cout << "Frame " << i << ": " << std::hex << std::setw(16)
+                      << std::setfill('0')
+                      << hashPixels(pixels.data(), pixels.size())
+                      << std::dec << std::setfill(' ') << "\n";
+            std::vector<std::string> paths;
+            for (uint32_t layer = 0; layer < getRenderLayerCount(); layer++) {
+                char name[32];
+                if (stereo) {
+                    std::snprintf(name, sizeof(name), "frame_%05u_%s.ppm", i,
+                                  layer == 0 ? "left" : "right");
+                } else {
+                    std::snprintf(name, sizeof(name), "frame_%05u.ppm", i);
+                }
+                paths.push_back(
+                    (std::filesystem::path{options.batchDirectory} / name)
+                        .string());
+            }
+            writeTasks.push_back(jobSystem->run(
+                [paths = std::move(paths), pixels = std::move(pixels), width,
+                 height, layerSize, done = &written[i]] {
+                    trace::Scope scope{"Write image"};
+                    bool success = true;
+                    for (size_t layer = 0; layer < paths.size(); layer++) {
+                        success = writePpm(paths[layer],
+                                           pixels.data() + layer * layerSize,
+                                           width, height) &&
+                                  success;
+                    }
+                    *done = success;
+                }));
+            frame++;
+        }
+        for (const auto& task : writeTasks) {
+            jobSystem->wait(task);
+        }
+        device->waitIdle();
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "Rendered " << frameCount
+                  << (stereo ? " stereo frames of " : " frames of ") << width
+                  << "x" << height << " at " << options.sampleCount
+                  << " spp in " << elapsed.count() << " s ("
+                  << 1000.0 * elapsed.count() / frameCount
+                  << " ms per frame, " << traceMs / frameCount
+                  << " ms tracing)\n";
+        uint32_t failedCount = static_cast<uint32_t>(
+            std::count(written.begin(), written.end(), 0));
+        if (failedCount > 0) {
+            std::cerr << "Failed to write " << failedCount << " images to "
+                      << options.batchDirectory << ".\n";
+            std::abort();
+        }
+    }
+
+    // Sets the camera, instances and sample seed of a frame of the
+    // timeline. Only CPU data is written, so this overlaps the trace of
+    // the previous frame; instances are uploaded when it is recorded.
+    void prepareBatchFrame(uint32_t index) {
+        trace::Scope traceScope{"prepareBatchFrame"};
+        animationTime = timeline.getTime(index);
+        pushConstants.sampleSeed = index;
+        prepareAnimatedFrame();
+    }
+
+    // Sets the camera and instances of the timeline at animationTime.
+    // Motion blurred frames also evaluate them at keys spread over the
+    // shutter interval around it: its ends for motion instances and the
+    // cameras, timeSliceCount slices otherwise. The GPU may still be
+    // reading the staging buffer, so the keys are kept until
+    // updateInstances().
+    void prepareAnimatedFrame() {
+        float frameDuration = batching ? 1.0f / timeline.fps : 1.0f / 60.0f;
+        float shutterTime = options.shutter * frameDuration;
+        float openTime = animationTime - 0.5f * shutterTime;
+
+        EyeCamera camera = evaluateCamera(animationTime);
+        std::copy(camera.origin, camera.origin + 4,
+                  pushConstants.cameraOrigin);
+        std::copy(camera.forward, camera.forward + 4,
+                  pushConstants.cameraForward);
+        std::copy(camera.right, camera.right + 4, pushConstants.cameraRight);
+        std::copy(camera.down, camera.down + 4, pushConstants.cameraDown);
+        if (motionBlur) {
+            shutterCameras[0] = evaluateCamera(openTime);
+            shutterCameras[1] = evaluateCamera(openTime + shutterTime);
+        }
+
+        // Without motion blur the instances are uploaded like any scene
+        // graph change
+        uint32_t keyCount = !motionBlur        ? 1
+                            : motionInstances ? 2
+                                              : timeSliceCount;
+        const float scale[3] = {1.0f, 1.0f, 1.0f};
+        uint32_t animatedCount =
+            static_cast<uint32_t>(restPositions.size() / 3);
+        for (uint32_t key = 0; key < keyCount; key++) {
+            float time = animationTime;
+            if (keyCount > 1) {
+                time = openTime + shutterTime * key / (keyCount - 1);
+            }
+            for (uint32_t node = 0; node < animatedCount; node++) {
+                float position[3];
+                float rotation[4];
+                timeline.evaluateInstance(node, time, &restPositions[3 * node],
+                                          position, rotation);
+                sceneGraph.setLocalTransform(node, position, rotation, scale);
+            }
+            sceneGraph.update();
+            if (!motionBlur) {
+                sceneGraphUpdated = true;
+                return;
+            }
+            uint32_t first = key * sliceInstanceCount;
+            for (uint32_t i : sceneGraph.getDirtyInstances()) {
+                sliceTransforms[first + i] = sceneGraph.getInstanceTransform(i);
+                sliceInstances.push_back(first + i);
+            }
+            const auto& ranges = sceneGraph.getDirtyInstanceRanges();
+            if (!motionInstances) {
+                for (InstanceRange range : ranges) {
+                    sliceRanges.push_back({first + range.first, range.count});
+                }
+            } else if (key == 1) {
+                // Both ends of a motion instance are uploaded together
+                sliceRanges.insert(sliceRanges.end(), ranges.begin(),
+                                   ranges.end());
+            }
+        }
+    }
+
+    // Camera of the timeline at time for the render target
+    EyeCamera evaluateCamera(float time) const {
+        Camera camera = timeline.evaluateCamera(time);
+        CameraBasis basis{};
+        if (!computeCameraBasis(camera,
+                                static_cast<float>(renderExtent.width) /
+                                    renderExtent.height,
+                                basis)) {
+            std::cerr << "Camera at " << time
+                      << " s has no view direction.\n";
+            std::abort();
+        }
+        EyeCamera eyeCamera{};
+        for (int axis = 0; axis < 3; axis++) {
+            eyeCamera.origin[axis] = camera.position[axis];
+            eyeCamera.forward[axis] = basis.forward[axis];
+            eyeCamera.right[axis] = basis.right[axis];
+            eyeCamera.down[axis] = basis.down[axis];
+        }
+        return eyeCamera;
+    }
+
+    // Compares tracing the voxel grid as bricks with the intersection
+    // shader against tracing the triangles of its exposed faces
+    void runVoxelBenchmark() {
+        if (options.voxelPath.empty()) {
+            std::cerr << "--voxel-benchmark requires --voxels.\n";
+            std::abort();
+        }
+        initGeometryBenchmark(voxelGrid.bounds);
+
+        // Meshed equivalent with shared corners
+        Mesh mesh = meshVoxelGrid(voxelGrid);
+        optimizeMesh(mesh);
+        Buffer vertexBuffer;
+        Buffer indexBuffer;
+        AccelStruct meshAccel =
+            buildTriangleAccel(mesh, vertexBuffer, indexBuffer);
+        double meshBuildMs = gpuProfiler.getDurationMs(PASS_BUILD_BLAS);
+
+        uint32_t brickCount = static_cast<uint32_t>(voxelGrid.bricks.size());
+        std::cout << voxelGrid.getVoxelCount() << " voxels\n";
+        printGeometryStats({
+            {"bricks", brickCount, voxelAccel.size,
+             brickCount * (sizeof(Aabb) + sizeof(GpuBrick)), voxelBuildMs,
+             measureTraceMs(voxelAccel, VOXEL_SBT_RECORD)},
+            {"triangles", mesh.getTriangleCount(), meshAccel.size,
+             mesh.vertices.size() * sizeof(Vertex) +
+                 mesh.indices.size() * sizeof(uint32_t),
+             meshBuildMs, measureTraceMs(meshAccel, TRIANGLE_SBT_RECORD)},
+        });
+        device->waitIdle();
+    }
+
+    // Compares tracing the strands with the intersection shader against
+    // tracing them tessellated into ribbons
+    void runCurveBenchmark() {
+        if (options.curvePath.empty()) {
+            std::cerr << "--curve-benchmark requires --curves.\n";
+            std::abort();
+        }
+        initGeometryBenchmark(curves.bounds);
+
+        Mesh mesh = tessellateRibbons(curves);
+        Buffer vertexBuffer;
+        Buffer indexBuffer;
+        AccelStruct ribbonAccel =
+            buildTriangleAccel(mesh, vertexBuffer, indexBuffer);
+        double ribbonBuildMs = gpuProfiler.getDurationMs(PASS_BUILD_BLAS);
+
+        uint32_t pieceCount = curveAccel.buildRangeInfo.primitiveCount;
+        std::cout << curves.segments.size() << " segments\n";
+        printGeometryStats({
+            {"curves", pieceCount, curveAccel.size,
+             curves.segments.size() * sizeof(CurveSegment) +
+                 pieceCount * (sizeof(Aabb) + sizeof(CurvePiece)),
+             curveBuildMs, measureTraceMs(curveAccel, CURVE_SBT_RECORD)},
+            {"ribbons", mesh.getTriangleCount(), ribbonAccel.size,
+             mesh.vertices.size() * sizeof(Vertex) +
+                 mesh.indices.size() * sizeof(uint32_t),
+             ribbonBuildMs, measureTraceMs(ribbonAccel, TRIANGLE_SBT_RECORD)},
+        });
+        device->waitIdle();
+    }
+
+    // Compares frames tracing one eye with frames tracing both eyes in
+    // one launch. Both use the stereo pipeline and render target, so the
+    // difference is the cost of the second eye. Frame times include
+    // recording, the TLAS update and the wait, which a frame per eye
+    // would pay twice.
+    void runStereoBenchmark() {
+        constexpr uint32_t WARMUP_FRAMES = 10;
+        constexpr uint32_t MEASURED_FRAMES = 100;
+
+        initVulkan();
+        startupProfiler.end();
+        resizeRenderTarget(WIDTH, HEIGHT);
+        readBackRenderImage = false;
+
+        auto measure = [&](uint32_t eyes, double& traceMs, double& frameMs) {
+            eyeCount = eyes;
+            traceMs = 0.0;
+            frameMs = 0.0;
+            for (uint32_t i = 0; i < WARMUP_FRAMES + MEASURED_FRAMES; i++) {
+                auto start = std::chrono::steady_clock::now();
+                recordFrame(*renderImage, *renderImageView);
+                vk::SubmitInfo submitInfo{};
+                submitInfo.setCommandBuffers(*commandBuffer);
+                queue.submit(submitInfo);
+                queue.waitIdle();
+                std::chrono::duration<double, std::milli> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                gpuProfiler.resolve();
+                if (i >= WARMUP_FRAMES) {
+                    traceMs += gpuProfiler.getDurationMs(PASS_TRACE);
+                    frameMs += elapsed.count();
+                }
+                frame++;
+            }
+            traceMs /= MEASURED_FRAMES;
+            frameMs /= MEASURED_FRAMES;
+        };
+        double monoTraceMs = 0.0;
+        double monoFrameMs = 0.0;
+        double stereoTraceMs = 0.0;
+        double stereoFrameMs = 0.0;
+        measure(1, monoTraceMs, monoFrameMs);
+        measure(2, stereoTraceMs, stereoFrameMs);
+        device->waitIdle();
+
+        std::cout << WIDTH << "x" << HEIGHT << " per eye, average of "
+                  << MEASURED_FRAMES << " frames\n";
+        std::cout << "eyes  trace ms  frame ms\n";
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "1   " << std::setw(10) << monoTraceMs << std::setw(10)
+                  << monoFrameMs << "\n";
+        std::cout << "2   " << std::setw(10) << stereoTraceMs << std::setw(10)
+                  << stereoFrameMs << "\n";
+        std::cout << std::setprecision(2)
+                  << "Both eyes in one launch take "
+                  << stereoFrameMs / monoFrameMs
+                  << "x the frame time of one eye (2.00x for a frame per "
+                     "eye), tracing "
+                  << stereoTraceMs / monoTraceMs << "x\n";
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+    // Initializes Vulkan without characters, which would refit the TLAS of
+    // a measurement, and looks at bounds from the front
+    void initGeometryBenchmark(const Aabb& bounds) {
+        options.characterCount = 0;
+        initVulkan();
+        startupProfiler.end();
+        resizeRenderTarget(WIDTH, HEIGHT);
+        readBackRenderImage = false;
+
+        Camera camera{};
+        float radius = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            camera.target[axis] = 0.5f * (bounds.min[axis] + bounds.max[axis]);
+            radius = std::max(radius, 0.5f * (bounds.max[axis] -
+                                               bounds.min[axis]));
+        }
+        std::copy(camera.target, camera.target + 3, camera.position);
+        camera.position[2] += 3.0f * radius;
+        CameraBasis basis{};
+        computeCameraBasis(camera, static_cast<float>(WIDTH) / HEIGHT, basis);
+        for (int axis = 0; axis < 3; axis++) {
+            pushConstants.cameraOrigin[axis] = camera.position[axis];
+            pushConstants.cameraForward[axis] = basis.forward[axis];
+            pushConstants.cameraRight[axis] = basis.right[axis];
+            pushConstants.cameraDown[axis] = basis.down[axis];
+        }
+    }
+
+    // Builds an uncompacted BLAS of the mesh, like the procedural BLAS it
+    // is compared with. The buffers must outlive the BLAS.
+    AccelStruct buildTriangleAccel(const Mesh& mesh,
+                                   Buffer& vertexBuffer,
+                                   Buffer& indexBuffer) {
+        vk::BufferUsageFlags bufferUsage{
+            vk::BufferUsageFlagBits::
+                eAccelerationStructureBuildInputReadOnlyKHR |
+            vk::BufferUsageFlagBits::eShaderDeviceAddress};
+        vk::MemoryPropertyFlags memoryProperty{
+            vk::MemoryPropertyFlagBits::eHostVisible |
+            vk::MemoryPropertyFlagBits::eHostCoherent};
+        vertexBuffer.init(memoryManager, *device,                 //
+                          mesh.vertices.size() * sizeof(Vertex),  //
+                          bufferUsage, memoryProperty,            //
+                          "Vertex buffer", mesh.vertices.data());
+        indexBuffer.init(memoryManager, *device,                  //
+                         mesh.indices.size() * sizeof(uint32_t),  //
+                         bufferUsage, memoryProperty,             //
+                         "Index buffer", mesh.indices.data());
+
+        vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+        triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+        triangles.setVertexData(vertexBuffer.address);
+        triangles.setVertexStride(sizeof(Vertex));
+        triangles.setMaxVertex(static_cast<uint32_t>(mesh.vertices.size()));
+        triangles.setIndexType(vk::IndexType::eUint32);
+        triangles.setIndexData(indexBuffer.address);
+
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+        geometry.setGeometry({triangles});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+        AccelStruct accel;
+        accel.init(memoryManager, *device, *commandPool, queue,
+                   vk::AccelerationStructureTypeKHR::eBottomLevel, geometry,
+                   mesh.getTriangleCount(), "BLAS", &gpuProfiler);
+        return accel;
+    }
+
+    // Average trace time with blas as the only instance of its own TLAS
+    double measureTraceMs(const AccelStruct& blas, uint32_t sbtRecord) {
+        constexpr uint32_t WARMUP_FRAMES = 10;
+        constexpr uint32_t MEASURED_FRAMES = 100;
+
+        TransformSystem transforms;
+        transforms.add(blas.buffer.address, 0, sbtRecord);
+        Buffer instances;
+        instances.init(
+            memoryManager, *device,
+            sizeof(vk::AccelerationStructureInstanceKHR),
+            vk::BufferUsageFlagBits::
+                    eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent,
+            "Benchmark instance buffer");
+        auto* mapped = static_cast<vk::AccelerationStructureInstanceKHR*>(
+            device->mapMemory(*instances.memory, 0, VK_WHOLE_SIZE));
+        transforms.writeInstancesScalar(mapped, 0, 1);
+        device->unmapMemory(*instances.memory);
+
+        vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
+        instancesData.setArrayOfPointers(false);
+        instancesData.setData(instances.address);
+        vk::AccelerationStructureGeometryKHR geometry{};
+        geometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+        geometry.setGeometry({instancesData});
+        geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+        AccelStruct tlas;
+        tlas.init(memoryManager, *device, *commandPool, queue,
+                  vk::AccelerationStructureTypeKHR::eTopLevel, geometry, 1,
+                  "Benchmark TLAS");
+
+        std::swap(topAccel, tlas);
+        double traceMs = 0.0;
+        for (uint32_t i = 0; i < WARMUP_FRAMES + MEASURED_FRAMES; i++) {
+            recordFrame(*renderImage, *renderImageView);
+            vk::SubmitInfo submitInfo{};
+            submitInfo.setCommandBuffers(*commandBuffer);
+            queue.submit(submitInfo);
+            queue.waitIdle();
+            gpuProfiler.resolve();
+            if (i >= WARMUP_FRAMES) {
+                traceMs += gpuProfiler.getDurationMs(PASS_TRACE);
+            }
+            frame++;
+        }
+        std::swap(topAccel, tlas);
+        return traceMs / MEASURED_FRAMES;
+    }
+
+    // Geometry is what the AS build and the shaders read
+    struct GeometryStats {
+        const char* name;
+        uint32_t primitiveCount;
+        vk::DeviceSize accelSize;
+        vk::DeviceSize geometrySize;
+        double buildMs;
+        double traceMs;
+    };
+
+    void printGeometryStats(const std::vector<GeometryStats>& rows) const {
+        auto toMiB = [](vk::DeviceSize size) {
+            return static_cast<double>(size) / (1024.0 * 1024.0);
+        };
+        std::cout << "geometry    primitives  BLAS MiB  geometry MiB"
+                     "  build ms  trace ms\n";
+        for (const auto& row : rows) {
+            std::cout << std::left << std::setw(10) << row.name << std::right
+                      << std::setw(12) << row.primitiveCount << std::fixed
+                      << std::setprecision(2) << std::setw(10)
+                      << toMiB(row.accelSize) << std::setw(14)
+                      << toMiB(row.geometrySize) << std::setprecision(3)
+                      << std::setw(10) << row.buildMs << std::setw(10)
+                      << row.traceMs << "\n";
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+#ifdef SOCKETS_SUPPORTED
+    // Sends the parameters of the render target and file descriptors of
+    // its memory and the semaphores. The consumer gets its own
+    // references, ours are closed once sent.
+    bool sendExportSetup(const Socket& consumer) {
+        auto properties =
+            physicalDevice.getProperties2<vk::PhysicalDeviceProperties2,
+                                          vk::PhysicalDeviceIDProperties>();
+        const auto& id = properties.get<vk::PhysicalDeviceIDProperties>();
+        ExportSetup setup{};
+        std::memcpy(setup.deviceUUID, id.deviceUUID.data(), VK_UUID_SIZE);
+        std::memcpy(setup.driverUUID, id.driverUUID.data(), VK_UUID_SIZE);
+        setup.width = renderExtent.width;
+        setup.height = renderExtent.height;
+        setup.format = static_cast<VkFormat>(RENDER_TARGET_FORMAT);
+        setup.usage = static_cast<VkImageUsageFlags>(RENDER_TARGET_USAGE);
+        setup.allocationSize =
+            device->getImageMemoryRequirements(*renderImage).size;
+        setup.memoryTypeIndex = renderImageMemoryType;
+
+        constexpr auto MEMORY_HANDLE =
+            vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd;
+        constexpr auto SEMAPHORE_HANDLE =
+            vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd;
+        std::vector<int> fds = {
+            device->getMemoryFdKHR({*renderImageMemory, MEMORY_HANDLE}),
+            device->getSemaphoreFdKHR(
+                {*exportReadySemaphore, SEMAPHORE_HANDLE}),
+            device->getSemaphoreFdKHR(
+                {*exportReleasedSemaphore, SEMAPHORE_HANDLE}),
+        };
+        bool sent = sendMessage(consumer, MessageType::ExportSetup,
+                                {{&setup, sizeof(setup)}}) &&
+                    consumer.sendFds(fds);
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        return sent;
+    }
+#endif
+
+    // Renders a job into the readback buffer. AS, pipeline and SBT are
+    // kept between jobs; the scene is only reloaded when a job names
+    // another one.
+    RenderedFrame renderJob(const RenderJob& job) {
+        RenderedFrame result{};
+        if (!job.scenePath.empty() &&
+            scenePaths != std::vector<std::string>{job.scenePath}) {
+            // A bad file fails the job and keeps the current scene
+            auto start = std::chrono::steady_clock::now();
+            std::vector<Mesh> loaded(1);
+            if (!tryLoadObj(job.scenePath, loaded[0], result.error)) {
+                return result;
+            }
+            optimizeMesh(loaded[0]);
+            computeBounds(loaded[0]);
+            reloadScene({job.scenePath}, std::move(loaded));
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            result.sceneLoadMs = elapsed.count();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        resizeRenderTarget(job.regionWidth, job.regionHeight);
+        setCamera(job);
+        pushConstants.sampleCount = job.sampleCount;
+
+        // The jitter only depends on the region, so a tile renders the
+        // same on any worker
+        pushConstants.sampleSeed = job.regionY * job.width + job.regionX;
+        recordFrame(*renderImage, *renderImageView);
+        {
+            trace::Scope scope{"Submit"};
+            vk::SubmitInfo submitInfo{};
+            submitInfo.setCommandBuffers(*commandBuffer);
+            queue.submit(submitInfo);
+        }
+        {
+            trace::Scope scope{"Wait"};
+            queue.waitIdle();
+        }
+        gpuProfiler.resolve();
+        frame++;
+
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.pixels = renderReadbackMapped;
+        result.renderMs = elapsed.count();
+        result.gpuMs = gpuProfiler.getDurationMs(PASS_TRACE);
+        return result;
+    }
+
+    // Replaces the scene and everything built from it with the loaded
+    // meshes of paths. The pipeline and SBT do not depend on the scene and
+    // are kept.
+    void reloadScene(const std::vector<std::string>& paths,
+                     std::vector<Mesh> loaded) {
+        trace::Scope traceScope{"reloadScene"};
+        device->waitIdle();
+        frameGraph = FrameGraph{};
+        topAccel = AccelStruct{};
+        characterAccels.clear();
+        bottomAccels.clear();
+        vertexBuffers.clear();
+        indexBuffers.clear();
+        instanceTransforms = TransformSystem{};
+        sceneGraph = SceneGraph{};
+        restPositions.clear();
+        instanceUploadRanges.clear();
+        sliceRanges.clear();
+        sliceInstances.clear();
+
+        scenePaths = paths;
+        meshes = std::move(loaded);
+        createBottomLevelAS();
+        createCharacters();
+        createTopLevelAS();
+        createFrameGraph();
+    }
+
+    // One layer per eye
+    uint32_t getRenderLayerCount() const { return stereo ? 2 : 1; }
+
+    // Sets the resolution of the next frames. The render target and its
+    // readback buffer are only recreated when they are too small, so the
+    // smaller edge tiles of a distributed frame do not reallocate them.
+    void resizeRenderTarget(uint32_t width, uint32_t height) {
+        renderExtent = vk::Extent2D{width, height};
+
+        // Hit counters are sized by the frame graph
+        if (hitCounterPixelCount > 0 && width * height > hitCounterPixelCount) {
+            device->waitIdle();
+            frameGraph = FrameGraph{};
+            createFrameGraph();
+        }
+
+        if (renderImage && width <= renderImageExtent.width &&
+            height <= renderImageExtent.height) {
+            return;
+        }
+        trace::Scope traceScope{"resizeRenderTarget"};
+        width = std::max(width, renderImageExtent.width);
+        height = std::max(height, renderImageExtent.height);
+        renderImageExtent = vk::Extent2D{width, height};
+        renderImageView.reset();
+
+        // Exported images are dedicated allocations that the consumer
+        // imports with the same parameters
+        vk::ExternalMemoryImageCreateInfo externalCreateInfo{
+            vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd};
+        vk::ImageCreateInfo createInfo{};
+        createInfo.setImageType(vk::ImageType::e2D);
+        createInfo.setFormat(RENDER_TARGET_FORMAT);
+        createInfo.setExtent({width, height, 1});
+        createInfo.setMipLevels(1);
+        createInfo.setArrayLayers(getRenderLayerCount());
+        createInfo.setSamples(vk::SampleCountFlagBits::e1);
+        createInfo.setTiling(vk::ImageTiling::eOptimal);
+        createInfo.setUsage(RENDER_TARGET_USAGE);
+        if (exporting) {
+            createInfo.setPNext(&externalCreateInfo);
+        }
+        renderImage = device->createImageUnique(createInfo);
+        vkutils::setObjectName(*device, *renderImage, "Render target");
+
+        vk::MemoryDedicatedAllocateInfo dedicatedInfo{*renderImage};
+        vk::ExportMemoryAllocateInfo exportInfo{
+            vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd};
+        exportInfo.setPNext(&dedicatedInfo);
+        vk::MemoryRequirements memoryReq =
+            device->getImageMemoryRequirements(*renderImage);
+        renderImageMemory = memoryManager.allocate(
+            *device, memoryReq, vk::MemoryPropertyFlagBits::eDeviceLocal,
+            "Render target", {}, exporting ? &exportInfo : nullptr,
+            &renderImageMemoryType);
+        device->bindImageMemory(*renderImage, *renderImageMemory, 0);
+
+        vk::ImageViewCreateInfo viewCreateInfo{};
+        viewCreateInfo.setImage(*renderImage);
+        viewCreateInfo.setViewType(stereo ? vk::ImageViewType::e2DArray
+                                          : vk::ImageViewType::e2D);
+        viewCreateInfo.setFormat(RENDER_TARGET_FORMAT);
+        viewCreateInfo.setSubresourceRange(
+            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, getRenderLayerCount()});
+        renderImageView = device->createImageViewUnique(viewCreateInfo);
+        vkutils::setObjectName(*device, *renderImageView,
+                               "Render target view");
+
+        vk::DeviceSize size =
+            sizeof(uint32_t) * width * height * getRenderLayerCount();
+        renderReadback.init(memoryManager, *device, size,
+                            vk::BufferUsageFlagBits::eTransferDst,
+                            vk::MemoryPropertyFlagBits::eHostVisible |
+                                vk::MemoryPropertyFlagBits::eHostCoherent,
+                            "Render target readback");
+        renderReadbackMapped = static_cast<const uint32_t*>(
+            device->mapMemory(*renderReadback.memory, 0, size));
+    }
+
+    // Points the camera at the region of the job, which must have been
+    // validated
+    void setCamera(const RenderJob& job) {
+        CameraBasis basis{};
+        computeCameraBasis(job.camera,
+                           static_cast<float>(job.width) / job.height, basis);
+        cropCameraBasis(basis, job.width, job.height, job.regionX, job.regionY,
+                        job.regionWidth, job.regionHeight);
+        for (int axis = 0; axis < 3; axis++) {
+            pushConstants.cameraOrigin[axis] = job.camera.position[axis];
+            pushConstants.cameraForward[axis] = basis.forward[axis];
+            pushConstants.cameraRight[axis] = basis.right[axis];
+            pushConstants.cameraDown[axis] = basis.down[axis];
+        }
+    }
+};
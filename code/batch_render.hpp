@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+
+// Camera at a point of the timeline
+struct CameraKey {
+    float time;
+    Camera camera;
+};
+
+// Animation of --batch, evaluated at fixed timesteps: frame i is at time
+// i / fps however long frames take to render. Everything is a function
+// of time only, so a frame looks the same whatever was rendered before.
+struct Timeline {
+    float fps = 30.0f;
+
+    // Sorted by time. Positions and targets follow a Catmull-Rom spline
+    // through the keys, up and field of view are interpolated linearly.
+    std::vector<CameraKey> cameraKeys;
+
+    // Instances turn around their Y axis and bob up and down, each with
+    // its own phase
+    float spinSpeed = 0.0f;  // radians per second
+    float bobHeight = 0.0f;
+    float bobPeriod = 2.0f;  // seconds
+
+    float getTime(uint32_t frame) const { return frame / fps; }
+
+    // Frames up to and including the last camera key
+    uint32_t getFrameCount() const {
+        if (cameraKeys.empty()) {
+            return 1;
+        }
+        return static_cast<uint32_t>(
+                   std::floor(cameraKeys.back().time * fps + 1e-3f)) +
+               1;
+    }
+
+    Camera evaluateCamera(float time) const {
+        if (cameraKeys.empty()) {
+            return Camera{};
+        }
+        if (time <= cameraKeys.front().time) {
+            return cameraKeys.front().camera;
+        }
+        if (time >= cameraKeys.back().time) {
+            return cameraKeys.back().camera;
+        }
+        size_t key = 0;
+        while (cameraKeys[key + 1].time <= time) {
+            key++;
+        }
+
+        // Ends are repeated to clamp the spline
+        const Camera& c0 = cameraKeys[key > 0 ? key - 1 : key].camera;
+        const Camera& c1 = cameraKeys[key].camera;
+        const Camera& c2 = cameraKeys[key + 1].camera;
+        const Camera& c3 =
+            cameraKeys[std::min(key + 2, cameraKeys.size() - 1)].camera;
+        float t = (time - cameraKeys[key].time) /
+                  (cameraKeys[key + 1].time - cameraKeys[key].time);
+        auto spline = [t](float p0, float p1, float p2, float p3) {
+            return 0.5f * (2.0f * p1 + (p2 - p0) * t +
+                           (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t * t +
+                           (3.0f * (p1 - p2) + p3 - p0) * t * t * t);
+        };
+
+        Camera camera{};
+        for (int axis = 0; axis < 3; axis++) {
+            camera.position[axis] =
+                spline(c0.position[axis], c1.position[axis],
+                       c2.position[axis], c3.position[axis]);
+            camera.target[axis] = spline(c0.target[axis], c1.target[axis],
+                                         c2.target[axis], c3.target[axis]);
+            camera.up[axis] = c1.up[axis] + (c2.up[axis] - c1.up[axis]) * t;
+        }
+        camera.fovY = c1.fovY + (c2.fovY - c1.fovY) * t;
+        return camera;
+    }
+
+    // Offsets restPosition and returns the rotation as a quaternion
+    void evaluateInstance(uint32_t instance,
+                          float time,
+                          const float restPosition[3],
+                          float position[3],
+                          float rotation[4]) const {
+        // Golden angle, so that neighbours do not move in step
+        float phase = 2.39996323f * instance;
+        float angle = spinSpeed * time + phase;
+        rotation[0] = 0.0f;
+        rotation[1] = std::sin(0.5f * angle);
+        rotation[2] = 0.0f;
+        rotation[3] = std::cos(0.5f * angle);
+        std::copy(restPosition, restPosition + 3, position);
+        position[1] += bobHeight *
+                       std::sin(6.28318531f * time / bobPeriod + phase);
+    }
+};
+
+// One orbit around the origin in 8 s, with slowly turning instances
+inline Timeline createDefaultTimeline() {
+    Timeline timeline{};
+    for (uint32_t i = 0; i <= 8; i++) {
+        float angle = 0.785398163f * i;
+        CameraKey key{};
+        key.time = static_cast<float>(i);
+        key.camera.position[0] = 5.0f * std::sin(angle);
+        key.camera.position[1] = 1.0f;
+        key.camera.position[2] = 5.0f * std::cos(angle);
+        timeline.cameraKeys.push_back(key);
+    }
+    timeline.spinSpeed = 0.5f;
+    timeline.bobHeight = 0.1f;
+    return timeline;
+}
+
+// Reads a timeline from lines of
+//   fps <frames per second>
+//   camera <time> <position xyz> <target xyz> <fovY>
+//   spin <radians per second>
+//   bob <height> <period>
+// Empty lines and lines starting with # are skipped. Returns false and
+// prints the line on errors.
+inline bool loadTimeline(const std::string& path, Timeline& timeline) {
+    std::ifstream file{path};
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << path << ".\n";
+        return false;
+    }
+    timeline = Timeline{};
+    std::string line;
+    uint32_t lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::istringstream stream{line};
+        std::string keyword;
+        if (!(stream >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+        bool valid = false;
+        if (keyword == "fps") {
+            valid = (stream >> timeline.fps) && timeline.fps > 0.0f;
+        } else if (keyword == "camera") {
+            CameraKey key{};
+            Camera& camera = key.camera;
+            valid = (stream >> key.time >> camera.position[0] >>
+                     camera.position[1] >> camera.position[2] >>
+                     camera.target[0] >> camera.target[1] >>
+                     camera.target[2] >> camera.fovY) &&
+                    (timeline.cameraKeys.empty() ||
+                     key.time > timeline.cameraKeys.back().time);
+            timeline.cameraKeys.push_back(key);
+        } else if (keyword == "spin") {
+            valid = static_cast<bool>(stream >> timeline.spinSpeed);
+        } else if (keyword == "bob") {
+            valid = (stream >> timeline.bobHeight >> timeline.bobPeriod) &&
+                    timeline.bobPeriod > 0.0f;
+        }
+        if (!valid) {
+            std::cerr << path << ":" << lineNumber << ": invalid line \""
+                      << line << "\".\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes width * height RGBA8 pixels as a binary PPM, dropping alpha
+inline bool writePpm(const std::string& path,
+                     const uint32_t* pixels,
+                     uint32_t width,
+                     uint32_t height) {
+    std::vector<uint8_t> rgb(size_t{3} * width * height);
+    for (size_t i = 0; i < size_t{width} * height; i++) {
+        rgb[3 * i + 0] = static_cast<uint8_t>(pixels[i]);
+        rgb[3 * i + 1] = static_cast<uint8_t>(pixels[i] >> 8);
+        rgb[3 * i + 2] = static_cast<uint8_t>(pixels[i] >> 16);
+    }
+    std::ofstream file{path, std::ios::binary};
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(rgb.data()),
+               static_cast<std::streamsize>(rgb.size()));
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "jobs.hpp"
+#include "mesh.hpp"
+#include "scene.hpp"
+
+inline float surfaceArea(const Aabb& box) {
+    if (box.isEmpty()) {
+        return 0.0f;
+    }
+    float dx = box.max[0] - box.min[0];
+    float dy = box.max[1] - box.min[1];
+    float dz = box.max[2] - box.min[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+inline Aabb intersectBounds(const Aabb& a, const Aabb& b) {
+    Aabb result;
+    for (int axis = 0; axis < 3; axis++) {
+        result.min[axis] = std::max(a.min[axis], b.min[axis]);
+        result.max[axis] = std::min(a.max[axis], b.max[axis]);
+        if (result.min[axis] > result.max[axis]) {
+            return Aabb{};
+        }
+    }
+    return result;
+}
+
+// Binary BVH over the triangles of a mesh, built top-down with binned
+// SAH. It only approximates what the driver builds, but the metrics
+// depend mostly on the geometry, so bad meshes show up here as well.
+class CpuBvh {
+public:
+    // Cost of visiting a node relative to intersecting a triangle
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    static constexpr float INTERSECTION_COST = 1.0f;
+    static constexpr uint32_t BIN_COUNT = 16;
+    static constexpr uint32_t MAX_LEAF_SIZE = 8;
+
+    struct Node {
+        Aabb bounds;
+
+        // Inner nodes: children are first and first + 1.
+        // Leaves: triangles [first, first + count) of getTriangles().
+        uint32_t first = 0;
+        uint32_t count = 0;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    void build(const Mesh& mesh) {
+        uint32_t triangleCount = mesh.getTriangleCount();
+        nodes.clear();
+        triangles.resize(triangleCount);
+        std::iota(triangles.begin(), triangles.end(), 0);
+        triangleBounds.resize(triangleCount);
+        centroids.resize(triangleCount);
+        for (uint32_t i = 0; i < triangleCount; i++) {
+            Aabb& bounds = triangleBounds[i];
+            bounds = Aabb{};
+            for (int corner = 0; corner < 3; corner++) {
+                bounds.extend(mesh.vertices[mesh.indices[i * 3 + corner]].pos);
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                centroids[i][axis] =
+                    0.5f * (bounds.min[axis] + bounds.max[axis]);
+            }
+        }
+        if (triangleCount == 0) {
+            return;
+        }
+
+        nodes.push_back({computeBounds(0, triangleCount), 0, triangleCount});
+        std::vector<uint32_t> stack = {0};
+        while (!stack.empty()) {
+            uint32_t index = stack.back();
+            stack.pop_back();
+            uint32_t mid = split(nodes[index]);
+            if (mid == 0) {
+                continue;
+            }
+
+            Node node = nodes[index];
+            uint32_t left = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(
+                {computeBounds(node.first, mid), node.first, mid - node.first});
+            nodes.push_back({computeBounds(mid, node.first + node.count), mid,
+                             node.first + node.count - mid});
+            nodes[index].first = left;
+            nodes[index].count = 0;
+            stack.push_back(left);
+            stack.push_back(left + 1);
+        }
+    }
+
+    const std::vector<Node>& getNodes() const { return nodes; }
+    const std::vector<uint32_t>& getTriangles() const { return triangles; }
+
+private:
+    std::vector<Node> nodes;
+    std::vector<uint32_t> triangles;
+    std::vector<Aabb> triangleBounds;
+    std::vector<std::array<float, 3>> centroids;
+
+    Aabb computeBounds(uint32_t begin, uint32_t end) const {
+        Aabb bounds;
+        for (uint32_t i = begin; i < end; i++) {
+            bounds.extend(triangleBounds[triangles[i]]);
+        }
+        return bounds;
+    }
+
+    // Partitions the triangles of a node at the cheapest bin boundary.
+    // Returns the first triangle of the right half, or 0 if the node
+    // stays a leaf.
+    uint32_t split(const Node& node) {
+        if (node.count <= 1) {
+            return 0;
+        }
+        Aabb centroidBounds;
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            centroidBounds.extend(centroids[triangles[i]].data());
+        }
+
+        struct Bin {
+            Aabb bounds;
+            uint32_t count = 0;
+        };
+        float bestCost = INFINITY;
+        int bestAxis = -1;
+        uint32_t bestBin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            float min = centroidBounds.min[axis];
+            float extent = centroidBounds.max[axis] - min;
+            if (extent <= 0.0f) {
+                continue;
+            }
+            float scale = BIN_COUNT / extent;
+            std::array<Bin, BIN_COUNT> bins{};
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                uint32_t triangle = triangles[i];
+                uint32_t bin = std::min(
+                    BIN_COUNT - 1,
+                    static_cast<uint32_t>((centroids[triangle][axis] - min) *
+                                          scale));
+                bins[bin].bounds.extend(triangleBounds[triangle]);
+                bins[bin].count++;
+            }
+
+            // Sweep from the right to get the cost of the right halves
+            std::array<float, BIN_COUNT> rightCosts{};
+            Aabb rightBounds;
+            uint32_t rightCount = 0;
+            for (uint32_t bin = BIN_COUNT - 1; bin > 0; bin--) {
+                rightBounds.extend(bins[bin].bounds);
+                rightCount += bins[bin].count;
+                rightCosts[bin] = surfaceArea(rightBounds) * rightCount;
+            }
+            Aabb leftBounds;
+            uint32_t leftCount = 0;
+            for (uint32_t bin = 1; bin < BIN_COUNT; bin++) {
+                leftBounds.extend(bins[bin - 1].bounds);
+                leftCount += bins[bin - 1].count;
+                float cost =
+                    surfaceArea(leftBounds) * leftCount + rightCosts[bin];
+                bool valid = leftCount > 0 && leftCount < node.count;
+                if (valid && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+
+        float area = surfaceArea(node.bounds);
+        float leafCost = INTERSECTION_COST * node.count;
+        float splitCost =
+            TRAVERSAL_COST +
+            (area > 0.0f ? INTERSECTION_COST * bestCost / area : leafCost);
+        uint32_t* begin = triangles.data() + node.first;
+        uint32_t* end = begin + node.count;
+        if (bestAxis < 0) {
+            // All centroids coincide, split in the middle if too large
+            return node.count > MAX_LEAF_SIZE ? node.first + node.count / 2
+                                              : 0;
+        }
+        if (splitCost >= leafCost && node.count <= MAX_LEAF_SIZE) {
+            return 0;
+        }
+
+        float min = centroidBounds.min[bestAxis];
+        float scale = BIN_COUNT / (centroidBounds.max[bestAxis] - min);
+        uint32_t* mid = std::partition(begin, end, [&](uint32_t triangle) {
+            uint32_t bin = std::min(
+                BIN_COUNT - 1,
+                static_cast<uint32_t>((centroids[triangle][bestAxis] - min) *
+                                      scale));
+            return bin < bestBin;
+        });
+        return node.first + static_cast<uint32_t>(mid - begin);
+    }
+};
+
+struct BvhQuality {
+    std::string name;
+    uint32_t triangleCount = 0;
+    uint32_t nodeCount = 0;
+    uint32_t leafCount = 0;
+    uint32_t maxDepth = 0;
+
+    // Expected cost of a ray entering the root, in triangle intersections
+    float sahCost = 0.0f;
+
+    // Expected number of nodes whose children both have to be visited,
+    // i.e. the summed sibling overlap area relative to the root
+    float overlap = 0.0f;
+
+    uint32_t maxLeafSize = 0;
+    float averageLeafSize = 0.0f;
+
+    // Triangles with (almost) zero area
+    uint32_t degenerateCount = 0;
+};
+
+// Builds a BVH over the mesh and measures its quality
+inline BvhQuality analyzeBvh(const Mesh& mesh) {
+    BvhQuality quality{};
+    quality.name = mesh.name;
+    quality.triangleCount = mesh.getTriangleCount();
+
+    for (uint32_t i = 0; i < quality.triangleCount; i++) {
+        const float* p0 = mesh.vertices[mesh.indices[i * 3 + 0]].pos;
+        const float* p1 = mesh.vertices[mesh.indices[i * 3 + 1]].pos;
+        const float* p2 = mesh.vertices[mesh.indices[i * 3 + 2]].pos;
+        float e0[3], e1[3];
+        for (int axis = 0; axis < 3; axis++) {
+            e0[axis] = p1[axis] - p0[axis];
+            e1[axis] = p2[axis] - p0[axis];
+        }
+        float cross[3] = {e0[1] * e1[2] - e0[2] * e1[1],
+                          e0[2] * e1[0] - e0[0] * e1[2],
+                          e0[0] * e1[1] - e0[1] * e1[0]};
+        float crossLength = std::sqrt(
+            cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+
+        // Relative to the longest edge so that the test is scale invariant
+        float edgeLengthSquared = 0.0f;
+        for (const float* edge : {e0, e1}) {
+            edgeLengthSquared =
+                std::max(edgeLengthSquared, edge[0] * edge[0] +
+                                                edge[1] * edge[1] +
+                                                edge[2] * edge[2]);
+        }
+        if (crossLength <= 1e-6f * edgeLengthSquared) {
+            quality.degenerateCount++;
+        }
+    }
+
+    CpuBvh bvh;
+    bvh.build(mesh);
+    const auto& nodes = bvh.getNodes();
+    quality.nodeCount = static_cast<uint32_t>(nodes.size());
+    if (nodes.empty()) {
+        return quality;
+    }
+
+    float rootArea = surfaceArea(nodes[0].bounds);
+    float invRootArea = rootArea > 0.0f ? 1.0f / rootArea : 0.0f;
+    std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const CpuBvh::Node& node = nodes[index];
+        float probability = surfaceArea(node.bounds) * invRootArea;
+        quality.maxDepth = std::max(quality.maxDepth, depth);
+        if (node.isLeaf()) {
+            quality.leafCount++;
+            quality.maxLeafSize = std::max(quality.maxLeafSize, node.count);
+            quality.sahCost +=
+                probability * CpuBvh::INTERSECTION_COST * node.count;
+            continue;
+        }
+        quality.sahCost += probability * CpuBvh::TRAVERSAL_COST;
+        quality.overlap += surfaceArea(intersectBounds(
+                               nodes[node.first].bounds,
+                               nodes[node.first + 1].bounds)) *
+                           invRootArea;
+        stack.push_back({node.first, depth + 1});
+        stack.push_back({node.first + 1, depth + 1});
+    }
+    quality.averageLeafSize =
+        static_cast<float>(quality.triangleCount) / quality.leafCount;
+    return quality;
+}
+
+// Analyzes every mesh of the scene in parallel and prints them ordered by
+// expected traversal cost, worst first
+inline void printBvhReport(const std::vector<std::string>& paths,
+                           uint32_t workerCount) {
+    JobSystem jobSystem{workerCount};
+    std::vector<Mesh> meshes = loadScene(jobSystem, paths);
+    std::vector<BvhQuality> qualities(meshes.size());
+    jobSystem.parallelFor(static_cast<uint32_t>(meshes.size()), 1,
+                          [&](uint32_t begin, uint32_t end) {
+                              for (uint32_t i = begin; i < end; i++) {
+                                  qualities[i] = analyzeBvh(meshes[i]);
+                              }
+                          });
+    std::stable_sort(qualities.begin(), qualities.end(),
+                     [](const BvhQuality& a, const BvhQuality& b) {
+                         return a.sahCost > b.sahCost;
+                     });
+
+    std::cout << std::left << std::setw(24) << "mesh" << std::right
+              << std::setw(10) << "tris" << std::setw(9) << "depth"
+              << std::setw(10) << "SAH" << std::setw(10) << "overlap"
+              << std::setw(10) << "avg leaf" << std::setw(10) << "max leaf"
+              << std::setw(11) << "degenerate" << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (const BvhQuality& quality : qualities) {
+        std::string name = quality.name;
+        if (name.size() > 23) {
+            name = "..." + name.substr(name.size() - 20);
+        }
+        std::cout << std::left << std::setw(24) << name << std::right
+                  << std::setw(10) << quality.triangleCount << std::setw(9)
+                  << quality.maxDepth << std::setw(10) << quality.sahCost
+                  << std::setw(10) << quality.overlap << std::setw(10)
+                  << quality.averageLeafSize << std::setw(10)
+                  << quality.maxLeafSize << std::setw(11)
+                  << quality.degenerateCount << "\n";
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << "SAH: expected intersections per ray entering the root "
+                 "(node visits count as "
+              << CpuBvh::TRAVERSAL_COST << ")\n";
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// Pinhole camera looking from position at target
+struct Camera {
+    float position[3] = {0.0f, 0.0f, 5.0f};
+    float target[3] = {0.0f, 0.0f, 0.0f};
+    float up[3] = {0.0f, 1.0f, 0.0f};
+
+    // Vertical field of view in degrees
+    float fovY = 40.0f;
+};
+
+// Primary rays go through forward + right * x + down * y for x, y in
+// [-1, 1] from the top left of the image
+struct CameraBasis {
+    float forward[3];
+    float right[3];
+    float down[3];
+};
+
+// Returns false if the camera has no view direction or up is parallel
+// to it. aspect is width / height of the image.
+inline bool computeCameraBasis(const Camera& camera,
+                               float aspect,
+                               CameraBasis& basis) {
+    auto normalize = [](float v[3]) {
+        float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+        if (!(length > 1e-6f)) {
+            return false;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            v[axis] /= length;
+        }
+        return true;
+    };
+    auto cross = [](const float a[3], const float b[3], float result[3]) {
+        result[0] = a[1] * b[2] - a[2] * b[1];
+        result[1] = a[2] * b[0] - a[0] * b[2];
+        result[2] = a[0] * b[1] - a[1] * b[0];
+    };
+
+    float forward[3];
+    for (int axis = 0; axis < 3; axis++) {
+        forward[axis] = camera.target[axis] - camera.position[axis];
+    }
+    float right[3];
+    float up[3];
+    if (!normalize(forward)) {
+        return false;
+    }
+    cross(forward, camera.up, right);
+    if (!normalize(right)) {
+        return false;
+    }
+    cross(right, forward, up);
+
+    float halfHeight = std::tan(0.5f * camera.fovY * 3.14159265f / 180.0f);
+    float halfWidth = halfHeight * aspect;
+    for (int axis = 0; axis < 3; axis++) {
+        basis.forward[axis] = forward[axis];
+        basis.right[axis] = right[axis] * halfWidth;
+        basis.down[axis] = -up[axis] * halfHeight;
+    }
+    return true;
+}
+
+// Narrows the basis of a width x height image to a region of it, so that
+// the rays of a region rendered on its own match those of the whole image
+inline void cropCameraBasis(CameraBasis& basis,
+                            uint32_t width,
+                            uint32_t height,
+                            uint32_t regionX,
+                            uint32_t regionY,
+                            uint32_t regionWidth,
+                            uint32_t regionHeight) {
+    // Center of the region and its half size in [-1, 1]
+    float centerX = (2.0f * regionX + regionWidth) / width - 1.0f;
+    float centerY = (2.0f * regionY + regionHeight) / height - 1.0f;
+    float scaleX = static_cast<float>(regionWidth) / width;
+    float scaleY = static_cast<float>(regionHeight) / height;
+    for (int axis = 0; axis < 3; axis++) {
+        basis.forward[axis] +=
+            basis.right[axis] * centerX + basis.down[axis] * centerY;
+        basis.right[axis] *= scaleX;
+        basis.down[axis] *= scaleY;
+    }
+}
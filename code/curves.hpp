@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mesh.hpp"
+
+// Control point of a strand: position and radius there
+struct CurvePoint {
+    float pos[3];
+    float radius;
+};
+
+// Cubic Bezier segment of a strand. Linear segments are stored with the
+// inner control points at the thirds, which is the same line.
+// Must match Segment in shaders/curves.rint
+struct CurveSegment {
+    CurvePoint points[4];
+};
+
+// Part [t0, t1] of a segment, one AABB primitive of the BLAS.
+// Must match Piece in shaders/curves.rint
+struct CurvePiece {
+    uint32_t segment;
+    float t0;
+    float t1;
+    uint32_t stepCount;  // capsules the shader intersects along the piece
+};
+
+struct Curves {
+    std::string name;
+    std::vector<CurveSegment> segments;
+    Aabb bounds;
+};
+
+// Pieces curved less than this fraction of their radius are intersected
+// as one capsule, others as CURVE_STEPS capsules
+constexpr float CURVE_FLATNESS = 0.25f;
+constexpr uint32_t CURVE_STEPS = 4;
+
+// Polar form of the segment: blossom(t, t, t) is the point at t, and
+// blossom(t0, t0, t1) etc. are the control points of the part [t0, t1]
+inline CurvePoint blossom(const CurveSegment& segment,
+                          float a,
+                          float b,
+                          float c) {
+    CurvePoint p[4];
+    std::copy(segment.points, segment.points + 4, p);
+    float params[3] = {a, b, c};
+    for (int level = 0; level < 3; level++) {
+        float t = params[level];
+        for (int i = 0; i < 3 - level; i++) {
+            for (int k = 0; k < 3; k++) {
+                p[i].pos[k] += (p[i + 1].pos[k] - p[i].pos[k]) * t;
+            }
+            p[i].radius += (p[i + 1].radius - p[i].radius) * t;
+        }
+    }
+    return p[0];
+}
+
+inline CurveSegment getSubSegment(const CurveSegment& segment,
+                                  float t0,
+                                  float t1) {
+    return {{blossom(segment, t0, t0, t0), blossom(segment, t0, t0, t1),
+             blossom(segment, t0, t1, t1), blossom(segment, t1, t1, t1)}};
+}
+
+// The curve and its radius stay within the convex hull of the control
+// points, so their box grown by the largest radius bounds the strand
+inline Aabb getSegmentBounds(const CurveSegment& segment) {
+    Aabb bounds;
+    float radius = 0.0f;
+    for (const auto& point : segment.points) {
+        bounds.extend(point.pos);
+        radius = std::max(radius, point.radius);
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        bounds.min[axis] -= radius;
+        bounds.max[axis] += radius;
+    }
+    return bounds;
+}
+
+inline float getSurfaceArea(const Aabb& box) {
+    float d[3];
+    for (int axis = 0; axis < 3; axis++) {
+        d[axis] = box.max[axis] - box.min[axis];
+    }
+    return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+// Largest distance of the inner control points from the chord
+inline float getFlatness(const CurveSegment& segment) {
+    const float* a = segment.points[0].pos;
+    const float* b = segment.points[3].pos;
+    float chord[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float length2 =
+        chord[0] * chord[0] + chord[1] * chord[1] + chord[2] * chord[2];
+    float flatness = 0.0f;
+    for (int i = 1; i < 3; i++) {
+        const float* p = segment.points[i].pos;
+        float d[3] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+        float s = length2 > 0.0f
+                      ? (d[0] * chord[0] + d[1] * chord[1] + d[2] * chord[2]) /
+                            length2
+                      : 0.0f;
+        float distance2 = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            float e = d[axis] - chord[axis] * s;
+            distance2 += e * e;
+        }
+        flatness = std::max(flatness, std::sqrt(distance2));
+    }
+    return flatness;
+}
+
+// Splits segments [begin, end) into pieces and appends them with their
+// AABBs. A strand running diagonally through its box leaves most of it
+// empty, and every ray through the empty part runs the intersection
+// shader for nothing. A piece is halved while that shrinks the surface
+// area of its boxes, which the number of such rays follows, by more than
+// a quarter, at most maxDepth times.
+inline void subdivideCurves(const Curves& curves,
+                            uint32_t begin,
+                            uint32_t end,
+                            std::vector<CurvePiece>& pieces,
+                            std::vector<Aabb>& boxes,
+                            uint32_t maxDepth = 2) {
+    struct Part {
+        float t0;
+        float t1;
+        uint32_t depth;
+    };
+
+    std::vector<Part> stack;
+    for (uint32_t s = begin; s < end; s++) {
+        const CurveSegment& segment = curves.segments[s];
+        stack.push_back({0.0f, 1.0f, 0});
+        while (!stack.empty()) {
+            Part part = stack.back();
+            stack.pop_back();
+            CurveSegment sub = getSubSegment(segment, part.t0, part.t1);
+            Aabb box = getSegmentBounds(sub);
+            if (part.depth < maxDepth) {
+                float tm = 0.5f * (part.t0 + part.t1);
+                float childArea =
+                    getSurfaceArea(getSegmentBounds(
+                        getSubSegment(segment, part.t0, tm))) +
+                    getSurfaceArea(getSegmentBounds(
+                        getSubSegment(segment, tm, part.t1)));
+                if (childArea < 0.75f * getSurfaceArea(box)) {
+                    stack.push_back({tm, part.t1, part.depth + 1});
+                    stack.push_back({part.t0, tm, part.depth + 1});
+                    continue;
+                }
+            }
+            float radius = std::min(sub.points[0].radius, sub.points[3].radius);
+            uint32_t stepCount =
+                getFlatness(sub) < CURVE_FLATNESS * radius ? 1 : CURVE_STEPS;
+            pieces.push_back({s, part.t0, part.t1, stepCount});
+            boxes.push_back(box);
+        }
+    }
+}
+
+inline void computeBounds(Curves& curves) {
+    curves.bounds = Aabb{};
+    for (const auto& segment : curves.segments) {
+        curves.bounds.extend(getSegmentBounds(segment));
+    }
+}
+
+// Reads a curve file:
+//   char magic[4]          "CRV1"
+//   uint32_t degree        1 (linear) or 3 (cubic Bezier)
+//   uint32_t segmentCount
+//   segmentCount times
+//     degree + 1 times
+//       float pos[3]
+//       float radius
+// in little-endian byte order
+inline Curves loadCurves(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << filename << "\n";
+        std::abort();
+    }
+
+    char magic[4] = {};
+    uint32_t degree = 0;
+    uint32_t segmentCount = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&degree), sizeof(degree));
+    file.read(reinterpret_cast<char*>(&segmentCount), sizeof(segmentCount));
+    if (!file || std::memcmp(magic, "CRV1", 4) != 0 ||
+        (degree != 1 && degree != 3)) {
+        std::cerr << filename << " is not a curve file.\n";
+        std::abort();
+    }
+
+    Curves curves;
+    curves.name = filename;
+    std::vector<CurvePoint> points(size_t{degree + 1} * segmentCount);
+    file.read(reinterpret_cast<char*>(points.data()),
+              static_cast<std::streamsize>(sizeof(CurvePoint) *
+                                           points.size()));
+    if (!file) {
+        std::cerr << filename << " is truncated.\n";
+        std::abort();
+    }
+    curves.segments.resize(segmentCount);
+    for (uint32_t s = 0; s < segmentCount; s++) {
+        CurveSegment& segment = curves.segments[s];
+        if (degree == 3) {
+            std::copy(&points[4 * s], &points[4 * s] + 4, segment.points);
+            continue;
+        }
+        const CurvePoint& a = points[2 * s];
+        const CurvePoint& b = points[2 * s + 1];
+        for (int i = 0; i < 4; i++) {
+            float t = i / 3.0f;
+            for (int k = 0; k < 3; k++) {
+                segment.points[i].pos[k] = a.pos[k] + (b.pos[k] - a.pos[k]) * t;
+            }
+            segment.points[i].radius = a.radius + (b.radius - a.radius) * t;
+        }
+    }
+    computeBounds(curves);
+    return curves;
+}
+
+inline bool writeCurves(const std::string& filename, const Curves& curves) {
+    std::ofstream file(filename, std::ios::binary);
+    uint32_t degree = 3;
+    uint32_t segmentCount = static_cast<uint32_t>(curves.segments.size());
+    file.write("CRV1", 4);
+    file.write(reinterpret_cast<const char*>(&degree), sizeof(degree));
+    file.write(reinterpret_cast<const char*>(&segmentCount),
+               sizeof(segmentCount));
+    file.write(reinterpret_cast<const char*>(curves.segments.data()),
+               static_cast<std::streamsize>(sizeof(CurveSegment) *
+                                            segmentCount));
+    return static_cast<bool>(file);
+}
+
+// Ball of fur: strands of one segment each grow from a sphere of radius 1
+// and bend down, tapering from root to tip
+inline Curves createTestCurves(uint32_t strandCount = 1000000) {
+    Curves curves;
+    curves.name = "Fur ball";
+    curves.segments.resize(strandCount);
+    std::mt19937 random{1234};
+    std::uniform_real_distribution<float> jitter{-1.0f, 1.0f};
+    for (uint32_t i = 0; i < strandCount; i++) {
+        // Roots on a Fibonacci sphere
+        float y = 1.0f - 2.0f * (i + 0.5f) / strandCount;
+        float ring = std::sqrt(std::max(0.0f, 1.0f - y * y));
+        float angle = 2.39996323f * i;
+        float normal[3] = {ring * std::cos(angle), y, ring * std::sin(angle)};
+
+        float length = 0.25f * (1.0f + 0.2f * jitter(random));
+        float droop = 0.5f + 0.1f * jitter(random);
+        CurveSegment& segment = curves.segments[i];
+        for (int k = 0; k < 4; k++) {
+            float t = k / 3.0f;
+            for (int axis = 0; axis < 3; axis++) {
+                segment.points[k].pos[axis] =
+                    normal[axis] * (1.0f + length * t);
+            }
+            segment.points[k].pos[1] -= droop * length * t * t;
+            segment.points[k].radius = 0.002f * (1.0f - 0.75f * t);
+        }
+    }
+    computeBounds(curves);
+    return curves;
+}
+
+// Triangulates every segment into stepCount flat quads as wide as the
+// strand, for comparison with the intersection shader. Ribbons face a
+// fixed direction across the strand, as they would in a BLAS.
+inline Mesh tessellateRibbons(const Curves& curves, uint32_t stepCount = 4) {
+    Mesh mesh;
+    mesh.name = curves.name + " (ribbons)";
+    mesh.vertices.reserve(curves.segments.size() * (stepCount + 1) * 2);
+    mesh.indices.reserve(curves.segments.size() * stepCount * 6);
+    for (const auto& segment : curves.segments) {
+        const float* a = segment.points[0].pos;
+        const float* b = segment.points[3].pos;
+        float tangent[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+
+        // Across the strand, perpendicular to its least aligned axis
+        int axis = 0;
+        for (int k = 1; k < 3; k++) {
+            if (std::abs(tangent[k]) < std::abs(tangent[axis])) {
+                axis = k;
+            }
+        }
+        float reference[3] = {0.0f, 0.0f, 0.0f};
+        reference[axis] = 1.0f;
+        float side[3] = {
+            tangent[1] * reference[2] - tangent[2] * reference[1],
+            tangent[2] * reference[0] - tangent[0] * reference[2],
+            tangent[0] * reference[1] - tangent[1] * reference[0],
+        };
+        float length = std::sqrt(side[0] * side[0] + side[1] * side[1] +
+                                 side[2] * side[2]);
+        if (length > 0.0f) {
+            for (float& value : side) {
+                value /= length;
+            }
+        }
+
+        uint32_t base = static_cast<uint32_t>(mesh.vertices.size());
+        for (uint32_t i = 0; i <= stepCount; i++) {
+            float t = static_cast<float>(i) / stepCount;
+            CurvePoint p = blossom(segment, t, t, t);
+            for (float sign : {-1.0f, 1.0f}) {
+                Vertex vertex{};
+                for (int k = 0; k < 3; k++) {
+                    vertex.pos[k] = p.pos[k] + side[k] * p.radius * sign;
+                }
+                mesh.vertices.push_back(vertex);
+            }
+        }
+        for (uint32_t i = 0; i < stepCount; i++) {
+            uint32_t v = base + 2 * i;
+            mesh.indices.insert(mesh.indices.end(),
+                                {v, v + 1, v + 3, v, v + 3, v + 2});
+        }
+    }
+    return mesh;
+}
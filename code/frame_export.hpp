@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "render_protocol.hpp"
+#include "vkutils.hpp"
+
+#ifdef SOCKETS_SUPPORTED
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+// Frames exported by --export are traced into an image whose memory is
+// shared with a consumer process, so the consumer reads them on the GPU
+// without a copy through host memory. The image, a semaphore signaled
+// when a frame is ready and a semaphore signaled when the consumer is
+// done with it are passed once as opaque file descriptors.
+
+// Followed by the file descriptors of the image memory, the ready
+// semaphore and the released semaphore. The consumer must create the
+// image on the device with these UUIDs as a 2D image with one mip level
+// and layer, optimal tiling and the same format, extent and usage, and
+// import the memory as a dedicated allocation.
+struct ExportSetup {
+    uint8_t deviceUUID[VK_UUID_SIZE];
+    uint8_t driverUUID[VK_UUID_SIZE];
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    VkImageUsageFlags usage;
+    uint64_t allocationSize;
+    uint32_t memoryTypeIndex;
+};
+
+// The frame is written in the general layout and released to
+// VK_QUEUE_FAMILY_EXTERNAL once the ready semaphore is signaled
+struct FrameReady {
+    uint64_t frame;
+
+    // Steady clock of the producer at submission, comparable across
+    // processes on the same machine
+    int64_t submitTimeNs;
+};
+
+// Sent once the consumer has submitted its last read of the frame, which
+// signals the released semaphore. The producer does not write the image
+// again before waiting for it.
+struct FrameReleased {
+    uint64_t frame;
+
+    // hashPixels() of the frame as the consumer read it
+    uint64_t checksum;
+};
+
+// FNV-1a over the pixels
+inline uint64_t hashPixels(const uint32_t* pixels, size_t count) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < count; i++) {
+        hash ^= pixels[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline int64_t getSteadyTimeNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+#ifdef SOCKETS_SUPPORTED
+// Sample consumer of exported frames. It imports the image and the
+// semaphores, then for each frame acquires the image from the producer,
+// copies it to host memory, standing in for an encoder or a compositor,
+// and releases it back to VK_QUEUE_FAMILY_EXTERNAL in the general layout.
+// The checksum of each frame is sent back so that the producer can check
+// the handoff. Returns false on failure.
+inline bool runFrameConsumer(const std::string& socketPath) {
+    Socket socket = Socket::connect(socketPath);
+    if (!socket.isOpen()) {
+        std::cerr << "Failed to connect to " << socketPath << ".\n";
+        return false;
+    }
+
+    MessageHeader header{};
+    std::vector<uint8_t> payload;
+    ExportSetup setup{};
+    std::vector<int> fds;
+    if (!receiveMessage(socket, header, payload) ||
+        header.type != MessageType::ExportSetup ||
+        payload.size() != sizeof(setup) || !socket.receiveFds(fds, 3)) {
+        std::cerr << "Failed to receive the exported frame.\n";
+        return false;
+    }
+    std::memcpy(&setup, payload.data(), sizeof(setup));
+
+    // Create instance and device on the device of the producer
+    std::vector<const char*> layers = {
+        "VK_LAYER_KHRONOS_validation",
+    };
+    std::vector<const char*> deviceExtensions = {
+        VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+        VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+    };
+    vk::UniqueInstance instance =
+        vkutils::createInstance(VK_API_VERSION_1_2, layers, true);
+    vk::UniqueDebugUtilsMessengerEXT debugMessenger =
+        vkutils::createDebugMessenger(*instance);
+    vk::PhysicalDevice physicalDevice;
+    for (const auto& candidate : instance->enumeratePhysicalDevices()) {
+        auto properties =
+            candidate.getProperties2<vk::PhysicalDeviceProperties2,
+                                     vk::PhysicalDeviceIDProperties>();
+        const auto& id = properties.get<vk::PhysicalDeviceIDProperties>();
+        if (std::memcmp(id.deviceUUID.data(), setup.deviceUUID,
+                        VK_UUID_SIZE) == 0 &&
+            std::memcmp(id.driverUUID.data(), setup.driverUUID,
+                        VK_UUID_SIZE) == 0 &&
+            vkutils::checkDeviceExtensionSupport(candidate,
+                                                 deviceExtensions)) {
+            physicalDevice = candidate;
+            break;
+        }
+    }
+    if (!physicalDevice) {
+        std::cerr << "The device of the producer is not available.\n";
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    uint32_t queueFamilyIndex =
+        vkutils::findGeneralQueueFamily(physicalDevice, {});
+    float queuePriority = 1.0f;
+    vk::DeviceQueueCreateInfo queueCreateInfo{
+        {}, queueFamilyIndex, 1, &queuePriority};
+    vk::DeviceCreateInfo deviceCreateInfo{};
+    deviceCreateInfo.setQueueCreateInfos(queueCreateInfo);
+    deviceCreateInfo.setPEnabledExtensionNames(deviceExtensions);
+    vk::UniqueDevice device =
+        physicalDevice.createDeviceUnique(deviceCreateInfo);
+    VULKAN_HPP_DEFAULT_DISPATCHER.init(*device);
+    vk::Queue queue = device->getQueue(queueFamilyIndex, 0);
+
+    // Import image memory, Vulkan owns the file descriptors from here
+    vk::ExternalMemoryImageCreateInfo externalCreateInfo{
+        vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd};
+    vk::ImageCreateInfo imageCreateInfo{};
+    imageCreateInfo.setImageType(vk::ImageType::e2D);
+    imageCreateInfo.setFormat(static_cast<vk::Format>(setup.format));
+    imageCreateInfo.setExtent({setup.width, setup.height, 1});
+    imageCreateInfo.setMipLevels(1);
+    imageCreateInfo.setArrayLayers(1);
+    imageCreateInfo.setSamples(vk::SampleCountFlagBits::e1);
+    imageCreateInfo.setTiling(vk::ImageTiling::eOptimal);
+    imageCreateInfo.setUsage(static_cast<vk::ImageUsageFlags>(setup.usage));
+    imageCreateInfo.setPNext(&externalCreateInfo);
+    vk::UniqueImage image = device->createImageUnique(imageCreateInfo);
+
+    vk::MemoryDedicatedAllocateInfo dedicatedInfo{*image};
+    vk::ImportMemoryFdInfoKHR importInfo{
+        vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd, fds[0]};
+    importInfo.setPNext(&dedicatedInfo);
+    vk::MemoryAllocateInfo allocateInfo{setup.allocationSize,
+                                        setup.memoryTypeIndex};
+    allocateInfo.setPNext(&importInfo);
+    vk::UniqueDeviceMemory imageMemory =
+        device->allocateMemoryUnique(allocateInfo);
+    device->bindImageMemory(*image, *imageMemory, 0);
+
+    auto importSemaphore = [&](int fd) {
+        vk::UniqueSemaphore semaphore = device->createSemaphoreUnique({});
+        vk::ImportSemaphoreFdInfoKHR semaphoreImportInfo{};
+        semaphoreImportInfo.setSemaphore(*semaphore);
+        semaphoreImportInfo.setHandleType(
+            vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd);
+        semaphoreImportInfo.setFd(fd);
+        device->importSemaphoreFdKHR(semaphoreImportInfo);
+        return semaphore;
+    };
+    vk::UniqueSemaphore readySemaphore = importSemaphore(fds[1]);
+    vk::UniqueSemaphore releasedSemaphore = importSemaphore(fds[2]);
+
+    // Host copy of the frame, as an encoder on the CPU would read it
+    vk::DeviceSize readbackSize =
+        sizeof(uint32_t) * size_t{setup.width} * setup.height;
+    vk::BufferCreateInfo bufferCreateInfo{};
+    bufferCreateInfo.setSize(readbackSize);
+    bufferCreateInfo.setUsage(vk::BufferUsageFlagBits::eTransferDst);
+    vk::UniqueBuffer readback = device->createBufferUnique(bufferCreateInfo);
+    vk::MemoryRequirements memoryReq =
+        device->getBufferMemoryRequirements(*readback);
+    vk::UniqueDeviceMemory readbackMemory =
+        device->allocateMemoryUnique(vk::MemoryAllocateInfo{
+            memoryReq.size,
+            vkutils::getMemoryType(
+                physicalDevice, memoryReq,
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                    vk::MemoryPropertyFlagBits::eHostCoherent)});
+    device->bindBufferMemory(*readback, *readbackMemory, 0);
+    const uint32_t* pixels = static_cast<const uint32_t*>(
+        device->mapMemory(*readbackMemory, 0, readbackSize));
+
+    vk::UniqueCommandPool commandPool =
+        vkutils::createCommandPool(*device, queueFamilyIndex);
+    vk::UniqueCommandBuffer commandBuffer =
+        vkutils::createCommandBuffer(*device, *commandPool);
+    vk::UniqueFence fence = device->createFenceUnique({});
+
+    std::cout << "Importing " << setup.width << "x" << setup.height
+              << " frames from " << socketPath << "\n";
+    uint64_t frameCount = 0;
+    double totalLatencyMs = 0.0;
+    double maxLatencyMs = 0.0;
+    while (receiveMessage(socket, header, payload)) {
+        FrameReady ready{};
+        if (header.type != MessageType::FrameReady ||
+            payload.size() != sizeof(ready)) {
+            std::cerr << "Unexpected message from producer.\n";
+            return false;
+        }
+        std::memcpy(&ready, payload.data(), sizeof(ready));
+
+        // Acquire the image from the producer. The barrier is chained to
+        // the semaphore wait by its source stage.
+        commandBuffer->begin(vk::CommandBufferBeginInfo{
+            vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+        vk::ImageMemoryBarrier acquire{};
+        acquire.setDstAccessMask(vk::AccessFlagBits::eTransferRead);
+        acquire.setOldLayout(vk::ImageLayout::eGeneral);
+        acquire.setNewLayout(vk::ImageLayout::eTransferSrcOptimal);
+        acquire.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_EXTERNAL);
+        acquire.setDstQueueFamilyIndex(queueFamilyIndex);
+        acquire.setImage(*image);
+        acquire.setSubresourceRange(
+            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+        commandBuffer->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                       vk::PipelineStageFlagBits::eTransfer,
+                                       {}, {}, {}, acquire);
+        vk::BufferImageCopy region{};
+        region.setImageSubresource({vk::ImageAspectFlagBits::eColor, 0, 0, 1});
+        region.setImageExtent({setup.width, setup.height, 1});
+        commandBuffer->copyImageToBuffer(*image,
+                                         vk::ImageLayout::eTransferSrcOptimal,
+                                         *readback, region);
+
+        // Give the image back as it was received. The released semaphore
+        // orders the producer's next frame after this barrier.
+        vk::ImageMemoryBarrier release = acquire;
+        release.setSrcAccessMask(vk::AccessFlagBits::eTransferRead);
+        release.setDstAccessMask({});
+        release.setOldLayout(vk::ImageLayout::eTransferSrcOptimal);
+        release.setNewLayout(vk::ImageLayout::eGeneral);
+        release.setSrcQueueFamilyIndex(queueFamilyIndex);
+        release.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_EXTERNAL);
+        commandBuffer->pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {}, release);
+        commandBuffer->end();
+
+        vk::PipelineStageFlags waitStage{vk::PipelineStageFlagBits::eTransfer};
+        vk::SubmitInfo submitInfo{};
+        submitInfo.setWaitSemaphores(*readySemaphore);
+        submitInfo.setWaitDstStageMask(waitStage);
+        submitInfo.setCommandBuffers(*commandBuffer);
+        submitInfo.setSignalSemaphores(*releasedSemaphore);
+        queue.submit(submitInfo, *fence);
+        if (device->waitForFences(*fence, true,
+                                  std::numeric_limits<uint64_t>::max()) !=
+            vk::Result::eSuccess) {
+            std::cerr << "Failed to wait for fence.\n";
+            std::abort();
+        }
+        device->resetFences(*fence);
+
+        // From the submission of the producer to pixels in host memory
+        double latencyMs = (getSteadyTimeNs() - ready.submitTimeNs) / 1e6;
+        totalLatencyMs += latencyMs;
+        maxLatencyMs = std::max(maxLatencyMs, latencyMs);
+        frameCount++;
+
+        FrameReleased released{};
+        released.frame = ready.frame;
+        released.checksum =
+            hashPixels(pixels, size_t{setup.width} * setup.height);
+        if (!sendMessage(socket, MessageType::FrameReleased,
+                         {{&released, sizeof(released)}})) {
+            break;
+        }
+    }
+    queue.waitIdle();
+
+    std::cout << "Consumed " << frameCount << " frames";
+    if (frameCount > 0) {
+        std::cout << ", latency from producer submit to host memory: "
+                  << totalLatencyMs / frameCount << " ms average, "
+                  << maxLatencyMs << " ms max";
+    }
+    std::cout << "\n";
+    return frameCount > 0;
+}
+
+// Starts this program as the consumer of socketPath, for the round trip
+// check of --export-check. Returns -1 on failure.
+inline pid_t spawnFrameConsumer(const std::string& executablePath,
+                                const std::string& socketPath) {
+    std::string program = executablePath;
+    std::string consumeOption = "--consume";
+    std::string path = socketPath;
+    char* argv[] = {program.data(), consumeOption.data(), path.data(),
+                    nullptr};
+    pid_t pid = -1;
+    if (posix_spawnp(&pid, program.c_str(), nullptr, nullptr, argv,
+                     environ) != 0) {
+        std::cerr << "Failed to start " << program << ".\n";
+        return -1;
+    }
+    return pid;
+}
+
+// Returns true if the consumer exited successfully
+inline bool waitFrameConsumer(pid_t pid) {
+    int status = 0;
+    return ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+#endif
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "gpu_profiler.hpp"
+#include "memory_manager.hpp"
+#include "vkutils.hpp"
+
+using FrameResource = uint32_t;
+
+// How a pass uses a resource
+struct ResourceAccess {
+    FrameResource resource;
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+
+    // Images only
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+};
+
+// Part of a frame recorded into its own secondary command buffer.
+// Passes are recorded in parallel and executed in order; the frame graph
+// inserts the barriers between them from their declared accesses.
+struct FramePass {
+    const char* name;
+    std::function<void(vk::CommandBuffer)> record;
+    std::vector<ResourceAccess> accesses;
+    bool enabled = true;
+
+    // Set when the pass is recorded
+    vk::CommandBuffer commandBuffer;
+};
+
+struct FrameGraphStats {
+    // Pipeline barriers recorded in the last execute()
+    uint32_t barrierCount = 0;
+
+    // Resource dependencies covered by them, i.e. the barriers needed if
+    // every resource was synchronized on its own
+    uint32_t dependencyCount = 0;
+
+    // Memory of transient buffers with and without aliasing
+    vk::DeviceSize transientSize = 0;
+    vk::DeviceSize dedicatedSize = 0;
+};
+
+// Declares the passes of a frame and the resources they read and write.
+// Transient buffers only live within a frame; those whose lifetimes do
+// not overlap share memory. Buffers are synchronized with global memory
+// barriers, images with image barriers including layout transitions.
+// Frames must not overlap on the GPU since transient memory is reused.
+class FrameGraph {
+public:
+    // Buffer owned elsewhere. finalStages/finalAccess is the use after
+    // the frame (e.g. host reads) that must see its writes.
+    FrameResource importBuffer(const char* name,
+                               vk::PipelineStageFlags finalStages = {},
+                               vk::AccessFlags finalAccess = {}) {
+        Resource resource{};
+        resource.name = name;
+        resource.finalStages = finalStages;
+        resource.finalAccess = finalAccess;
+        return addResource(std::move(resource));
+    }
+
+    // Image owned elsewhere, set with setImage() before execute().
+    // Barriers cover its first layerCount array layers.
+    FrameResource importImage(const char* name,
+                              vk::ImageLayout initialLayout,
+                              vk::ImageLayout finalLayout,
+                              uint32_t layerCount = 1) {
+        Resource resource{};
+        resource.name = name;
+        resource.isImage = true;
+        resource.layerCount = layerCount;
+        resource.initialLayout = initialLayout;
+        resource.finalLayout = finalLayout;
+        resource.finalStages = vk::PipelineStageFlagBits::eBottomOfPipe;
+        return addResource(std::move(resource));
+    }
+
+    // Buffer created by compile(), valid only during the frame
+    FrameResource createBuffer(const char* name,
+                               vk::DeviceSize size,
+                               vk::BufferUsageFlags usage) {
+        Resource resource{};
+        resource.name = name;
+        resource.isTransient = true;
+        resource.size = size;
+        resource.usage = usage;
+        return addResource(std::move(resource));
+    }
+
+    void setImage(FrameResource resource, vk::Image image) {
+        resources[resource].image = image;
+    }
+
+    // Releases an imported image from srcQueueFamily to dstQueueFamily in
+    // the final barrier, e.g. to VK_QUEUE_FAMILY_EXTERNAL for another
+    // process. Its initial layout must be undefined, as the image is used
+    // again without acquiring it back.
+    void setImageRelease(FrameResource resource,
+                         uint32_t srcQueueFamily,
+                         uint32_t dstQueueFamily) {
+        resources[resource].releaseSrcQueueFamily = srcQueueFamily;
+        resources[resource].releaseDstQueueFamily = dstQueueFamily;
+    }
+
+    uint32_t addPass(const char* name,
+                     std::vector<ResourceAccess> accesses,
+                     std::function<void(vk::CommandBuffer)> record) {
+        passes.push_back({name, std::move(record), std::move(accesses)});
+        return static_cast<uint32_t>(passes.size() - 1);
+    }
+
+    void setPassEnabled(uint32_t pass, bool enabled) {
+        passes[pass].enabled = enabled;
+    }
+
+    // Creates transient buffers and places them in one allocation.
+    // Lifetimes span all declared passes, enabled or not.
+    void compile(MemoryManager& memoryManager, vk::Device device) {
+        for (uint32_t pass = 0; pass < passes.size(); pass++) {
+            for (const auto& access : passes[pass].accesses) {
+                Resource& resource = resources[access.resource];
+                resource.firstPass = std::min(resource.firstPass, pass);
+                resource.lastPass = std::max(resource.lastPass, pass);
+            }
+        }
+
+        // Create buffers
+        std::vector<FrameResource> transients;
+        uint32_t memoryTypeBits = ~0u;
+        for (FrameResource i = 0; i < resources.size(); i++) {
+            Resource& resource = resources[i];
+            bool unused = resource.firstPass > resource.lastPass;
+            if (!resource.isTransient || unused) {
+                continue;
+            }
+            vk::BufferCreateInfo createInfo{};
+            createInfo.setSize(resource.size);
+            createInfo.setUsage(resource.usage |
+                                vk::BufferUsageFlagBits::eShaderDeviceAddress);
+            resource.buffer = device.createBufferUnique(createInfo);
+            vkutils::setObjectName(device, *resource.buffer, resource.name);
+
+            vk::MemoryRequirements memoryReq =
+                device.getBufferMemoryRequirements(*resource.buffer);
+            resource.memorySize = memoryReq.size;
+            resource.memoryAlignment = memoryReq.alignment;
+            memoryTypeBits &= memoryReq.memoryTypeBits;
+            stats.dedicatedSize += memoryReq.size;
+            transients.push_back(i);
+        }
+        if (transients.empty()) {
+            return;
+        }
+
+        // Place the largest first, at the lowest offset that does not
+        // overlap a placed buffer with an overlapping lifetime
+        std::stable_sort(transients.begin(), transients.end(),
+                         [&](FrameResource a, FrameResource b) {
+                             return resources[a].memorySize >
+                                    resources[b].memorySize;
+                         });
+        std::vector<FrameResource> placed;
+        for (FrameResource i : transients) {
+            Resource& resource = resources[i];
+            std::vector<FrameResource> live;
+            for (FrameResource other : placed) {
+                if (resources[other].firstPass <= resource.lastPass &&
+                    resource.firstPass <= resources[other].lastPass) {
+                    live.push_back(other);
+                }
+            }
+
+            std::vector<vk::DeviceSize> candidates = {0};
+            for (FrameResource other : live) {
+                candidates.push_back(vkutils::alignUp(
+                    resources[other].memoryOffset + resources[other].memorySize,
+                    resource.memoryAlignment));
+            }
+            std::sort(candidates.begin(), candidates.end());
+            for (vk::DeviceSize offset : candidates) {
+                bool fits = true;
+                for (FrameResource other : live) {
+                    if (overlaps(offset, resource.memorySize,
+                                 resources[other].memoryOffset,
+                                 resources[other].memorySize)) {
+                        fits = false;
+                        break;
+                    }
+                }
+                if (fits) {
+                    resource.memoryOffset = offset;
+                    break;
+                }
+            }
+            stats.transientSize =
+                std::max(stats.transientSize,
+                         resource.memoryOffset + resource.memorySize);
+            placed.push_back(i);
+        }
+
+        // Buffers sharing memory with another one must wait for it
+        for (FrameResource i : transients) {
+            for (FrameResource other : transients) {
+                if (i != other &&
+                    overlaps(resources[i].memoryOffset,
+                             resources[i].memorySize,
+                             resources[other].memoryOffset,
+                             resources[other].memorySize)) {
+                    resources[i].aliases.push_back(other);
+                }
+            }
+        }
+
+        // Allocate and bind
+        vk::MemoryRequirements memoryReq{};
+        memoryReq.setSize(stats.transientSize);
+        memoryReq.setMemoryTypeBits(memoryTypeBits);
+        memory = memoryManager.allocate(
+            device, memoryReq, vk::MemoryPropertyFlagBits::eDeviceLocal,
+            "Transient memory", vk::MemoryAllocateFlagBits::eDeviceAddress);
+
+        for (FrameResource i : transients) {
+            Resource& resource = resources[i];
+            device.bindBufferMemory(*resource.buffer, *memory,
+                                    resource.memoryOffset);
+            vk::BufferDeviceAddressInfoKHR addressInfo{};
+            addressInfo.setBuffer(*resource.buffer);
+            resource.address = device.getBufferAddressKHR(&addressInfo);
+        }
+    }
+
+    vk::Buffer getBuffer(FrameResource resource) const {
+        return *resources[resource].buffer;
+    }
+
+    vk::DeviceAddress getBufferAddress(FrameResource resource) const {
+        return resources[resource].address;
+    }
+
+    std::vector<FramePass*> getEnabledPasses() {
+        std::vector<FramePass*> enabledPasses;
+        for (auto& pass : passes) {
+            if (pass.enabled) {
+                enabledPasses.push_back(&pass);
+            }
+        }
+        return enabledPasses;
+    }
+
+    // Executes the recorded command buffers of the enabled passes with
+    // the barriers they need, then makes the imported resources ready
+    // for their final use
+    void execute(vk::CommandBuffer commandBuffer, GpuProfiler* profiler) {
+        states.assign(resources.size(), State{});
+        for (FrameResource i = 0; i < resources.size(); i++) {
+            states[i].layout = resources[i].initialLayout;
+        }
+        stats.barrierCount = 0;
+        stats.dependencyCount = 0;
+
+        for (const FramePass* pass : getEnabledPasses()) {
+            Barrier barrier{};
+            for (const auto& access : pass->accesses) {
+                addDependency(access, barrier);
+            }
+            recordBarrier(commandBuffer, barrier);
+
+            GpuProfiler::Scope scope{profiler, commandBuffer, pass->name};
+            commandBuffer.executeCommands(pass->commandBuffer);
+        }
+
+        Barrier barrier{};
+        for (FrameResource i = 0; i < resources.size(); i++) {
+            const Resource& resource = resources[i];
+            if (!resource.isTransient && states[i].used) {
+                addDependency({i, resource.finalStages, resource.finalAccess,
+                               resource.finalLayout},
+                              barrier, true);
+            }
+        }
+        recordBarrier(commandBuffer, barrier);
+    }
+
+    const FrameGraphStats& getStats() const { return stats; }
+
+    void printSummary() const {
+        auto toKiB = [](vk::DeviceSize size) {
+            return static_cast<double>(size) / 1024.0;
+        };
+        std::cout << "Frame graph: " << passes.size() << " passes\n";
+        for (const auto& resource : resources) {
+            if (resource.buffer) {
+                std::cout << "  " << resource.name << ": passes "
+                          << resource.firstPass << "-" << resource.lastPass
+                          << ", " << toKiB(resource.memorySize)
+                          << " KiB at offset " << resource.memoryOffset
+                          << "\n";
+            }
+        }
+        std::cout << "  Transient memory: " << toKiB(stats.transientSize)
+                  << " KiB (" << toKiB(stats.dedicatedSize)
+                  << " KiB without aliasing)\n";
+    }
+
+private:
+    struct Resource {
+        const char* name;
+        bool isImage = false;
+        bool isTransient = false;
+
+        // Imported images
+        vk::Image image;
+        uint32_t layerCount = 1;
+        vk::ImageLayout initialLayout = vk::ImageLayout::eUndefined;
+        vk::ImageLayout finalLayout = vk::ImageLayout::eUndefined;
+        uint32_t releaseSrcQueueFamily = VK_QUEUE_FAMILY_IGNORED;
+        uint32_t releaseDstQueueFamily = VK_QUEUE_FAMILY_IGNORED;
+
+        // Imported resources
+        vk::PipelineStageFlags finalStages;
+        vk::AccessFlags finalAccess;
+
+        // Transient buffers
+        vk::DeviceSize size = 0;
+        vk::BufferUsageFlags usage;
+        vk::UniqueBuffer buffer;
+        vk::DeviceAddress address = 0;
+        vk::DeviceSize memoryOffset = 0;
+        vk::DeviceSize memorySize = 0;
+        vk::DeviceSize memoryAlignment = 1;
+        std::vector<FrameResource> aliases;
+
+        uint32_t firstPass = UINT32_MAX;
+        uint32_t lastPass = 0;
+    };
+
+    // Access to a resource since its last write, during execute()
+    struct State {
+        bool used = false;
+        vk::PipelineStageFlags writeStages;
+        vk::AccessFlags writeAccess;
+        vk::PipelineStageFlags readStages;
+
+        // Reads that the last write has already been made visible to
+        vk::PipelineStageFlags visibleStages;
+        vk::AccessFlags visibleAccess;
+
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    };
+
+    struct Barrier {
+        vk::PipelineStageFlags srcStages;
+        vk::PipelineStageFlags dstStages;
+        vk::MemoryBarrier memoryBarrier;
+        std::vector<vk::ImageMemoryBarrier> imageBarriers;
+    };
+
+    static constexpr vk::AccessFlags WRITE_ACCESS =
+        vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite |
+        vk::AccessFlagBits::eHostWrite | vk::AccessFlagBits::eMemoryWrite |
+        vk::AccessFlagBits::eColorAttachmentWrite |
+        vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+        vk::AccessFlagBits::eAccelerationStructureWriteKHR;
+
+    std::vector<Resource> resources;
+    std::vector<FramePass> passes;
+    DeviceMemory memory;
+    std::vector<State> states;
+    FrameGraphStats stats;
+
+    FrameResource addResource(Resource&& resource) {
+        resources.push_back(std::move(resource));
+        return static_cast<FrameResource>(resources.size() - 1);
+    }
+
+    static bool overlaps(vk::DeviceSize offsetA,
+                         vk::DeviceSize sizeA,
+                         vk::DeviceSize offsetB,
+                         vk::DeviceSize sizeB) {
+        return offsetA < offsetB + sizeB && offsetB < offsetA + sizeA;
+    }
+
+    // final is the use after the frame, which may release the resource
+    void addDependency(const ResourceAccess& access,
+                       Barrier& barrier,
+                       bool final = false) {
+        const Resource& resource = resources[access.resource];
+        State& state = states[access.resource];
+        bool write = static_cast<bool>(access.access & WRITE_ACCESS);
+        bool release = final && resource.releaseDstQueueFamily !=
+                                    VK_QUEUE_FAMILY_IGNORED;
+
+        // Releasing ownership is a transition like a layout change
+        bool layoutChange =
+            resource.isImage && (access.layout != state.layout || release);
+
+        vk::PipelineStageFlags srcStages;
+        vk::AccessFlags srcAccess;
+
+        // Memory may still be in use by an aliased buffer
+        if (!state.used) {
+            for (FrameResource alias : resource.aliases) {
+                const State& aliasState = states[alias];
+                if (aliasState.used) {
+                    srcStages |= aliasState.writeStages | aliasState.readStages;
+                    srcAccess |= aliasState.writeAccess;
+                }
+            }
+        }
+
+        bool visible =
+            (access.access & ~state.visibleAccess) == vk::AccessFlags{} &&
+            (access.stages & ~state.visibleStages) == vk::PipelineStageFlags{};
+        if (write || layoutChange) {
+            srcStages |= state.writeStages | state.readStages;
+            srcAccess |= state.writeAccess;
+        } else if (state.writeAccess && !visible) {
+            srcStages |= state.writeStages;
+            srcAccess |= state.writeAccess;
+        }
+
+        bool needed = srcStages || layoutChange;
+        if (needed) {
+            stats.dependencyCount++;
+            barrier.srcStages |=
+                srcStages ? srcStages
+                          : vk::PipelineStageFlags{
+                                vk::PipelineStageFlagBits::eTopOfPipe};
+            barrier.dstStages |= access.stages;
+            if (resource.isImage) {
+                vk::ImageMemoryBarrier imageBarrier{};
+                imageBarrier.setSrcAccessMask(srcAccess);
+                imageBarrier.setDstAccessMask(access.access);
+                imageBarrier.setOldLayout(state.layout);
+                imageBarrier.setNewLayout(access.layout);
+                imageBarrier.setSrcQueueFamilyIndex(
+                    release ? resource.releaseSrcQueueFamily
+                            : VK_QUEUE_FAMILY_IGNORED);
+                imageBarrier.setDstQueueFamilyIndex(
+                    release ? resource.releaseDstQueueFamily
+                            : VK_QUEUE_FAMILY_IGNORED);
+                imageBarrier.setImage(resource.image);
+                imageBarrier.setSubresourceRange(
+                    {vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                     resource.layerCount});
+                barrier.imageBarriers.push_back(imageBarrier);
+            } else {
+                barrier.memoryBarrier.srcAccessMask |= srcAccess;
+                barrier.memoryBarrier.dstAccessMask |= access.access;
+            }
+        }
+
+        // Update state
+        state.used = true;
+        if (write || layoutChange) {
+            state.writeStages = access.stages;
+            state.writeAccess = access.access & WRITE_ACCESS;
+            state.readStages = write ? vk::PipelineStageFlags{} : access.stages;
+            state.visibleStages = access.stages;
+            state.visibleAccess = access.access;
+        } else {
+            state.readStages |= access.stages;
+            if (needed) {
+                state.visibleStages |= access.stages;
+                state.visibleAccess |= access.access;
+            }
+        }
+        if (resource.isImage) {
+            state.layout = access.layout;
+        }
+    }
+
+    void recordBarrier(vk::CommandBuffer commandBuffer,
+                       const Barrier& barrier) {
+        if (!barrier.srcStages) {
+            return;
+        }
+        std::vector<vk::MemoryBarrier> memoryBarriers;
+        if (barrier.memoryBarrier.srcAccessMask ||
+            barrier.memoryBarrier.dstAccessMask) {
+            memoryBarriers.push_back(barrier.memoryBarrier);
+        }
+        commandBuffer.pipelineBarrier(barrier.srcStages, barrier.dstStages,
+                                      {}, memoryBarriers, {},
+                                      barrier.imageBarriers);
+        stats.barrierCount++;
+    }
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tracer.hpp"
+
+// Frames are only streamed on POSIX systems
+#ifndef _WIN32
+#define FRAME_STREAM_SUPPORTED
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pixel layouts of --stream, e.g. for
+// ffmpeg -f rawvideo -pix_fmt rgba -s 1920x1080 -r 60 -i pipe ...
+enum class StreamFormat : uint32_t {
+    RGBA,  // 4 bytes per pixel
+    NV12,  // 8-bit luma plane, then U and V interleaved at half resolution
+};
+
+inline size_t getStreamFrameSize(StreamFormat format,
+                                 uint32_t width,
+                                 uint32_t height) {
+    size_t pixelCount = size_t{width} * height;
+    return format == StreamFormat::NV12 ? pixelCount * 3 / 2
+                                        : pixelCount * 4;
+}
+
+#ifdef FRAME_STREAM_SUPPORTED
+// Largest size of one write() call, also the size requested for pipes
+constexpr size_t STREAM_WRITE_SIZE = 1 << 20;
+
+// Opens stdout for "-", otherwise the file or named pipe at path. A named
+// pipe is created if nothing exists at path, and opening it waits for a
+// reader. Returns -1 on failure.
+inline int openFrameStream(const std::string& path) {
+    int fd = -1;
+    if (path == "-") {
+        // Everything else printed to stdout goes to stderr, so that only
+        // frames reach the pipe
+        std::cout.flush();
+        fd = ::dup(STDOUT_FILENO);
+        ::dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        struct stat status = {};
+        if (::stat(path.c_str(), &status) != 0 &&
+            ::mkfifo(path.c_str(), 0644) != 0) {
+            return -1;
+        }
+        std::cout << "Waiting for a reader on " << path << "\n";
+        fd = ::open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    }
+
+#ifdef F_SETPIPE_SZ
+    // A larger pipe takes a whole write with fewer wake-ups of the reader
+    struct stat status = {};
+    if (fd >= 0 && ::fstat(fd, &status) == 0 && S_ISFIFO(status.st_mode)) {
+        ::fcntl(fd, F_SETPIPE_SZ, static_cast<int>(STREAM_WRITE_SIZE));
+    }
+#endif
+    return fd;
+}
+
+// Writes size bytes in calls of STREAM_WRITE_SIZE. Each slot is mapped
+// from its own allocation, so calls start at aligned offsets of an
+// aligned mapping. Returns false if the reader is gone.
+inline bool writeFrameData(int fd, const uint8_t* data, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        size_t chunk = std::min(size - offset, STREAM_WRITE_SIZE);
+        ssize_t written = ::write(fd, data + offset, chunk);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        offset += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Writes frames to a file descriptor on its own thread. Frames are slots
+// of a ring of host-visible buffers that the GPU copies into; a slot is
+// free again once its frame has been written, so rendering only waits
+// for the pipe when the reader falls behind by the whole ring.
+class FrameStreamWriter {
+public:
+    FrameStreamWriter() = default;
+    FrameStreamWriter(const FrameStreamWriter&) = delete;
+    FrameStreamWriter& operator=(const FrameStreamWriter&) = delete;
+    ~FrameStreamWriter() { finish(); }
+
+    // Takes ownership of fd
+    void init(int fd, uint32_t slotCount) {
+        this->fd = fd;
+        queued.assign(slotCount, false);
+        thread = std::thread{[this] { writeFrames(); }};
+    }
+
+    // Waits until the last frame of the slot has been written. Returns
+    // false once a write failed, e.g. because the reader closed the pipe.
+    bool acquireSlot(uint32_t slot) {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock{mutex};
+        condition.wait(lock, [&] { return !queued[slot] || failed; });
+        stallTime += std::chrono::steady_clock::now() - start;
+        return !failed;
+    }
+
+    // Queues size bytes at data, which must stay valid until the slot is
+    // acquired again
+    void submit(uint32_t slot, const void* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            queued[slot] = true;
+            frames.push_back({slot, static_cast<const uint8_t*>(data), size});
+        }
+        condition.notify_all();
+    }
+
+    // Writes the queued frames, then stops the thread and closes the file
+    void finish() {
+        if (!thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        condition.notify_all();
+        thread.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    uint64_t getWrittenBytes() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return writtenBytes;
+    }
+
+    // Time spent in write() calls
+    double getWriteMs() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return writeTime.count();
+    }
+
+    // Time the renderer waited for a free slot
+    double getStallMs() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return stallTime.count();
+    }
+
+private:
+    struct QueuedFrame {
+        uint32_t slot;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    int fd = -1;
+    std::thread thread;
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<QueuedFrame> frames;
+    std::vector<bool> queued;
+    bool stopping = false;
+    bool failed = false;
+    uint64_t writtenBytes = 0;
+    std::chrono::duration<double, std::milli> writeTime{};
+    std::chrono::duration<double, std::milli> stallTime{};
+
+    void writeFrames() {
+        trace::Tracer::get().setThreadName("Stream writer");
+        while (true) {
+            QueuedFrame frame{};
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                condition.wait(lock,
+                               [&] { return !frames.empty() || stopping; });
+                if (frames.empty()) {
+                    return;
+                }
+                frame = frames.front();
+                frames.pop_front();
+            }
+
+            // Frames after a failed write are dropped
+            auto start = std::chrono::steady_clock::now();
+            bool written = false;
+            if (!failed) {
+                trace::Scope scope{"Write frame"};
+                written = writeFrameData(fd, frame.data, frame.size);
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                queued[frame.slot] = false;
+                failed = failed || !written;
+                if (written) {
+                    writtenBytes += frame.size;
+                    writeTime += std::chrono::steady_clock::now() - start;
+                }
+            }
+            condition.notify_all();
+        }
+    }
+};
+#endif
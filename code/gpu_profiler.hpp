@@ -0,0 +1,228 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+
+#include "tracer.hpp"
+#include "vkutils.hpp"
+
+// Measures named GPU passes with timestamp queries and adds them to the
+// GPU track of trace::Tracer. Timestamps are converted to the host clock
+// with VK_EXT_calibrated_timestamps when available, otherwise with a
+// one-time estimate taken around a submission.
+class GpuProfiler {
+public:
+    static constexpr uint32_t MAX_QUERIES = 64;
+
+    void init(vk::PhysicalDevice physicalDevice,
+              vk::Device device,
+              vk::CommandPool commandPool,
+              vk::Queue queue,
+              uint32_t queueFamilyIndex,
+              bool calibratedTimestampsEnabled) {
+        this->device = device;
+
+        auto queueFamilies = physicalDevice.getQueueFamilyProperties();
+        vk::PhysicalDeviceLimits limits = physicalDevice.getProperties().limits;
+        if (queueFamilies[queueFamilyIndex].timestampValidBits == 0) {
+            std::cerr << "Timestamps are not supported by the queue.\n";
+            return;
+        }
+        timestampPeriod = limits.timestampPeriod;
+
+        vk::QueryPoolCreateInfo createInfo{};
+        createInfo.setQueryType(vk::QueryType::eTimestamp);
+        createInfo.setQueryCount(MAX_QUERIES);
+        queryPool = device.createQueryPoolUnique(createInfo);
+        vkutils::setObjectName(device, *queryPool, "Timestamp queries");
+
+        // Prefer the host domain matching std::chrono::steady_clock
+        useCalibratedTimestamps = calibratedTimestampsEnabled;
+        if (useCalibratedTimestamps) {
+#ifdef __linux__
+            auto domains = physicalDevice.getCalibrateableTimeDomainsEXT();
+            for (auto domain : domains) {
+                if (domain == vk::TimeDomainEXT::eClockMonotonic) {
+                    useMonotonicDomain = true;
+                }
+            }
+#endif
+            calibrate();
+        } else {
+            // Write a timestamp and take the middle of the submission
+            int64_t hostBeginNs = trace::Tracer::nowNs();
+            vkutils::oneTimeSubmit(
+                device, commandPool, queue,
+                [&](vk::CommandBuffer commandBuffer) {
+                    commandBuffer.resetQueryPool(*queryPool, 0, 1);
+                    commandBuffer.writeTimestamp(
+                        vk::PipelineStageFlagBits::eBottomOfPipe, *queryPool,
+                        0);
+                });
+            int64_t hostEndNs = trace::Tracer::nowNs();
+            calibrationTicks = readQueries(1).front();
+            calibrationHostNs = (hostBeginNs + hostEndNs) / 2;
+        }
+    }
+
+    // Records timestamps around a pass and labels it for GPU captures
+    class Scope {
+    public:
+        Scope(GpuProfiler* profiler,
+              vk::CommandBuffer commandBuffer,
+              const char* name)
+            : label{commandBuffer, name},
+              profiler{profiler && profiler->queryPool ? profiler : nullptr},
+              commandBuffer{commandBuffer} {
+            if (this->profiler) {
+                query = this->profiler->beginPass(commandBuffer, name);
+            }
+        }
+
+        ~Scope() {
+            if (profiler && query != UINT32_MAX) {
+                commandBuffer.writeTimestamp(
+                    vk::PipelineStageFlagBits::eBottomOfPipe,
+                    *profiler->queryPool, query + 1);
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        vkutils::DebugLabel label;
+        GpuProfiler* profiler;
+        vk::CommandBuffer commandBuffer;
+        uint32_t query = UINT32_MAX;
+    };
+
+    // Reads back all passes recorded since the last call.
+    // The command buffers containing them must have completed.
+    void resolve() {
+        if (passes.empty()) {
+            return;
+        }
+
+        if (useCalibratedTimestamps) {
+            calibrate();
+        }
+
+        std::vector<uint64_t> timestamps = readQueries(queryCount);
+        trace::EventBuffer* track = nullptr;
+        if (trace::Tracer::get().isEnabled()) {
+            track = &trace::Tracer::get().gpuTrack("Queue");
+        }
+        for (const auto& pass : passes) {
+            int64_t beginNs = toHostNs(timestamps[pass.query]);
+            int64_t endNs = toHostNs(timestamps[pass.query + 1]);
+            setDurationMs(pass.name, (endNs - beginNs) / 1e6);
+            if (track) {
+                track->push({pass.name, "gpu", beginNs, endNs - beginNs});
+            }
+        }
+        passes.clear();
+        queryCount = 0;
+    }
+
+    // Returns the duration of the last resolved pass with this name
+    double getDurationMs(const char* name) const {
+        for (const auto& duration : durations) {
+            if (std::strcmp(duration.first, name) == 0) {
+                return duration.second;
+            }
+        }
+        return 0.0;
+    }
+
+private:
+    struct Pass {
+        const char* name;
+        uint32_t query;
+    };
+
+    vk::Device device;
+    vk::UniqueQueryPool queryPool;
+    float timestampPeriod = 1.0f;
+    bool useCalibratedTimestamps = false;
+    bool useMonotonicDomain = false;
+
+    // GPU ticks at calibrationHostNs
+    uint64_t calibrationTicks = 0;
+    int64_t calibrationHostNs = 0;
+
+    std::vector<Pass> passes;
+    uint32_t queryCount = 0;
+    std::vector<std::pair<const char*, double>> durations;
+
+    uint32_t beginPass(vk::CommandBuffer commandBuffer, const char* name) {
+        if (queryCount + 2 > MAX_QUERIES) {
+            return UINT32_MAX;
+        }
+        // Reset all queries before the first pass after resolve()
+        if (queryCount == 0) {
+            commandBuffer.resetQueryPool(*queryPool, 0, MAX_QUERIES);
+        }
+        uint32_t query = queryCount;
+        queryCount += 2;
+        passes.push_back({name, query});
+        commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                     *queryPool, query);
+        return query;
+    }
+
+    std::vector<uint64_t> readQueries(uint32_t count) {
+        std::vector<uint64_t> timestamps(count);
+        vk::Result result = device.getQueryPoolResults(
+            *queryPool, 0, count, sizeof(uint64_t) * count, timestamps.data(),
+            sizeof(uint64_t),
+            vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+        if (result != vk::Result::eSuccess) {
+            std::cerr << "Failed to get timestamp query results.\n";
+        }
+        return timestamps;
+    }
+
+    void calibrate() {
+        std::array<vk::CalibratedTimestampInfoEXT, 2> infos{};
+        infos[0].setTimeDomain(vk::TimeDomainEXT::eDevice);
+        infos[1].setTimeDomain(vk::TimeDomainEXT::eClockMonotonic);
+        uint32_t count = useMonotonicDomain ? 2 : 1;
+
+        std::array<uint64_t, 2> timestamps{};
+        uint64_t maxDeviation = 0;
+        int64_t hostBeginNs = trace::Tracer::nowNs();
+        VkResult result =
+            VULKAN_HPP_DEFAULT_DISPATCHER.vkGetCalibratedTimestampsEXT(
+                device, count,
+                reinterpret_cast<const VkCalibratedTimestampInfoEXT*>(
+                    infos.data()),
+                timestamps.data(), &maxDeviation);
+        int64_t hostEndNs = trace::Tracer::nowNs();
+        if (result != VK_SUCCESS) {
+            std::cerr << "Failed to get calibrated timestamps.\n";
+            return;
+        }
+
+        calibrationTicks = timestamps[0];
+        calibrationHostNs = useMonotonicDomain
+                                ? static_cast<int64_t>(timestamps[1])
+                                : (hostBeginNs + hostEndNs) / 2;
+    }
+
+    int64_t toHostNs(uint64_t ticks) const {
+        int64_t deltaTicks = static_cast<int64_t>(ticks - calibrationTicks);
+        return calibrationHostNs +
+               static_cast<int64_t>(deltaTicks * double{timestampPeriod});
+    }
+
+    void setDurationMs(const char* name, double durationMs) {
+        for (auto& duration : durations) {
+            if (std::strcmp(duration.first, name) == 0) {
+                duration.second = durationMs;
+                return;
+            }
+        }
+        durations.emplace_back(name, durationMs);
+    }
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing task scheduler.
+// Every thread owns a deque: it pushes and pops its own tasks at the back
+// (LIFO, cache friendly) and steals from the front of other deques (FIFO).
+// Thread 0 is the thread that owns the JobSystem; it runs tasks while it
+// is blocked in wait().
+class JobSystem {
+public:
+    class Task {
+    public:
+        bool isDone() const { return done.load(std::memory_order_acquire); }
+
+    private:
+        friend class JobSystem;
+
+        std::function<void()> func;
+
+        // Unfinished dependencies + 1 until the task is submitted
+        std::atomic<uint32_t> pendingCount{1};
+
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Task>> continuations;
+        std::atomic<bool> done{false};
+    };
+    using TaskPtr = std::shared_ptr<Task>;
+
+    explicit JobSystem(uint32_t workerCount) : queues(workerCount + 1) {
+        for (uint32_t i = 0; i < workerCount; i++) {
+            workers.emplace_back([this, i] { workerLoop(i + 1); });
+        }
+    }
+
+    ~JobSystem() {
+        {
+            std::lock_guard<std::mutex> lock{sleepMutex};
+            stopping = true;
+        }
+        sleepCondition.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    // Threads that execute tasks, including the owning thread
+    uint32_t getThreadCount() const {
+        return static_cast<uint32_t>(queues.size());
+    }
+
+    // Index of the calling thread (0 for threads that are not workers).
+    // Use this to pick per-thread resources such as command pools.
+    static uint32_t getThreadIndex() { return threadIndex(); }
+
+    // The task does not run before submit()
+    TaskPtr create(std::function<void()> func) {
+        auto task = std::make_shared<Task>();
+        task->func = std::move(func);
+        return task;
+    }
+
+    // Must be called before the task is submitted
+    void addDependency(const TaskPtr& task, const TaskPtr& dependency) {
+        std::lock_guard<std::mutex> lock{dependency->mutex};
+        if (dependency->isDone()) {
+            return;
+        }
+        task->pendingCount.fetch_add(1, std::memory_order_relaxed);
+        dependency->continuations.push_back(task);
+    }
+
+    void submit(const TaskPtr& task) { release(task); }
+
+    TaskPtr run(std::function<void()> func) {
+        TaskPtr task = create(std::move(func));
+        submit(task);
+        return task;
+    }
+
+    // Runs func once task has finished
+    TaskPtr then(const TaskPtr& task, std::function<void()> func) {
+        TaskPtr continuation = create(std::move(func));
+        addDependency(continuation, task);
+        submit(continuation);
+        return continuation;
+    }
+
+    // Runs func once all tasks have finished
+    TaskPtr whenAll(const std::vector<TaskPtr>& tasks,
+                    std::function<void()> func = [] {}) {
+        TaskPtr continuation = create(std::move(func));
+        for (const auto& task : tasks) {
+            addDependency(continuation, task);
+        }
+        submit(continuation);
+        return continuation;
+    }
+
+    // Executes other tasks on the calling thread until the task is done
+    void wait(const TaskPtr& task) {
+        while (!task->isDone()) {
+            if (TaskPtr next = findTask(threadIndex())) {
+                execute(next);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Splits [0, count) into chunks and runs func(begin, end) in parallel
+    void parallelFor(uint32_t count,
+                     uint32_t chunkSize,
+                     const std::function<void(uint32_t, uint32_t)>& func) {
+        std::vector<TaskPtr> tasks;
+        for (uint32_t begin = 0; begin < count; begin += chunkSize) {
+            uint32_t end = std::min(begin + chunkSize, count);
+            tasks.push_back(run([&func, begin, end] { func(begin, end); }));
+        }
+        wait(whenAll(tasks));
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<TaskPtr> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+    std::atomic<uint32_t> queuedCount{0};
+    bool stopping = false;
+
+    static uint32_t& threadIndex() {
+        thread_local uint32_t index = 0;
+        return index;
+    }
+
+    // Schedules the task once its last dependency is released
+    void release(const TaskPtr& task) {
+        if (task->pendingCount.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        uint32_t index = threadIndex();
+        if (index >= queues.size()) {
+            index = 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock{queues[index].mutex};
+            queues[index].tasks.push_back(task);
+        }
+        queuedCount.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock{sleepMutex};
+        }
+        sleepCondition.notify_one();
+    }
+
+    TaskPtr findTask(uint32_t index) {
+        // Own queue first (newest task)
+        {
+            Queue& queue = queues[index];
+            std::lock_guard<std::mutex> lock{queue.mutex};
+            if (!queue.tasks.empty()) {
+                TaskPtr task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                queuedCount.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+
+        // Steal the oldest task from another queue
+        uint32_t count = static_cast<uint32_t>(queues.size());
+        for (uint32_t offset = 1; offset < count; offset++) {
+            Queue& queue = queues[(index + offset) % count];
+            std::lock_guard<std::mutex> lock{queue.mutex};
+            if (!queue.tasks.empty()) {
+                TaskPtr task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queuedCount.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(const TaskPtr& task) {
+        task->func();
+        task->func = nullptr;
+
+        std::vector<TaskPtr> continuations;
+        {
+            std::lock_guard<std::mutex> lock{task->mutex};
+            task->done.store(true, std::memory_order_release);
+            continuations.swap(task->continuations);
+        }
+        for (const auto& continuation : continuations) {
+            release(continuation);
+        }
+    }
+
+    void workerLoop(uint32_t index) {
+        threadIndex() = index;
+        while (true) {
+            if (TaskPtr task = findTask(index)) {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock{sleepMutex};
+            sleepCondition.wait(lock, [this] {
+                return stopping ||
+                       queuedCount.load(std::memory_order_acquire) > 0;
+            });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+};
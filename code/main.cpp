@@ -1,6 +1,67 @@
-#include "10_draw_triangle.hpp"
+#include "app.hpp"
+#include "render_coordinator.hpp"
 
-int main() {
-    Application app;
+int main(int argc, char** argv) {
+    Options options = parseOptions(argc, argv);
+    if (options.loadScaling) {
+        benchmarkSceneLoad(options.meshPaths);
+        return 0;
+    }
+    if (options.transformBenchmark) {
+        benchmarkInstanceTransforms(options.getWorkerCount());
+        return 0;
+    }
+    if (options.sceneGraphBenchmark) {
+        benchmarkSceneGraph();
+        return 0;
+    }
+    if (options.bvhReport) {
+        printBvhReport(options.meshPaths, options.getWorkerCount());
+        return 0;
+    }
+    if (!options.makeVoxelsPath.empty()) {
+        bool written =
+            writeBricks(options.makeVoxelsPath, createTestVoxelGrid());
+        return written ? 0 : 1;
+    }
+    if (!options.makeCurvesPath.empty()) {
+        bool written = writeCurves(options.makeCurvesPath, createTestCurves());
+        return written ? 0 : 1;
+    }
+    if (!options.clientSocketPath.empty()) {
+#ifdef SOCKETS_SUPPORTED
+        std::string scenePath =
+            options.meshPaths.empty() ? "" : options.meshPaths[0];
+        return runRenderClient(options.clientSocketPath, scenePath) ? 0 : 1;
+#else
+        std::cerr << "Client mode requires POSIX sockets.\n";
+        return 1;
+#endif
+    }
+
+    if (!options.consumeSocketPath.empty()) {
+#ifdef SOCKETS_SUPPORTED
+        return runFrameConsumer(options.consumeSocketPath) ? 0 : 1;
+#else
+        std::cerr << "Consumer mode requires POSIX file descriptors.\n";
+        return 1;
+#endif
+    }
+    if (!options.workerAddresses.empty() || options.localWorkerCount > 0) {
+#ifdef SOCKETS_SUPPORTED
+        std::string scenePath =
+            options.meshPaths.empty() ? "" : options.meshPaths[0];
+        return runCoordinator(options.workerAddresses,
+                              options.localWorkerCount,
+                              options.executablePath, scenePath)
+                   ? 0
+                   : 1;
+#else
+        std::cerr << "Coordinator mode requires POSIX sockets.\n";
+        return 1;
+#endif
+    }
+
+    Application app{options};
     app.run();
 }
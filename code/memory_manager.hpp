@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "vkutils.hpp"
+
+struct MemoryPolicy {
+    // Budget callbacks are raised when a heap goes above this fraction of
+    // its budget
+    float warningRatio = 0.9f;
+
+    // Allocations that only require device-local memory go to a
+    // host-visible heap instead if they would push their heap above this
+    // fraction of its budget
+    bool allowSpill = true;
+    float spillRatio = 0.95f;
+
+    // Overrides the budget of device-local heaps (0: driver budget)
+    vk::DeviceSize deviceLocalBudget = 0;
+};
+
+struct HeapBudget {
+    vk::DeviceSize size = 0;
+    vk::DeviceSize budget = 0;
+    vk::DeviceSize usage = 0;
+    bool deviceLocal = false;
+
+    // Raised a warning that has not been cleared yet
+    bool warned = false;
+
+    float getUsageRatio() const {
+        return budget > 0 ? static_cast<float>(usage) / budget : 0.0f;
+    }
+};
+
+class MemoryManager;
+
+// Device memory allocated by a MemoryManager. Freeing it gives its size
+// back to the heap usage, so the manager must outlive it.
+class DeviceMemory {
+public:
+    DeviceMemory() = default;
+    DeviceMemory(DeviceMemory&& other) noexcept { *this = std::move(other); }
+    DeviceMemory& operator=(DeviceMemory&& other) noexcept;
+    ~DeviceMemory() { reset(); }
+
+    void reset();
+
+    vk::DeviceMemory get() const { return memory.get(); }
+    vk::DeviceMemory operator*() const { return memory.get(); }
+    explicit operator bool() const { return static_cast<bool>(memory); }
+
+private:
+    friend class MemoryManager;
+
+    vk::UniqueDeviceMemory memory;
+    MemoryManager* manager = nullptr;
+    uint32_t heapIndex = 0;
+    vk::DeviceSize size = 0;
+    bool spilled = false;
+};
+
+// Allocates device memory and tracks per-heap usage against the budget.
+// Memory properties are queried once. With VK_EXT_memory_budget the
+// usage and budget come from the driver and are refreshed by
+// updateBudget(); without it the budget is 80% of the heap size and the
+// usage counts the live allocations made here.
+// allocate() and frees may happen on several threads.
+class MemoryManager {
+public:
+    using BudgetCallback =
+        std::function<void(uint32_t heapIndex, const HeapBudget& heap)>;
+
+    void init(vk::PhysicalDevice physicalDevice,
+              bool memoryBudgetEnabled,
+              const MemoryPolicy& policy = {}) {
+        this->physicalDevice = physicalDevice;
+        this->memoryBudgetEnabled = memoryBudgetEnabled;
+        this->policy = policy;
+        properties = physicalDevice.getMemoryProperties();
+        heaps.resize(properties.memoryHeapCount);
+        for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+            const vk::MemoryHeap& heap = properties.memoryHeaps[i];
+            heaps[i].size = heap.size;
+            heaps[i].budget = heap.size / 10 * 8;
+            heaps[i].deviceLocal = static_cast<bool>(
+                heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+        }
+        updateBudget();
+    }
+
+    const vk::PhysicalDeviceMemoryProperties& getProperties() const {
+        return properties;
+    }
+
+    // Called when a heap goes above policy.warningRatio of its budget
+    void addBudgetCallback(BudgetCallback callback) {
+        std::lock_guard<std::mutex> lock{mutex};
+        callbacks.push_back(std::move(callback));
+    }
+
+    // Refreshes usage and budget from the driver, e.g. once per frame
+    void updateBudget() {
+        std::unique_lock<std::mutex> lock{mutex};
+        if (memoryBudgetEnabled) {
+            auto chain = physicalDevice.getMemoryProperties2<
+                vk::PhysicalDeviceMemoryProperties2,
+                vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+            const auto& budget =
+                chain.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+            for (uint32_t i = 0; i < heaps.size(); i++) {
+                heaps[i].budget = budget.heapBudget[i];
+                heaps[i].usage = budget.heapUsage[i];
+            }
+        }
+        for (uint32_t i = 0; i < heaps.size(); i++) {
+            if (heaps[i].deviceLocal && policy.deviceLocalBudget > 0) {
+                heaps[i].budget = policy.deviceLocalBudget;
+            }
+            checkBudget(i);
+        }
+        raiseWarnings(lock);
+    }
+
+    std::vector<HeapBudget> getHeapBudgets() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return heaps;
+    }
+
+    // Returns the first type allowed by memoryTypeBits with the required
+    // properties whose heap stays below the spill ratio. Under pressure,
+    // device-local requests fall back to a host-visible type.
+    uint32_t findMemoryType(uint32_t memoryTypeBits,
+                            vk::MemoryPropertyFlags required,
+                            vk::DeviceSize size) const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return findMemoryTypeLocked(memoryTypeBits, required, size);
+    }
+
+    // Spilled allocations are still usable but slower to access from the
+    // GPU. next is chained to the allocate info (e.g. export info) and
+    // the chosen type is written to memoryTypeIndex if not null.
+    DeviceMemory allocate(
+        vk::Device device,
+        const vk::MemoryRequirements& memoryReq,
+        vk::MemoryPropertyFlags required,
+        const char* name,
+        vk::MemoryAllocateFlags flags = {},
+        const void* next = nullptr,
+        uint32_t* memoryTypeIndex = nullptr) {
+        std::unique_lock<std::mutex> lock{mutex};
+        uint32_t memoryType = findMemoryTypeLocked(memoryReq.memoryTypeBits,
+                                                   required, memoryReq.size);
+        if (memoryTypeIndex) {
+            *memoryTypeIndex = memoryType;
+        }
+        const vk::MemoryType& type = properties.memoryTypes[memoryType];
+        DeviceMemory memory;
+        memory.manager = this;
+        memory.heapIndex = type.heapIndex;
+        memory.size = memoryReq.size;
+        memory.spilled = (type.propertyFlags & required) != required;
+        heaps[type.heapIndex].usage += memoryReq.size;
+        if (memory.spilled) {
+            spilledSize += memoryReq.size;
+        }
+        checkBudget(type.heapIndex);
+        raiseWarnings(lock);
+
+        vk::MemoryAllocateFlagsInfo allocateFlags{};
+        allocateFlags.flags = flags;
+        allocateFlags.pNext = next;
+        vk::MemoryAllocateInfo allocateInfo{};
+        allocateInfo.setAllocationSize(memoryReq.size);
+        allocateInfo.setMemoryTypeIndex(memoryType);
+        allocateInfo.setPNext(&allocateFlags);
+        memory.memory = device.allocateMemoryUnique(allocateInfo);
+        vkutils::setObjectName(device, *memory, name);
+        return memory;
+    }
+
+    // Total size of the allocations that went to host-visible memory
+    vk::DeviceSize getSpilledSize() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return spilledSize;
+    }
+
+    void printSummary() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto toMiB = [](vk::DeviceSize size) {
+            return static_cast<double>(size) / (1024.0 * 1024.0);
+        };
+        std::cout << "Memory heaps"
+                  << (memoryBudgetEnabled ? "" : " (estimated, no budget "
+                                                 "extension)")
+                  << ":\n";
+        for (uint32_t i = 0; i < heaps.size(); i++) {
+            const HeapBudget& heap = heaps[i];
+            std::cout << "  Heap " << i
+                      << (heap.deviceLocal ? " (device-local): " : ": ")
+                      << toMiB(heap.usage) << " / " << toMiB(heap.budget)
+                      << " MiB used (size " << toMiB(heap.size) << " MiB)\n";
+        }
+        if (spilledSize > 0) {
+            std::cout << "  Spilled to host-visible memory: "
+                      << toMiB(spilledSize) << " MiB\n";
+        }
+    }
+
+private:
+    friend class DeviceMemory;
+
+    vk::PhysicalDevice physicalDevice;
+    bool memoryBudgetEnabled = false;
+    MemoryPolicy policy;
+    vk::PhysicalDeviceMemoryProperties properties;
+
+    mutable std::mutex mutex;
+    std::vector<HeapBudget> heaps;
+    std::vector<BudgetCallback> callbacks;
+    std::vector<std::pair<uint32_t, HeapBudget>> warnings;
+    vk::DeviceSize spilledSize = 0;
+
+    uint32_t findMemoryTypeLocked(uint32_t memoryTypeBits,
+                                  vk::MemoryPropertyFlags required,
+                                  vk::DeviceSize size) const {
+        auto find = [&](vk::MemoryPropertyFlags flags, bool checkBudget) {
+            for (uint32_t i = 0; i < properties.memoryTypeCount; i++) {
+                const vk::MemoryType& type = properties.memoryTypes[i];
+                if (!(memoryTypeBits & (1u << i)) ||
+                    (type.propertyFlags & flags) != flags) {
+                    continue;
+                }
+                const HeapBudget& heap = heaps[type.heapIndex];
+                if (checkBudget &&
+                    heap.usage + size > policy.spillRatio * heap.budget) {
+                    continue;
+                }
+                return i;
+            }
+            return UINT32_MAX;
+        };
+
+        uint32_t memoryType = find(required, policy.allowSpill);
+        bool spillable =
+            required == vk::MemoryPropertyFlags{
+                            vk::MemoryPropertyFlagBits::eDeviceLocal};
+        if (memoryType == UINT32_MAX && spillable && policy.allowSpill) {
+            memoryType = find(vk::MemoryPropertyFlagBits::eHostVisible, true);
+        }
+        if (memoryType == UINT32_MAX) {
+            // Over budget everywhere, let the allocation decide
+            memoryType = find(required, false);
+        }
+        if (memoryType == UINT32_MAX) {
+            std::cerr << "Failed to get memory type index.\n";
+            std::abort();
+        }
+        return memoryType;
+    }
+
+    // The driver's usage may already be refreshed without the allocation
+    void release(const DeviceMemory& memory) {
+        std::lock_guard<std::mutex> lock{mutex};
+        HeapBudget& heap = heaps[memory.heapIndex];
+        heap.usage -= std::min(heap.usage, memory.size);
+        if (memory.spilled) {
+            spilledSize -= memory.size;
+        }
+        checkBudget(memory.heapIndex);
+    }
+
+    // Queues a warning once per crossing of the warning ratio
+    void checkBudget(uint32_t heapIndex) {
+        HeapBudget& heap = heaps[heapIndex];
+        bool over = heap.getUsageRatio() > policy.warningRatio;
+        if (over && !heap.warned) {
+            warnings.push_back({heapIndex, heap});
+        }
+        heap.warned = over;
+    }
+
+    // Callbacks run unlocked so that they can query the manager
+    void raiseWarnings(std::unique_lock<std::mutex>& lock) {
+        if (warnings.empty()) {
+            lock.unlock();
+            return;
+        }
+        auto raised = std::move(warnings);
+        warnings.clear();
+        auto callbacksCopy = callbacks;
+        lock.unlock();
+        for (const auto& [heapIndex, heap] : raised) {
+            for (const auto& callback : callbacksCopy) {
+                callback(heapIndex, heap);
+            }
+        }
+    }
+};
+
+inline DeviceMemory& DeviceMemory::operator=(DeviceMemory&& other) noexcept {
+    if (this != &other) {
+        reset();
+        memory = std::move(other.memory);
+        manager = std::exchange(other.manager, nullptr);
+        heapIndex = other.heapIndex;
+        size = other.size;
+        spilled = other.spilled;
+    }
+    return *this;
+}
+
+inline void DeviceMemory::reset() {
+    if (manager) {
+        memory.reset();
+        manager->release(*this);
+        manager = nullptr;
+    }
+}
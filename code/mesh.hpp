@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Vertex {
+    float pos[3];
+};
+
+struct Aabb {
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    void extend(const float point[3]) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = std::min(min[axis], point[axis]);
+            max[axis] = std::max(max[axis], point[axis]);
+        }
+    }
+
+    void extend(const Aabb& other) {
+        extend(other.min);
+        extend(other.max);
+    }
+
+    bool isEmpty() const { return min[0] > max[0]; }
+};
+
+struct Mesh {
+    std::string name;
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    Aabb bounds;
+
+    uint32_t getTriangleCount() const {
+        return static_cast<uint32_t>(indices.size() / 3);
+    }
+};
+
+inline Mesh createTriangleMesh() {
+    Mesh mesh;
+    mesh.name = "Triangle";
+    mesh.vertices = {
+        {{1.0f, 1.0f, 0.0f}},
+        {{-1.0f, 1.0f, 0.0f}},
+        {{0.0f, -1.0f, 0.0f}},
+    };
+    mesh.indices = {0, 1, 2};
+    return mesh;
+}
+
+// Loads positions and faces of a Wavefront OBJ file.
+// Polygons are triangulated as fans. Returns false with a message if the
+// file cannot be opened or a face refers to a missing vertex.
+inline bool tryLoadObj(const std::string& filename,
+                       Mesh& mesh,
+                       std::string& error) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        error = "Failed to open " + filename;
+        return false;
+    }
+
+    mesh = Mesh{};
+    mesh.name = filename;
+
+    std::string line;
+    std::vector<uint32_t> face;
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::string type;
+        stream >> type;
+        if (type == "v") {
+            Vertex vertex{};
+            stream >> vertex.pos[0] >> vertex.pos[1] >> vertex.pos[2];
+            mesh.vertices.push_back(vertex);
+        } else if (type == "f") {
+            // Each element is "v", "v/vt", "v//vn" or "v/vt/vn"
+            face.clear();
+            std::string element;
+            while (stream >> element) {
+                long index = std::strtol(element.c_str(), nullptr, 10);
+                if (index < 0) {
+                    index += static_cast<long>(mesh.vertices.size()) + 1;
+                }
+                face.push_back(static_cast<uint32_t>(index - 1));
+            }
+            for (uint32_t index : face) {
+                if (index >= mesh.vertices.size()) {
+                    error = "Invalid vertex index in " + filename;
+                    return false;
+                }
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[i - 1]);
+                mesh.indices.push_back(face[i]);
+            }
+        }
+    }
+    return true;
+}
+
+inline Mesh loadObj(const std::string& filename) {
+    Mesh mesh;
+    std::string error;
+    if (!tryLoadObj(filename, mesh, error)) {
+        std::cerr << error << "\n";
+        std::abort();
+    }
+    return mesh;
+}
+
+// Welds vertices with identical positions, removes degenerate triangles
+// and renumbers vertices in order of first use for better memory locality.
+inline void optimizeMesh(Mesh& mesh) {
+    struct PositionHash {
+        size_t operator()(const Vertex& v) const {
+            size_t hash = 0;
+            for (float value : v.pos) {
+                hash = hash * 31 + std::hash<float>{}(value);
+            }
+            return hash;
+        }
+    };
+    struct PositionEqual {
+        bool operator()(const Vertex& a, const Vertex& b) const {
+            return a.pos[0] == b.pos[0] && a.pos[1] == b.pos[1] &&
+                   a.pos[2] == b.pos[2];
+        }
+    };
+
+    // Map each vertex to the first vertex with the same position
+    std::unordered_map<Vertex, uint32_t, PositionHash, PositionEqual> unique;
+    std::vector<uint32_t> weld(mesh.vertices.size());
+    for (uint32_t i = 0; i < mesh.vertices.size(); i++) {
+        weld[i] = unique.emplace(mesh.vertices[i], i).first->second;
+    }
+
+    std::vector<uint32_t> remap(mesh.vertices.size(), UINT32_MAX);
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    vertices.reserve(unique.size());
+    indices.reserve(mesh.indices.size());
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        uint32_t tri[3];
+        for (int k = 0; k < 3; k++) {
+            uint32_t index = mesh.indices[i + k];
+            if (index >= mesh.vertices.size()) {
+                index = 0;
+            }
+            tri[k] = weld[index];
+        }
+        if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) {
+            continue;
+        }
+        for (uint32_t index : tri) {
+            if (remap[index] == UINT32_MAX) {
+                remap[index] = static_cast<uint32_t>(vertices.size());
+                vertices.push_back(mesh.vertices[index]);
+            }
+            indices.push_back(remap[index]);
+        }
+    }
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(indices);
+}
+
+inline void computeBounds(Mesh& mesh) {
+    mesh.bounds = Aabb{};
+    for (const auto& vertex : mesh.vertices) {
+        mesh.bounds.extend(vertex.pos);
+    }
+}
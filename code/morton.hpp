@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "mesh.hpp"
+
+// Inserts two zero bits between each of the lower 10 bits of v
+inline uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point in [0, 1]^3
+inline uint32_t mortonCode(float x, float y, float z) {
+    auto quantize = [](float v) {
+        return static_cast<uint32_t>(std::clamp(v * 1024.0f, 0.0f, 1023.0f));
+    };
+    return (expandBits(quantize(x)) << 2) | (expandBits(quantize(y)) << 1) |
+           expandBits(quantize(z));
+}
+
+// Sorts keys ascending and applies the same permutation to values.
+// LSD radix sort with 8 bits per pass; passes over bits that are zero in
+// every key are skipped.
+inline void radixSort(std::vector<uint32_t>& keys,
+                      std::vector<uint32_t>& values) {
+    uint32_t usedBits = 0;
+    for (uint32_t key : keys) {
+        usedBits |= key;
+    }
+
+    std::vector<uint32_t> tempKeys(keys.size());
+    std::vector<uint32_t> tempValues(values.size());
+    for (uint32_t shift = 0; shift < 32; shift += 8) {
+        if (((usedBits >> shift) & 0xFF) == 0) {
+            continue;
+        }
+
+        std::array<uint32_t, 256> offsets{};
+        for (uint32_t key : keys) {
+            offsets[(key >> shift) & 0xFF]++;
+        }
+        uint32_t sum = 0;
+        for (uint32_t& offset : offsets) {
+            uint32_t count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for (size_t i = 0; i < keys.size(); i++) {
+            uint32_t dst = offsets[(keys[i] >> shift) & 0xFF]++;
+            tempKeys[dst] = keys[i];
+            tempValues[dst] = values[i];
+        }
+        keys.swap(tempKeys);
+        values.swap(tempValues);
+    }
+}
+
+// Returns the indices of the boxes ordered along the Z-order curve of
+// their centres, relative to the bounds of all centres
+inline std::vector<uint32_t> computeMortonOrder(
+    const std::vector<Aabb>& bounds) {
+    Aabb centroidBounds;
+    std::vector<std::array<float, 3>> centres(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            centres[i][axis] =
+                0.5f * (bounds[i].min[axis] + bounds[i].max[axis]);
+        }
+        centroidBounds.extend(centres[i].data());
+    }
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0.0f ? 1.0f / extent : 0.0f;
+    }
+
+    std::vector<uint32_t> keys(bounds.size());
+    std::vector<uint32_t> order(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        float p[3];
+        for (int axis = 0; axis < 3; axis++) {
+            p[axis] =
+                (centres[i][axis] - centroidBounds.min[axis]) * scale[axis];
+        }
+        keys[i] = mortonCode(p[0], p[1], p[2]);
+    }
+    std::iota(order.begin(), order.end(), 0);
+    radixSort(keys, order);
+    return order;
+}
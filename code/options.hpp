@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_stream.hpp"
+
+struct Options {
+    // Write frame stats as JSON to this file on exit
+    std::string benchmarkPath;
+
+    // Write startup phases as Chrome trace JSON to this file
+    std::string startupTracePath;
+
+    // Write the CPU/GPU timeline as Chrome trace JSON to this file on exit
+    std::string tracePath;
+
+    // OBJ files of the scene (a triangle if empty)
+    std::vector<std::string> meshPaths;
+
+    // Copies of the meshes scattered in random order (0: one per mesh)
+    uint32_t instanceCount = 0;
+
+    // Sort TLAS instances along a Z-order curve before the build
+    bool mortonSort = false;
+
+    // Scratch memory shared by the BLAS builds of one wave
+    uint32_t scratchBudgetMiB = 64;
+
+    // Print the properties of every acceleration structure after loading
+    bool inspectAccels = false;
+
+    // Print the frame graph's passes and transient memory after compiling
+    bool frameGraphReport = false;
+
+    // Budget of device-local heaps, allocations spill to host-visible
+    // memory beyond it (0: driver budget)
+    uint32_t memoryBudgetMiB = 0;
+
+    // Skinned characters deformed on the GPU every frame
+    uint32_t characterCount = 0;
+
+    // Rebuild a character BLAS instead of refitting it when its vertices
+    // moved more than this fraction of its size since the last build
+    float rebuildThreshold = 0.2f;
+
+    // Serve render jobs on this Unix domain socket without a window
+    std::string serverSocketPath;
+
+    // Send test jobs to the server on this socket, print their latency
+    // and exit. The first mesh path is sent as the scene.
+    std::string clientSocketPath;
+
+    // Render a frame split into tiles on these render servers and on
+    // localWorkerCount servers started on this machine, print how it
+    // scales from 1 to N workers and exit. The first mesh path is sent as
+    // the scene.
+    std::vector<std::string> workerAddresses;
+    uint32_t localWorkerCount = 0;
+
+    // Trace frames without a window into an image shared through file
+    // descriptors with a consumer connecting to this Unix domain socket
+    std::string exportSocketPath;
+
+    // Start the consumer of --export as a child process, check every
+    // frame it reads back and exit with an error on any mismatch
+    bool exportCheck = false;
+
+    // Import the frames exported on this socket, check them and exit
+    std::string consumeSocketPath;
+
+    // Trace frames without a window and write them as raw video to this
+    // file or named pipe ("-": stdout)
+    std::string streamPath;
+    StreamFormat streamFormat = StreamFormat::RGBA;
+    uint32_t streamWidth = 1920;
+    uint32_t streamHeight = 1080;
+
+    // Render the frames of a timeline without a window into numbered
+    // images in this directory, with sampleCount samples per pixel.
+    // The timeline of batch and motion blurred frames is read from
+    // timelinePath, or orbits the scene.
+    std::string batchDirectory;
+    std::string timelinePath;
+    uint32_t batchWidth = 1920;
+    uint32_t batchHeight = 1080;
+    uint32_t sampleCount = 64;
+
+    // Thin lens camera: radius of the lens in scene units (0: pinhole)
+    // and distance of the plane in focus along the view direction
+    float apertureRadius = 0.0f;
+    float focusDistance = 5.0f;
+
+    // Motion blur over the shutter interval, which is shutter frames long
+    // and centered on the frame time (1: no motion blur). Without
+    // VK_NV_ray_tracing_motion_blur the TLAS holds the instances at this
+    // many times of the interval.
+    uint32_t timeSliceCount = 1;
+    float shutter = 0.5f;
+
+    // Trace both eyes of --batch in one launch into the two layers of the
+    // render target, the eyes eyeDistance apart along the camera right
+    bool stereo = false;
+    float eyeDistance = 0.064f;
+
+    // Compare tracing one eye with tracing both eyes in one launch and exit
+    bool stereoBenchmark = false;
+
+    // Brick file of a voxel grid added to the scene, traced as one AABB
+    // per brick with an intersection shader
+    std::string voxelPath;
+
+    // Compare tracing the voxel grid as bricks with tracing its meshed
+    // faces and exit
+    bool voxelBenchmark = false;
+
+    // Write a procedural voxel grid to this brick file and exit
+    std::string makeVoxelsPath;
+
+    // Curve file of hair strands added to the scene, traced as AABBs
+    // around pieces of the segments with an intersection shader
+    std::string curvePath;
+
+    // Compare tracing the curves with tracing them as ribbons and exit
+    bool curveBenchmark = false;
+
+    // Write a procedural fur ball of 1M strands to this curve file and exit
+    std::string makeCurvesPath;
+
+    // Path of this program, to start local render servers
+    std::string executablePath;
+
+    // Job threads in addition to the main thread (default: cores - 1)
+    uint32_t workerCount = UINT32_MAX;
+
+    // Measure scene load time with 1 to N threads and exit
+    bool loadScaling = false;
+
+    // Measure command recording time with increasing pass counts and exit
+    bool recordBenchmark = false;
+
+    // Measure TLAS instance writes per millisecond and exit
+    bool transformBenchmark = false;
+
+    // Measure scene graph updates with 5% of the nodes moving and exit
+    bool sceneGraphBenchmark = false;
+
+    // Build a CPU BVH over each mesh, print quality metrics and exit
+    bool bvhReport = false;
+
+    // Exit after this many frames (0: run until the window is closed)
+    uint32_t frameCount = 0;
+
+    uint32_t getWorkerCount() const {
+        if (workerCount == UINT32_MAX) {
+            return std::max(1u, std::thread::hardware_concurrency()) - 1;
+        }
+        return workerCount;
+    }
+};
+
+// Parses <width>x<height>, leaving 0 for missing values
+inline void parseSize(const char* text, uint32_t& width, uint32_t& height) {
+    char* end = nullptr;
+    width = static_cast<uint32_t>(std::strtoul(text, &end, 10));
+    height = static_cast<uint32_t>(
+        *end == 'x' ? std::strtoul(end + 1, nullptr, 10) : 0);
+}
+
+inline Options parseOptions(int argc, char** argv) {
+    Options options{};
+    options.executablePath = argv[0];
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--benchmark" && hasValue) {
+            options.benchmarkPath = argv[++i];
+        } else if (arg == "--startup-trace" && hasValue) {
+            options.startupTracePath = argv[++i];
+        } else if (arg == "--trace" && hasValue) {
+            options.tracePath = argv[++i];
+        } else if (arg == "--mesh" && hasValue) {
+            options.meshPaths.push_back(argv[++i]);
+        } else if (arg == "--instances" && hasValue) {
+            options.instanceCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--morton-sort") {
+            options.mortonSort = true;
+        } else if (arg == "--scratch-budget" && hasValue) {
+            options.scratchBudgetMiB =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--inspect-accels") {
+            options.inspectAccels = true;
+        } else if (arg == "--frame-graph-report") {
+            options.frameGraphReport = true;
+        } else if (arg == "--memory-budget" && hasValue) {
+            options.memoryBudgetMiB =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--characters" && hasValue) {
+            options.characterCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--rebuild-threshold" && hasValue) {
+            options.rebuildThreshold = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--server" && hasValue) {
+            options.serverSocketPath = argv[++i];
+        } else if (arg == "--client" && hasValue) {
+            options.clientSocketPath = argv[++i];
+        } else if (arg == "--coordinator" && hasValue) {
+            // Comma-separated list of addresses
+            std::string addresses = argv[++i];
+            size_t begin = 0;
+            while (begin <= addresses.size()) {
+                size_t end = std::min(addresses.find(',', begin),
+                                      addresses.size());
+                if (end > begin) {
+                    options.workerAddresses.push_back(
+                        addresses.substr(begin, end - begin));
+                }
+                begin = end + 1;
+            }
+        } else if (arg == "--local-workers" && hasValue) {
+            options.localWorkerCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--export" && hasValue) {
+            options.exportSocketPath = argv[++i];
+        } else if (arg == "--export-check") {
+            options.exportCheck = true;
+        } else if (arg == "--consume" && hasValue) {
+            options.consumeSocketPath = argv[++i];
+        } else if (arg == "--stream" && hasValue) {
+            options.streamPath = argv[++i];
+        } else if (arg == "--stream-format" && hasValue &&
+                   (std::string{argv[i + 1]} == "rgba" ||
+                    std::string{argv[i + 1]} == "nv12")) {
+            options.streamFormat = std::string{argv[++i]} == "nv12"
+                                       ? StreamFormat::NV12
+                                       : StreamFormat::RGBA;
+        } else if (arg == "--stream-size" && hasValue) {
+            parseSize(argv[++i], options.streamWidth, options.streamHeight);
+        } else if (arg == "--batch" && hasValue) {
+            options.batchDirectory = argv[++i];
+        } else if (arg == "--timeline" && hasValue) {
+            options.timelinePath = argv[++i];
+        } else if (arg == "--batch-size" && hasValue) {
+            parseSize(argv[++i], options.batchWidth, options.batchHeight);
+        } else if (arg == "--samples" && hasValue) {
+            options.sampleCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--aperture" && hasValue) {
+            options.apertureRadius = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--focus-distance" && hasValue) {
+            options.focusDistance = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--motion-blur" && hasValue) {
+            options.timeSliceCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--shutter" && hasValue) {
+            options.shutter = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--stereo") {
+            options.stereo = true;
+        } else if (arg == "--eye-distance" && hasValue) {
+            options.eyeDistance = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--stereo-benchmark") {
+            options.stereoBenchmark = true;
+        } else if (arg == "--voxels" && hasValue) {
+            options.voxelPath = argv[++i];
+        } else if (arg == "--voxel-benchmark") {
+            options.voxelBenchmark = true;
+        } else if (arg == "--make-voxels" && hasValue) {
+            options.makeVoxelsPath = argv[++i];
+        } else if (arg == "--curves" && hasValue) {
+            options.curvePath = argv[++i];
+        } else if (arg == "--curve-benchmark") {
+            options.curveBenchmark = true;
+        } else if (arg == "--make-curves" && hasValue) {
+            options.makeCurvesPath = argv[++i];
+        } else if (arg == "--workers" && hasValue) {
+            options.workerCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--load-scaling") {
+            options.loadScaling = true;
+        } else if (arg == "--record-benchmark") {
+            options.recordBenchmark = true;
+        } else if (arg == "--transform-benchmark") {
+            options.transformBenchmark = true;
+        } else if (arg == "--scene-graph-benchmark") {
+            options.sceneGraphBenchmark = true;
+        } else if (arg == "--bvh-report") {
+            options.bvhReport = true;
+        } else if (arg == "--frames" && hasValue) {
+            options.frameCount =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            std::cerr << "Usage: " << argv[0]
+                      << " [--benchmark <file.json>]"
+                         " [--startup-trace <file.json>]"
+                         " [--trace <file.json>] [--mesh <file.obj>]..."
+                         " [--instances <count>] [--morton-sort]"
+                         " [--scratch-budget <MiB>] [--inspect-accels]"
+                         " [--frame-graph-report]"
+                         " [--memory-budget <MiB>] [--characters <count>]"
+                         " [--rebuild-threshold <ratio>]"
+                         " [--server <socket>] [--client <socket>]"
+                         " [--coordinator <address>,...]"
+                         " [--local-workers <count>]"
+                         " [--export <socket>] [--export-check]"
+                         " [--consume <socket>]"
+                         " [--stream <file>|-] [--stream-format rgba|nv12]"
+                         " [--stream-size <width>x<height>]"
+                         " [--batch <directory>] [--timeline <file>]"
+                         " [--batch-size <width>x<height>]"
+                         " [--samples <count>]"
+                         " [--aperture <radius>] [--focus-distance <distance>]"
+                         " [--motion-blur <slices>] [--shutter <frames>]"
+                         " [--stereo] [--eye-distance <distance>]"
+                         " [--stereo-benchmark]"
+                         " [--voxels <file.bricks>] [--voxel-benchmark]"
+                         " [--make-voxels <file.bricks>]"
+                         " [--curves <file.curves>] [--curve-benchmark]"
+                         " [--make-curves <file.curves>]"
+                         " [--workers <count>] [--load-scaling]"
+                         " [--record-benchmark] [--transform-benchmark]"
+                         " [--scene-graph-benchmark] [--bvh-report]"
+                         " [--frames <count>]\n";
+            std::exit(1);
+        }
+    }
+    return options;
+}
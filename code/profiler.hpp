@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records CPU timestamps of sequential startup phases, phases that ran on
+// worker threads alongside them, and the time to the first presented frame.
+// Output is Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+class StartupProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    StartupProfiler() : origin{Clock::now()} {}
+
+    // Ends the current phase (if any) and starts a new one
+    void begin(const char* name) {
+        end();
+        std::lock_guard<std::mutex> lock{mutex};
+        current = phases.size();
+        phases.push_back({name, elapsedUs(), 0.0, false});
+        inPhase = true;
+    }
+
+    void end() {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (inPhase) {
+            phases[current].durationUs = elapsedUs() - phases[current].startUs;
+            inPhase = false;
+        }
+    }
+
+    // Adds a phase timed on a worker thread. Safe to call from any thread.
+    void record(const char* name, Clock::time_point start,
+                Clock::time_point stop) {
+        std::lock_guard<std::mutex> lock{mutex};
+        phases.push_back({name, toUs(start), toUs(stop) - toUs(start), true});
+    }
+
+    void markFirstFrame() {
+        end();
+        firstFrameUs = elapsedUs();
+    }
+
+    bool firstFrameMarked() const { return firstFrameUs >= 0.0; }
+
+    void printSummary() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        std::cout << "Startup phases:\n";
+        for (const auto& phase : phases) {
+            std::cout << "  " << std::left << std::setw(24) << phase.name
+                      << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(10) << phase.durationUs / 1000.0 << " ms"
+                      << (phase.worker ? " (worker)" : "") << "\n";
+        }
+        if (firstFrameMarked()) {
+            std::cout << "Time to first presented frame: " << std::fixed
+                      << std::setprecision(2) << firstFrameUs / 1000.0
+                      << " ms\n";
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+    void writeChromeTrace(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open " << filename << "\n";
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        file << std::fixed << std::setprecision(3);
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (const auto& phase : phases) {
+            file << "  {\"name\": \"" << phase.name
+                 << "\", \"cat\": \"startup\", \"ph\": \"X\", \"ts\": "
+                 << phase.startUs << ", \"dur\": " << phase.durationUs
+                 << ", \"pid\": 1, \"tid\": " << (phase.worker ? 2 : 1)
+                 << "},\n";
+        }
+        if (firstFrameMarked()) {
+            file << "  {\"name\": \"First frame presented\", \"cat\": "
+                    "\"startup\", \"ph\": \"i\", \"s\": \"g\", \"ts\": "
+                 << firstFrameUs << ", \"pid\": 1, \"tid\": 1},\n";
+        }
+        file << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"args\": {\"name\": \"vulkan_raytracing\"}}\n";
+        file << "]}\n";
+    }
+
+private:
+    struct Phase {
+        const char* name;
+        double startUs;
+        double durationUs;
+        bool worker;
+    };
+
+    Clock::time_point origin;
+    std::vector<Phase> phases;
+    mutable std::mutex mutex;
+    size_t current = 0;
+    bool inPhase = false;
+    double firstFrameUs = -1.0;
+
+    double toUs(Clock::time_point time) const {
+        return std::chrono::duration<double, std::micro>(time - origin)
+            .count();
+    }
+
+    double elapsedUs() const { return toUs(Clock::now()); }
+};
@@ -0,0 +1,551 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.hpp"
+#include "render_protocol.hpp"
+#include "tracer.hpp"
+
+#ifdef SOCKETS_SUPPORTED
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+// Hands out the tiles of a frame to workers. Each worker starts with a
+// contiguous range of tiles and takes them from the front of its queue.
+// Once its queue is empty it steals from the back of the longest other
+// queue, so fast workers take over the tiles of slow ones.
+class TileScheduler {
+public:
+    void init(uint32_t tileCount, uint32_t workerCount) {
+        queues.clear();
+        for (uint32_t i = 0; i < workerCount; i++) {
+            queues.push_back(std::make_unique<Queue>());
+            uint32_t begin = tileCount * i / workerCount;
+            uint32_t end = tileCount * (i + 1) / workerCount;
+            for (uint32_t tile = begin; tile < end; tile++) {
+                queues[i]->tiles.push_back(tile);
+            }
+        }
+        stolenCount = 0;
+    }
+
+    // Returns false if no tile is left in any queue
+    bool next(uint32_t worker, uint32_t& tile) {
+        {
+            Queue& own = *queues[worker];
+            std::lock_guard<std::mutex> lock{own.mutex};
+            if (!own.tiles.empty()) {
+                tile = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+
+        // The victim may be emptied by another thief before it is locked
+        while (true) {
+            uint32_t victim = UINT32_MAX;
+            size_t longest = 0;
+            for (uint32_t i = 0; i < queues.size(); i++) {
+                std::lock_guard<std::mutex> lock{queues[i]->mutex};
+                if (queues[i]->tiles.size() > longest) {
+                    longest = queues[i]->tiles.size();
+                    victim = i;
+                }
+            }
+            if (victim == UINT32_MAX) {
+                return false;
+            }
+            Queue& queue = *queues[victim];
+            std::lock_guard<std::mutex> lock{queue.mutex};
+            if (!queue.tiles.empty()) {
+                tile = queue.tiles.back();
+                queue.tiles.pop_back();
+                stolenCount++;
+                return true;
+            }
+        }
+    }
+
+    // Puts back a tile that a failed worker did not deliver, for the other
+    // workers to steal
+    void requeue(uint32_t worker, uint32_t tile) {
+        Queue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock{queue.mutex};
+        queue.tiles.push_front(tile);
+    }
+
+    uint32_t getStolenCount() const { return stolenCount; }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<uint32_t> tiles;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<uint32_t> stolenCount{0};
+};
+
+// Frame split into square tiles, cut at the image border
+struct DistributedFrame {
+    std::string scenePath;
+    Camera camera;
+    uint32_t width = 1920;
+    uint32_t height = 1080;
+    uint32_t sampleCount = 4;
+    uint32_t tileSize = 128;
+
+    uint32_t getTileColumns() const {
+        return (width + tileSize - 1) / tileSize;
+    }
+
+    uint32_t getTileCount() const {
+        return getTileColumns() * ((height + tileSize - 1) / tileSize);
+    }
+
+    // The tile index is the job ID
+    JobRequest createTileRequest(uint32_t tile) const {
+        JobRequest request{};
+        request.jobId = tile;
+        request.width = width;
+        request.height = height;
+        request.sampleCount = sampleCount;
+        request.tileSize = tileSize;
+        request.encoding = TileEncoding::RunLength;
+        request.camera = camera;
+        request.regionX = tile % getTileColumns() * tileSize;
+        request.regionY = tile / getTileColumns() * tileSize;
+        request.regionWidth = std::min(tileSize, width - request.regionX);
+        request.regionHeight = std::min(tileSize, height - request.regionY);
+        request.scenePathSize = static_cast<uint32_t>(scenePath.size());
+        return request;
+    }
+};
+
+struct DistributedStats {
+    double frameMs = 0.0;
+    uint32_t stolenCount = 0;
+    std::vector<uint32_t> workerTileCounts;
+};
+
+// A worker that does not finish a tile within this time is treated as
+// failed and its tiles go to the other workers. The first tile of a scene
+// also loads it and builds its AS.
+constexpr auto TILE_TIMEOUT = std::chrono::seconds(10);
+constexpr auto SCENE_LOAD_TIMEOUT = std::chrono::minutes(5);
+
+#ifdef SOCKETS_SUPPORTED
+inline bool sendTileJob(const Socket& worker,
+                        const DistributedFrame& frame,
+                        uint32_t tile) {
+    JobRequest request = frame.createTileRequest(tile);
+    return sendMessage(worker, MessageType::Job,
+                       {{&request, sizeof(request)},
+                        {frame.scenePath.data(), frame.scenePath.size()}});
+}
+
+// Receives the pixels of a tile job into image, which has the size of the
+// frame. Returns false if the worker failed, sent an invalid reply or did
+// not finish the tile within timeout.
+inline bool receiveTileJob(const Socket& worker,
+                           const DistributedFrame& frame,
+                           uint32_t tile,
+                           std::vector<uint32_t>& image,
+                           JobDone& done,
+                           std::chrono::milliseconds timeout = TILE_TIMEOUT) {
+    JobRequest request = frame.createTileRequest(tile);
+    uint32_t receivedPixels = 0;
+    MessageHeader header{};
+    std::vector<uint8_t> payload;
+    std::vector<uint32_t> pixels;
+    auto deadline = Socket::Clock::now() + timeout;
+    while (true) {
+        if (!receiveMessage(worker, header, payload, deadline)) {
+            if (Socket::Clock::now() >= deadline) {
+                std::cerr << "Tile " << tile << " timed out.\n";
+            }
+            return false;
+        }
+        if (header.type == MessageType::JobDone &&
+            payload.size() == sizeof(done)) {
+            std::memcpy(&done, payload.data(), sizeof(done));
+            return done.jobId == tile &&
+                   receivedPixels ==
+                       request.regionWidth * request.regionHeight;
+        }
+        if (header.type == MessageType::Error) {
+            size_t messageOffset = std::min(payload.size(), sizeof(JobError));
+            std::cerr << "Tile " << tile << " failed: "
+                      << std::string(payload.begin() + messageOffset,
+                                     payload.end())
+                      << "\n";
+            return false;
+        }
+
+        // Tiles must be inside the region of the job
+        TileHeader tileHeader{};
+        if (header.type != MessageType::Tile ||
+            !decodeTile(payload, tileHeader, pixels) ||
+            tileHeader.jobId != tile || tileHeader.x < request.regionX ||
+            tileHeader.y < request.regionY ||
+            tileHeader.x - request.regionX >= request.regionWidth ||
+            tileHeader.y - request.regionY >= request.regionHeight ||
+            tileHeader.width >
+                request.regionWidth - (tileHeader.x - request.regionX) ||
+            tileHeader.height >
+                request.regionHeight - (tileHeader.y - request.regionY)) {
+            std::cerr << "Invalid tile " << tile << " from worker.\n";
+            return false;
+        }
+        for (uint32_t row = 0; row < tileHeader.height; row++) {
+            std::copy_n(pixels.data() + size_t{row} * tileHeader.width,
+                        tileHeader.width,
+                        image.data() +
+                            size_t{tileHeader.y + row} * frame.width +
+                            tileHeader.x);
+        }
+        receivedPixels += tileHeader.width * tileHeader.height;
+    }
+}
+
+// Tiles requested from a worker before the previous ones arrived, so that
+// it does not idle during a round trip
+constexpr uint32_t MAX_TILES_IN_FLIGHT = 2;
+
+// Renders the frame on the first workerCount workers into image, with one
+// thread per worker. The tiles of a failed or timed out worker, including
+// those in flight, are taken over by the others and its socket is closed,
+// so later frames skip it. Returns false if tiles are missing because
+// every worker failed.
+inline bool renderDistributed(std::vector<Socket>& workers,
+                              uint32_t workerCount,
+                              const DistributedFrame& frame,
+                              std::vector<uint32_t>& image,
+                              DistributedStats& stats) {
+    trace::Scope traceScope{"renderDistributed"};
+    uint32_t tileCount = frame.getTileCount();
+    TileScheduler scheduler;
+    scheduler.init(tileCount, workerCount);
+    image.assign(size_t{frame.width} * frame.height, 0);
+    stats.workerTileCounts.assign(workerCount, 0);
+    std::atomic<uint32_t> remainingCount{tileCount};
+
+    auto serveWorker = [&](uint32_t worker) {
+        Socket& socket = workers[worker];
+        std::deque<uint32_t> inFlight;
+        bool failed = !socket.isOpen();
+        while (!failed) {
+            uint32_t tile = 0;
+            while (inFlight.size() < MAX_TILES_IN_FLIGHT &&
+                   scheduler.next(worker, tile)) {
+                if (!sendTileJob(socket, frame, tile)) {
+                    scheduler.requeue(worker, tile);
+                    failed = true;
+                    break;
+                }
+                inFlight.push_back(tile);
+            }
+            if (failed) {
+                break;
+            }
+            if (inFlight.empty()) {
+                if (remainingCount == 0) {
+                    break;
+                }
+                // Tiles of a failed worker may still come back
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            JobDone done{};
+            if (!receiveTileJob(socket, frame, inFlight.front(), image,
+                                done)) {
+                failed = true;
+                break;
+            }
+            inFlight.pop_front();
+            stats.workerTileCounts[worker]++;
+            remainingCount--;
+        }
+
+        for (uint32_t tile : inFlight) {
+            scheduler.requeue(worker, tile);
+        }
+        if (failed && socket.isOpen()) {
+            std::cerr << "Worker " << worker
+                      << " failed, its tiles go to the other workers.\n";
+            socket.close();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t worker = 0; worker < workerCount; worker++) {
+        threads.emplace_back(serveWorker, worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats.frameMs = elapsed.count();
+    stats.stolenCount = scheduler.getStolenCount();
+    return remainingCount == 0;
+}
+
+// Renders one tile on each worker, so that scene loading is not part of
+// the measured frames. Returns the longest scene load.
+inline double warmUpWorkers(std::vector<Socket>& workers,
+                            const DistributedFrame& frame) {
+    std::vector<double> sceneLoadMs(workers.size(), 0.0);
+    std::vector<std::thread> threads;
+    for (uint32_t worker = 0; worker < workers.size(); worker++) {
+        threads.emplace_back([&, worker] {
+            std::vector<uint32_t> image(size_t{frame.width} * frame.height);
+            JobDone done{};
+            if (!sendTileJob(workers[worker], frame, 0) ||
+                !receiveTileJob(workers[worker], frame, 0, image, done,
+                                SCENE_LOAD_TIMEOUT)) {
+                std::cerr << "Worker " << worker << " failed to warm up.\n";
+                workers[worker].close();
+                return;
+            }
+            sceneLoadMs[worker] = done.sceneLoadMs;
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return *std::max_element(sceneLoadMs.begin(), sceneLoadMs.end());
+}
+
+// Removes the workers whose socket was closed after a failure, returns
+// how many were removed
+inline uint32_t dropFailedWorkers(std::vector<Socket>& workers) {
+    auto failed =
+        std::remove_if(workers.begin(), workers.end(),
+                       [](const Socket& worker) { return !worker.isOpen(); });
+    uint32_t failedCount = static_cast<uint32_t>(workers.end() - failed);
+    workers.erase(failed, workers.end());
+    return failedCount;
+}
+
+// Renders the frame with 1 to N workers, keeping the best of a few runs,
+// and prints the speedup and efficiency relative to one worker. A worker
+// that fails is dropped and its row is measured again with the others.
+inline bool measureScaling(std::vector<Socket>& workers,
+                           const DistributedFrame& frame) {
+    constexpr uint32_t RUN_COUNT = 3;
+    std::cout << "Frame: " << frame.width << "x" << frame.height << ", "
+              << frame.sampleCount << " spp, " << frame.getTileCount()
+              << " tiles of " << frame.tileSize << "x" << frame.tileSize
+              << "\n";
+    double sceneLoadMs = warmUpWorkers(workers, frame);
+    std::cout << "Scene loaded on the workers in " << sceneLoadMs << " ms\n";
+    dropFailedWorkers(workers);
+
+    std::cout << "workers  frame ms  speedup  efficiency  stolen"
+                 "  tiles per worker\n";
+    std::cout << std::fixed << std::setprecision(2);
+    std::vector<uint32_t> reference;
+    std::vector<uint32_t> image;
+    double singleWorkerMs = 0.0;
+    uint32_t count = 1;
+    while (count <= workers.size()) {
+        DistributedStats best{};
+        best.frameMs = std::numeric_limits<double>::max();
+        bool workerFailed = false;
+        for (uint32_t run = 0; run < RUN_COUNT; run++) {
+            DistributedStats stats{};
+            bool complete =
+                renderDistributed(workers, count, frame, image, stats);
+
+            // The frame ran on fewer workers than the row would show
+            workerFailed = std::any_of(
+                workers.begin(), workers.begin() + count,
+                [](const Socket& worker) { return !worker.isOpen(); });
+            if (workerFailed) {
+                break;
+            }
+            if (!complete) {
+                std::cerr << "Frame on " << count
+                          << " workers is missing tiles.\n";
+                std::cout.unsetf(std::ios::floatfield);
+                return false;
+            }
+            if (stats.frameMs < best.frameMs) {
+                best = stats;
+            }
+
+            // Jitter only depends on the tile, so the image must not
+            // depend on which worker rendered it, except across GPUs or
+            // drivers that round differently
+            if (reference.empty()) {
+                reference = image;
+            } else if (image != reference) {
+                size_t differentCount = 0;
+                for (size_t i = 0; i < image.size(); i++) {
+                    differentCount += image[i] != reference[i];
+                }
+                std::cerr << "Warning: " << differentCount
+                          << " pixels differ from the first frame.\n";
+            }
+        }
+        if (workerFailed) {
+            uint32_t failedCount = dropFailedWorkers(workers);
+            std::cerr << "Dropped " << failedCount << " failed worker(s), "
+                      << workers.size() << " left.\n";
+            continue;
+        }
+        if (count == 1) {
+            singleWorkerMs = best.frameMs;
+        }
+        double speedup = singleWorkerMs / best.frameMs;
+        auto [minTiles, maxTiles] = std::minmax_element(
+            best.workerTileCounts.begin(), best.workerTileCounts.end());
+        std::cout << std::setw(7) << count << std::setw(10) << best.frameMs
+                  << std::setw(8) << speedup << "x" << std::setw(11)
+                  << 100.0 * speedup / count << "%" << std::setw(8)
+                  << best.stolenCount << std::setw(11) << *minTiles << " - "
+                  << *maxTiles << "\n";
+        count++;
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    if (workers.empty()) {
+        std::cerr << "Every worker failed.\n";
+        return false;
+    }
+    return true;
+}
+
+// Render server started by the coordinator on this machine
+struct LocalWorker {
+    pid_t pid = -1;
+    std::string socketPath;
+};
+
+// Starts count render servers of this program on Unix domain sockets in
+// /tmp. Their standard output is discarded, errors are kept.
+inline std::vector<LocalWorker> spawnLocalWorkers(
+    const std::string& executablePath,
+    uint32_t count) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    std::vector<LocalWorker> workers;
+    for (uint32_t i = 0; i < count; i++) {
+        LocalWorker worker;
+        worker.socketPath = "/tmp/vulkan_raytracing_" +
+                            std::to_string(::getpid()) + "_" +
+                            std::to_string(i) + ".sock";
+        std::string program = executablePath;
+        std::string serverOption = "--server";
+        std::string socketPath = worker.socketPath;
+        char* argv[] = {program.data(), serverOption.data(), socketPath.data(),
+                        nullptr};
+        if (posix_spawnp(&worker.pid, program.c_str(), &actions, nullptr,
+                         argv, environ) != 0) {
+            std::cerr << "Failed to start " << program << ".\n";
+            continue;
+        }
+        workers.push_back(worker);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return workers;
+}
+
+// Waits until a local worker listens, returns a closed socket if it
+// exited or timed out
+inline Socket connectLocalWorker(const LocalWorker& worker) {
+    constexpr auto TIMEOUT = std::chrono::seconds(60);
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < TIMEOUT) {
+        Socket socket = Socket::connect(worker.socketPath);
+        if (socket.isOpen()) {
+            return socket;
+        }
+        int status = 0;
+        if (::waitpid(worker.pid, &status, WNOHANG) == worker.pid) {
+            return {};
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return {};
+}
+
+inline void stopLocalWorkers(const std::vector<LocalWorker>& workers) {
+    for (const LocalWorker& worker : workers) {
+        ::kill(worker.pid, SIGTERM);
+    }
+    for (const LocalWorker& worker : workers) {
+        int status = 0;
+        ::waitpid(worker.pid, &status, 0);
+        ::unlink(worker.socketPath.c_str());
+    }
+}
+
+// Connects to the render servers at workerAddresses and to localCount
+// servers started on this machine, then measures how a frame of the scene
+// scales across them. Returns false on failure.
+inline bool runCoordinator(const std::vector<std::string>& workerAddresses,
+                           uint32_t localCount,
+                           const std::string& executablePath,
+                           const std::string& scenePath) {
+    // Writes to a failed worker must fail instead of raising SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::vector<LocalWorker> localWorkers =
+        spawnLocalWorkers(executablePath, localCount);
+    std::vector<Socket> workers;
+    bool connected = true;
+    for (const std::string& address : workerAddresses) {
+        workers.push_back(Socket::connect(address));
+        if (!workers.back().isOpen()) {
+            std::cerr << "Failed to connect to " << address << ".\n";
+            connected = false;
+        }
+    }
+    for (const LocalWorker& worker : localWorkers) {
+        workers.push_back(connectLocalWorker(worker));
+        if (!workers.back().isOpen()) {
+            std::cerr << "Local worker " << worker.socketPath
+                      << " did not start.\n";
+            connected = false;
+        }
+    }
+    if (workers.empty()) {
+        std::cerr << "No workers to render with.\n";
+        connected = false;
+    }
+
+    bool result = false;
+    if (connected) {
+        DistributedFrame frame{};
+        frame.scenePath = scenePath;
+        result = measureScaling(workers, frame);
+    }
+    workers.clear();
+    stopLocalWorkers(localWorkers);
+    return result;
+}
+#endif
@@ -0,0 +1,490 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "camera.hpp"
+
+// Sockets are only used on POSIX systems
+#ifndef _WIN32
+#define SOCKETS_SUPPORTED
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Messages between the render server and its clients are a header
+// followed by size bytes of payload. Structs are sent as they are in
+// memory, so both ends must be the same build on machines of the same
+// endianness.
+enum class MessageType : uint32_t {
+    Job = 1,      // JobRequest, client to server
+    Tile = 2,     // TileHeader, server to client
+    JobDone = 3,  // JobDone, server to client
+    Error = 4,    // JobError, server to client
+
+    // Frame export, see frame_export.hpp
+    ExportSetup = 5,    // ExportSetup, producer to consumer
+    FrameReady = 6,     // FrameReady, producer to consumer
+    FrameReleased = 7,  // FrameReleased, consumer to producer
+};
+
+struct MessageHeader {
+    MessageType type;
+    uint32_t size;
+};
+
+enum class TileEncoding : uint32_t {
+    Raw = 0,
+    RunLength = 1,
+};
+
+// Followed by scenePathSize bytes of the OBJ path to render
+// (empty: the scene already loaded by the server)
+struct JobRequest {
+    uint32_t jobId;
+    uint32_t width;
+    uint32_t height;
+    uint32_t sampleCount;
+
+    // Tiles are squares of this size, cut at the image border
+    uint32_t tileSize;
+    TileEncoding encoding;
+    Camera camera;
+
+    // Part of the image to render, e.g. one tile of a distributed frame
+    // (regionWidth 0: the whole image)
+    uint32_t regionX;
+    uint32_t regionY;
+    uint32_t regionWidth;
+    uint32_t regionHeight;
+
+    uint32_t scenePathSize;
+};
+
+// Followed by dataSize bytes of RGBA8 pixels, row by row. x and y are
+// in the whole image, not in the region of the job.
+struct TileHeader {
+    uint32_t jobId;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    TileEncoding encoding;
+    uint32_t dataSize;
+};
+
+// Sent after the last tile of a job
+struct JobDone {
+    uint32_t jobId;
+    uint32_t tileCount;
+    uint64_t encodedSize;
+
+    // Loading another scene and building its AS, not part of the latency
+    double sceneLoadMs;
+
+    // Recording, submission and GPU execution of the frame
+    double renderMs;
+    double gpuMs;
+
+    // From the request being received to the last tile being sent
+    double latencyMs;
+};
+
+// Followed by the error message
+struct JobError {
+    uint32_t jobId;
+};
+
+// Runs of equal pixels are a count followed by the pixel; other pixels
+// are a count with the high bit set followed by the pixels
+constexpr uint32_t RUN_LENGTH_LITERAL = 0x80000000u;
+
+inline void encodeRunLength(const uint32_t* pixels,
+                            uint32_t count,
+                            std::vector<uint32_t>& encoded) {
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && pixels[i + run] == pixels[i]) {
+            run++;
+        }
+        if (run > 1) {
+            encoded.push_back(run);
+            encoded.push_back(pixels[i]);
+            i += run;
+            continue;
+        }
+
+        // Literals until the next pair of equal pixels
+        uint32_t end = i + 1;
+        while (end < count &&
+               (end + 1 == count || pixels[end + 1] != pixels[end])) {
+            end++;
+        }
+        encoded.push_back(RUN_LENGTH_LITERAL | (end - i));
+        encoded.insert(encoded.end(), pixels + i, pixels + end);
+        i = end;
+    }
+}
+
+// Returns false if the data is malformed or does not decode to count
+// pixels
+inline bool decodeRunLength(const uint32_t* data,
+                            uint32_t size,
+                            uint32_t count,
+                            std::vector<uint32_t>& pixels) {
+    pixels.clear();
+    const uint32_t* end = data + size;
+    while (data < end) {
+        uint32_t word = *data++;
+        uint32_t length = word & ~RUN_LENGTH_LITERAL;
+        if (length == 0 || pixels.size() + length > count) {
+            return false;
+        }
+        if (word & RUN_LENGTH_LITERAL) {
+            if (static_cast<uint32_t>(end - data) < length) {
+                return false;
+            }
+            pixels.insert(pixels.end(), data, data + length);
+            data += length;
+        } else {
+            if (data == end) {
+                return false;
+            }
+            pixels.insert(pixels.end(), length, *data++);
+        }
+    }
+    return pixels.size() == count;
+}
+
+// Decodes the pixels of a Tile message, returns false if it is malformed
+inline bool decodeTile(const std::vector<uint8_t>& payload,
+                       TileHeader& tile,
+                       std::vector<uint32_t>& pixels) {
+    if (payload.size() < sizeof(tile)) {
+        return false;
+    }
+    std::memcpy(&tile, payload.data(), sizeof(tile));
+    const uint32_t* data =
+        reinterpret_cast<const uint32_t*>(payload.data() + sizeof(tile));
+    uint32_t pixelCount = tile.width * tile.height;
+    uint32_t wordCount = static_cast<uint32_t>(
+        (payload.size() - sizeof(tile)) / sizeof(uint32_t));
+    if (tile.encoding == TileEncoding::RunLength) {
+        return decodeRunLength(data, wordCount, pixelCount, pixels);
+    }
+    if (wordCount != pixelCount) {
+        return false;
+    }
+    pixels.assign(data, data + wordCount);
+    return true;
+}
+
+#ifdef SOCKETS_SUPPORTED
+// Stream socket on an address that is either a Unix domain socket path
+// or tcp:<host>:<port> to reach other machines
+class Socket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // No deadline: wait for as long as the peer is connected
+    static constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+    Socket() = default;
+    explicit Socket(int fd) : fd{fd} {}
+    Socket(Socket&& other) noexcept : fd{std::exchange(other.fd, -1)} {}
+    Socket& operator=(Socket&& other) noexcept {
+        if (this != &other) {
+            close();
+            fd = std::exchange(other.fd, -1);
+        }
+        return *this;
+    }
+    ~Socket() { close(); }
+
+    // Replaces a socket file left by a previous server, but no other kind
+    // of file. A TCP server listens on the interfaces of host (empty:
+    // loopback only, *: all of them, which has no authentication).
+    static Socket listen(const std::string& address) {
+        Socket socket = open(address, true);
+        if (!socket.isOpen()) {
+            std::cerr << "Failed to listen on " << address << ".\n";
+            std::abort();
+        }
+        return socket;
+    }
+
+    // Returns a closed socket if no server listens on address
+    static Socket connect(const std::string& address) {
+        return open(address, false);
+    }
+
+    Socket accept() const {
+        Socket client{::accept(fd, nullptr, nullptr)};
+        client.setNoDelay();
+        return client;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Both return false once the peer has disconnected. receive() also
+    // returns false if the data has not arrived by the deadline, which
+    // leaves the stream in the middle of a message.
+    bool send(const void* data, size_t size) const {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = ::send(fd, bytes, size, 0);
+            if (sent <= 0) {
+                return false;
+            }
+            bytes += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool receive(void* data,
+                 size_t size,
+                 Clock::time_point deadline = NO_DEADLINE) const {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            if (!waitReadable(deadline)) {
+                return false;
+            }
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received <= 0) {
+                return false;
+            }
+            bytes += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    // Passes file descriptors to the peer process, only over Unix domain
+    // sockets. The receiver owns the descriptors it gets.
+    bool sendFds(const std::vector<int>& fds) const {
+        size_t fdsSize = sizeof(int) * fds.size();
+        std::vector<uint64_t> control((CMSG_SPACE(fdsSize) + 7) / 8);
+        char byte = 0;
+        iovec data{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = CMSG_SPACE(fdsSize);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(fdsSize);
+        std::memcpy(CMSG_DATA(header), fds.data(), fdsSize);
+        return ::sendmsg(fd, &message, 0) == 1;
+    }
+
+    bool receiveFds(std::vector<int>& fds, size_t count) const {
+        size_t fdsSize = sizeof(int) * count;
+        std::vector<uint64_t> control((CMSG_SPACE(fdsSize) + 7) / 8);
+        char byte = 0;
+        iovec data{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = CMSG_SPACE(fdsSize);
+        if (::recvmsg(fd, &message, 0) != 1 || message.msg_flags & MSG_CTRUNC) {
+            return false;
+        }
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (!header || header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_RIGHTS ||
+            header->cmsg_len != CMSG_LEN(fdsSize)) {
+            return false;
+        }
+        fds.resize(count);
+        std::memcpy(fds.data(), CMSG_DATA(header), fdsSize);
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    int fd = -1;
+
+    bool waitReadable(Clock::time_point deadline) const {
+        if (deadline == NO_DEADLINE) {
+            return true;
+        }
+        while (true) {
+            auto remaining = std::chrono::duration_cast<
+                std::chrono::milliseconds>(deadline - Clock::now());
+            pollfd request{fd, POLLIN, 0};
+            int result = ::poll(&request, 1,
+                                static_cast<int>(std::max<int64_t>(
+                                    remaining.count(), 0)));
+            if (result >= 0 || errno != EINTR) {
+                return result > 0;
+            }
+        }
+    }
+
+    static Socket open(const std::string& address, bool server) {
+        const std::string TCP_PREFIX = "tcp:";
+        if (address.compare(0, TCP_PREFIX.size(), TCP_PREFIX) == 0) {
+            return openTcp(address.substr(TCP_PREFIX.size()), server);
+        }
+
+        sockaddr_un unixAddress{};
+        if (!makeAddress(address, unixAddress)) {
+            return {};
+        }
+        struct stat status {};
+        if (server && ::lstat(address.c_str(), &status) == 0 &&
+            S_ISSOCK(status.st_mode)) {
+            ::unlink(address.c_str());
+        }
+        Socket socket{::socket(AF_UNIX, SOCK_STREAM, 0)};
+        if (socket.isOpen() &&
+            !socket.bindOrConnect(reinterpret_cast<sockaddr*>(&unixAddress),
+                                  sizeof(unixAddress), server)) {
+            socket.close();
+        }
+        return socket;
+    }
+
+    // Tries each address host resolves to
+    static Socket openTcp(const std::string& hostPort, bool server) {
+        size_t colon = hostPort.rfind(':');
+        if (colon == std::string::npos) {
+            std::cerr << "Invalid TCP address: " << hostPort << "\n";
+            return {};
+        }
+        std::string host = hostPort.substr(0, colon);
+        std::string port = hostPort.substr(colon + 1);
+
+        // Without a host, getaddrinfo returns the loopback address, or the
+        // wildcard address for AI_PASSIVE
+        bool anyHost = server && host == "*";
+        if (anyHost) {
+            std::cerr << "Warning: listening on all interfaces, any host "
+                         "can submit jobs.\n";
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = anyHost ? AI_PASSIVE : 0;
+        addrinfo* results = nullptr;
+        if (::getaddrinfo(host.empty() || anyHost ? nullptr : host.c_str(),
+                          port.c_str(), &hints, &results) != 0) {
+            std::cerr << "Failed to resolve " << hostPort << ".\n";
+            return {};
+        }
+        Socket socket;
+        for (addrinfo* info = results; info && !socket.isOpen();
+             info = info->ai_next) {
+            socket = Socket{::socket(info->ai_family, info->ai_socktype,
+                                     info->ai_protocol)};
+            if (!socket.isOpen()) {
+                continue;
+            }
+            if (server) {
+                // Allows restarting a worker while old connections linger
+                int reuse = 1;
+                ::setsockopt(socket.fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                             sizeof(reuse));
+            }
+            if (!socket.bindOrConnect(info->ai_addr, info->ai_addrlen,
+                                      server)) {
+                socket.close();
+            }
+        }
+        ::freeaddrinfo(results);
+        if (!server) {
+            socket.setNoDelay();
+        }
+        return socket;
+    }
+
+    bool bindOrConnect(const sockaddr* address, socklen_t size, bool server) {
+        if (server) {
+            return ::bind(fd, address, size) == 0 && ::listen(fd, 16) == 0;
+        }
+        return ::connect(fd, address, size) == 0;
+    }
+
+    // Sends small messages such as job requests right away instead of
+    // waiting to fill a TCP packet. Fails without effect on Unix domain
+    // sockets.
+    void setNoDelay() {
+        if (fd >= 0) {
+            int noDelay = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+                         sizeof(noDelay));
+        }
+    }
+
+    static bool makeAddress(const std::string& path, sockaddr_un& address) {
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Invalid socket path: " << path << "\n";
+            return false;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+};
+
+// Larger messages are treated as a broken stream
+constexpr uint32_t MAX_MESSAGE_SIZE = 256u << 20;
+
+// The payload is the concatenation of parts
+inline bool sendMessage(const Socket& socket,
+                        MessageType type,
+                        const std::vector<std::pair<const void*, size_t>>&
+                            parts) {
+    MessageHeader header{type, 0};
+    for (const auto& part : parts) {
+        header.size += static_cast<uint32_t>(part.second);
+    }
+    if (!socket.send(&header, sizeof(header))) {
+        return false;
+    }
+    for (const auto& part : parts) {
+        if (!socket.send(part.first, part.second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool receiveMessage(
+    const Socket& socket,
+    MessageHeader& header,
+    std::vector<uint8_t>& payload,
+    Socket::Clock::time_point deadline = Socket::NO_DEADLINE) {
+    if (!socket.receive(&header, sizeof(header), deadline) ||
+        header.size > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    payload.resize(header.size);
+    return socket.receive(payload.data(), payload.size(), deadline);
+}
+#endif
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "render_protocol.hpp"
+#include "tracer.hpp"
+
+struct RenderJob {
+    uint32_t id = 0;
+    std::string scenePath;
+    Camera camera;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t sampleCount = 1;
+    uint32_t tileSize = 64;
+    TileEncoding encoding = TileEncoding::Raw;
+
+    // Part of the image to render
+    uint32_t regionX = 0;
+    uint32_t regionY = 0;
+    uint32_t regionWidth = 0;
+    uint32_t regionHeight = 0;
+};
+
+// Output of the renderer, valid until the next job
+struct RenderedFrame {
+    // regionWidth * regionHeight RGBA8 pixels, row by row
+    const uint32_t* pixels = nullptr;
+
+    // Set instead of the pixels if the job failed, e.g. the scene file
+    // is malformed
+    std::string error;
+
+    double sceneLoadMs = 0.0;
+    double renderMs = 0.0;
+    double gpuMs = 0.0;
+};
+
+// Returns an empty string if the job can be rendered
+inline std::string validateJob(const RenderJob& job) {
+    constexpr uint32_t MAX_SIZE = 8192;
+    constexpr uint32_t MAX_SAMPLES = 1024;
+    if (job.width == 0 || job.height == 0 || job.width > MAX_SIZE ||
+        job.height > MAX_SIZE) {
+        return "Resolution must be between 1 and 8192.";
+    }
+    if (job.sampleCount == 0 || job.sampleCount > MAX_SAMPLES) {
+        return "Sample count must be between 1 and 1024.";
+    }
+    if (job.regionWidth == 0 || job.regionHeight == 0 ||
+        job.regionX >= job.width || job.regionY >= job.height ||
+        job.regionWidth > job.width - job.regionX ||
+        job.regionHeight > job.height - job.regionY) {
+        return "Region must be inside the image.";
+    }
+    if (job.tileSize < 8) {
+        return "Tile size must be at least 8.";
+    }
+    if (job.encoding != TileEncoding::Raw &&
+        job.encoding != TileEncoding::RunLength) {
+        return "Unknown tile encoding.";
+    }
+    if (!(job.camera.fovY > 0.0f && job.camera.fovY < 180.0f)) {
+        return "Field of view must be between 0 and 180 degrees.";
+    }
+    CameraBasis basis;
+    if (!computeCameraBasis(job.camera, 1.0f, basis)) {
+        return "Camera has no view direction or up is parallel to it.";
+    }
+    if (!job.scenePath.empty() && !std::ifstream{job.scenePath}.is_open()) {
+        return "Failed to open " + job.scenePath + ".";
+    }
+    return {};
+}
+
+#ifdef SOCKETS_SUPPORTED
+using RenderFunction = std::function<RenderedFrame(const RenderJob& job)>;
+
+// Cuts the frame into tiles and sends them, returns false if the client
+// disconnected
+inline bool sendTiles(const Socket& client,
+                      const RenderJob& job,
+                      const RenderedFrame& frame,
+                      JobDone& done) {
+    trace::Scope traceScope{"sendTiles"};
+    std::vector<uint32_t> pixels;
+    std::vector<uint32_t> encoded;
+    for (uint32_t y = 0; y < job.regionHeight; y += job.tileSize) {
+        for (uint32_t x = 0; x < job.regionWidth; x += job.tileSize) {
+            TileHeader tile{};
+            tile.jobId = job.id;
+            tile.x = job.regionX + x;
+            tile.y = job.regionY + y;
+            tile.width = std::min(job.tileSize, job.regionWidth - x);
+            tile.height = std::min(job.tileSize, job.regionHeight - y);
+            tile.encoding = job.encoding;
+
+            pixels.clear();
+            for (uint32_t row = 0; row < tile.height; row++) {
+                const uint32_t* begin =
+                    frame.pixels + size_t{y + row} * job.regionWidth + x;
+                pixels.insert(pixels.end(), begin, begin + tile.width);
+            }
+            const std::vector<uint32_t>* data = &pixels;
+            if (job.encoding == TileEncoding::RunLength) {
+                encoded.clear();
+                encodeRunLength(pixels.data(),
+                                static_cast<uint32_t>(pixels.size()),
+                                encoded);
+                data = &encoded;
+            }
+            tile.dataSize =
+                static_cast<uint32_t>(sizeof(uint32_t) * data->size());
+
+            if (!sendMessage(client, MessageType::Tile,
+                             {{&tile, sizeof(tile)},
+                              {data->data(), tile.dataSize}})) {
+                return false;
+            }
+            done.tileCount++;
+            done.encodedSize += tile.dataSize;
+        }
+    }
+    return true;
+}
+
+// Serves one client until it disconnects. Jobs are rendered in the order
+// they are received.
+inline void serveClient(const Socket& client,
+                        const RenderFunction& render) {
+    MessageHeader header{};
+    std::vector<uint8_t> payload;
+    while (receiveMessage(client, header, payload)) {
+        if (header.type != MessageType::Job ||
+            payload.size() < sizeof(JobRequest)) {
+            std::cerr << "Unexpected message from client.\n";
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        JobRequest request{};
+        std::memcpy(&request, payload.data(), sizeof(request));
+        if (payload.size() != sizeof(request) + request.scenePathSize) {
+            std::cerr << "Malformed job request.\n";
+            return;
+        }
+
+        RenderJob job{};
+        job.id = request.jobId;
+        job.scenePath.assign(
+            reinterpret_cast<const char*>(payload.data()) + sizeof(request),
+            request.scenePathSize);
+        job.camera = request.camera;
+        job.width = request.width;
+        job.height = request.height;
+        job.sampleCount = request.sampleCount;
+        job.tileSize = request.tileSize;
+        job.encoding = request.encoding;
+        job.regionX = request.regionX;
+        job.regionY = request.regionY;
+        job.regionWidth = request.regionWidth;
+        job.regionHeight = request.regionHeight;
+        if (job.regionWidth == 0) {
+            job.regionX = 0;
+            job.regionY = 0;
+            job.regionWidth = job.width;
+            job.regionHeight = job.height;
+        }
+
+        auto sendError = [&](const std::string& error) {
+            JobError jobError{job.id};
+            std::cerr << "Job " << job.id << " rejected: " << error << "\n";
+            return sendMessage(client, MessageType::Error,
+                               {{&jobError, sizeof(jobError)},
+                                {error.data(), error.size()}});
+        };
+        std::string error = validateJob(job);
+        if (!error.empty()) {
+            if (!sendError(error)) {
+                return;
+            }
+            continue;
+        }
+
+        trace::Scope traceScope{"Job"};
+        RenderedFrame frame = render(job);
+        if (!frame.error.empty()) {
+            if (!sendError(frame.error + ".")) {
+                return;
+            }
+            continue;
+        }
+        JobDone done{};
+        done.jobId = job.id;
+        done.sceneLoadMs = frame.sceneLoadMs;
+        done.renderMs = frame.renderMs;
+        done.gpuMs = frame.gpuMs;
+        if (!sendTiles(client, job, frame, done)) {
+            return;
+        }
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        done.latencyMs = elapsed.count() - frame.sceneLoadMs;
+        if (!sendMessage(client, MessageType::JobDone,
+                         {{&done, sizeof(done)}})) {
+            return;
+        }
+        std::cout << "Job " << job.id << ": " << job.regionWidth << "x"
+                  << job.regionHeight << ", " << job.sampleCount << " spp, "
+                  << done.tileCount << " tiles in " << done.latencyMs
+                  << " ms\n";
+    }
+}
+
+// Listens on socketPath and serves clients one at a time until the
+// process is killed
+inline void serveRenderJobs(const std::string& socketPath,
+                            const RenderFunction& render) {
+    // Writes to a disconnected client must fail instead of raising SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Socket server = Socket::listen(socketPath);
+    std::cout << "Listening on " << socketPath << "\n";
+    while (true) {
+        Socket client = server.accept();
+        if (!client.isOpen()) {
+            std::cerr << "Failed to accept a client.\n";
+            continue;
+        }
+        std::cout << "Client connected\n";
+        serveClient(client, render);
+        std::cout << "Client disconnected\n";
+    }
+}
+
+// Sends a few jobs with different resolutions, sample counts and
+// encodings, checks that the tiles cover each image and prints the
+// latency reported by the server. Returns false on failure.
+inline bool runRenderClient(const std::string& socketPath,
+                            const std::string& scenePath) {
+    Socket socket = Socket::connect(socketPath);
+    if (!socket.isOpen()) {
+        std::cerr << "Failed to connect to " << socketPath << ".\n";
+        return false;
+    }
+
+    struct ClientJob {
+        uint32_t width;
+        uint32_t height;
+        uint32_t sampleCount;
+        TileEncoding encoding;
+        float angle;
+    };
+    const std::vector<ClientJob> jobs = {
+        {640, 480, 1, TileEncoding::Raw, 0.0f},
+        {640, 480, 1, TileEncoding::RunLength, 0.0f},
+        {1280, 720, 4, TileEncoding::RunLength, 0.5f},
+        {1280, 720, 16, TileEncoding::Raw, 1.0f},
+        {800, 600, 1, TileEncoding::RunLength, 1.5f},
+    };
+
+    std::cout << "job  resolution  spp  encoding  tiles    KiB  load ms"
+                 "  render ms  gpu ms  latency ms  round trip ms\n";
+    std::cout << std::fixed << std::setprecision(2);
+    MessageHeader header{};
+    std::vector<uint8_t> payload;
+    std::vector<uint32_t> tilePixels;
+    for (uint32_t i = 0; i < jobs.size(); i++) {
+        const ClientJob& clientJob = jobs[i];
+        JobRequest request{};
+        request.jobId = i;
+        request.width = clientJob.width;
+        request.height = clientJob.height;
+        request.sampleCount = clientJob.sampleCount;
+        request.tileSize = 64;
+        request.encoding = clientJob.encoding;
+
+        // Orbit around the origin
+        request.camera.position[0] = 5.0f * std::sin(clientJob.angle);
+        request.camera.position[2] = 5.0f * std::cos(clientJob.angle);
+        request.scenePathSize = static_cast<uint32_t>(scenePath.size());
+
+        auto start = std::chrono::steady_clock::now();
+        if (!sendMessage(socket, MessageType::Job,
+                         {{&request, sizeof(request)},
+                          {scenePath.data(), scenePath.size()}})) {
+            std::cerr << "Failed to send job " << i << ".\n";
+            return false;
+        }
+
+        // Each pixel must be received exactly once
+        std::vector<uint8_t> covered(size_t{request.width} * request.height);
+        JobDone done{};
+        while (true) {
+            if (!receiveMessage(socket, header, payload)) {
+                std::cerr << "Server disconnected.\n";
+                return false;
+            }
+            if (header.type == MessageType::Error &&
+                payload.size() >= sizeof(JobError)) {
+                std::cerr << "Job " << i << " failed: "
+                          << std::string(payload.begin() + sizeof(JobError),
+                                         payload.end())
+                          << "\n";
+                return false;
+            }
+            if (header.type == MessageType::JobDone &&
+                payload.size() == sizeof(done)) {
+                std::memcpy(&done, payload.data(), sizeof(done));
+                break;
+            }
+
+            if (header.type != MessageType::Tile) {
+                std::cerr << "Unexpected message from server.\n";
+                return false;
+            }
+            TileHeader tile{};
+            if (!decodeTile(payload, tile, tilePixels) ||
+                tile.x + tile.width > request.width ||
+                tile.y + tile.height > request.height) {
+                std::cerr << "Invalid tile in job " << i << ".\n";
+                return false;
+            }
+            for (uint32_t y = tile.y; y < tile.y + tile.height; y++) {
+                for (uint32_t x = tile.x; x < tile.x + tile.width; x++) {
+                    covered[size_t{y} * request.width + x]++;
+                }
+            }
+        }
+        std::chrono::duration<double, std::milli> roundTrip =
+            std::chrono::steady_clock::now() - start;
+
+        for (uint8_t count : covered) {
+            if (count != 1) {
+                std::cerr << "Tiles of job " << i
+                          << " do not cover the image.\n";
+                return false;
+            }
+        }
+        std::string resolution = std::to_string(request.width) + "x" +
+                                 std::to_string(request.height);
+        std::cout << std::setw(3) << i << std::setw(12) << resolution
+                  << std::setw(5) << request.sampleCount << std::setw(10)
+                  << (request.encoding == TileEncoding::Raw ? "raw" : "rle")
+                  << std::setw(7) << done.tileCount << std::setw(7)
+                  << done.encodedSize / 1024 << std::setw(9)
+                  << done.sceneLoadMs << std::setw(11) << done.renderMs
+                  << std::setw(8) << done.gpuMs << std::setw(12)
+                  << done.latencyMs << std::setw(15) << roundTrip.count()
+                  << "\n";
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    return true;
+}
+#endif
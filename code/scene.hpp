@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jobs.hpp"
+#include "mesh.hpp"
+#include "tracer.hpp"
+
+// Loads, optimizes and bounds all meshes in parallel.
+// Without paths the scene is a single triangle.
+inline std::vector<Mesh> loadScene(JobSystem& jobSystem,
+                                   const std::vector<std::string>& paths) {
+    trace::Scope traceScope{"loadScene"};
+    if (paths.empty()) {
+        std::vector<Mesh> meshes(1, createTriangleMesh());
+        computeBounds(meshes[0]);
+        return meshes;
+    }
+
+    std::vector<Mesh> meshes(paths.size());
+    std::vector<JobSystem::TaskPtr> tasks;
+    for (size_t i = 0; i < paths.size(); i++) {
+        Mesh& mesh = meshes[i];
+        auto load = jobSystem.run([&mesh, &path = paths[i]] {
+            trace::Scope scope{"loadObj"};
+            mesh = loadObj(path);
+        });
+        auto optimize = jobSystem.then(load, [&mesh] {
+            trace::Scope scope{"optimizeMesh"};
+            optimizeMesh(mesh);
+        });
+        tasks.push_back(jobSystem.then(optimize, [&mesh] {
+            trace::Scope scope{"computeBounds"};
+            computeBounds(mesh);
+        }));
+    }
+    jobSystem.wait(jobSystem.whenAll(tasks));
+    return meshes;
+}
+
+// Measures the CPU side of scene loading with 1 to N threads
+inline void benchmarkSceneLoad(const std::vector<std::string>& paths,
+                               uint32_t repeatCount = 3) {
+    uint32_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    double baseMs = 0.0;
+
+    std::cout << "threads    load ms   speedup  efficiency\n";
+    for (uint32_t threads = 1; threads <= maxThreads; threads++) {
+        JobSystem jobSystem{threads - 1};
+        double bestMs = 0.0;
+        for (uint32_t i = 0; i < repeatCount; i++) {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<Mesh> meshes = loadScene(jobSystem, paths);
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            if (i == 0 || elapsed.count() < bestMs) {
+                bestMs = elapsed.count();
+            }
+        }
+        if (threads == 1) {
+            baseMs = bestMs;
+        }
+        double speedup = bestMs > 0.0 ? baseMs / bestMs : 0.0;
+        std::cout << std::setw(7) << threads << std::fixed
+                  << std::setprecision(2) << std::setw(11) << bestMs
+                  << std::setw(10) << speedup << std::setw(12)
+                  << speedup / threads << "\n";
+    }
+    std::cout.unsetf(std::ios::floatfield);
+}
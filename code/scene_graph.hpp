@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "jobs.hpp"
+#include "tracer.hpp"
+#include "transforms.hpp"
+
+// Consecutive TLAS instances [first, first + count)
+struct InstanceRange {
+    uint32_t first;
+    uint32_t count;
+};
+
+// Returns a * b for affine 3x4 matrices
+inline vk::TransformMatrixKHR multiplyTransforms(
+    const vk::TransformMatrixKHR& a,
+    const vk::TransformMatrixKHR& b) {
+    vk::TransformMatrixKHR result;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            result.matrix[i][j] = a.matrix[i][0] * b.matrix[0][j] +
+                                  a.matrix[i][1] * b.matrix[1][j] +
+                                  a.matrix[i][2] * b.matrix[2][j];
+        }
+        result.matrix[i][3] += a.matrix[i][3];
+    }
+    return result;
+}
+
+// Transform hierarchy flattened into arrays sorted by depth, so parents
+// always come before their children and update() is a single forward
+// pass. Changing a node marks it dirty; update() recomputes the world
+// transforms of dirty nodes and their descendants only and collects the
+// instances that moved.
+class SceneGraph {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // Dirty instances are written in chunks of this size, one job per
+    // chunk
+    static constexpr uint32_t CHUNK_SIZE = 4096;
+
+    // Returns a node id, which stays valid when the arrays are re-sorted
+    uint32_t addNode(uint32_t parent = NONE, uint32_t instance = NONE) {
+        uint32_t node = static_cast<uint32_t>(slotOfNode.size());
+        uint32_t depth = parent == NONE ? 0 : depths[slotOfNode[parent]] + 1;
+
+        uint32_t slot = static_cast<uint32_t>(nodeOfSlot.size());
+        slotOfNode.push_back(slot);
+        nodeOfSlot.push_back(node);
+        parents.push_back(parent == NONE ? NONE : slotOfNode[parent]);
+        depths.push_back(depth);
+        instances.push_back(instance);
+        locals.push_back(Local{});
+        worlds.push_back(vk::TransformMatrixKHR{});
+        dirty.push_back(1);
+
+        if (instance != NONE) {
+            if (instance >= slotOfInstance.size()) {
+                slotOfInstance.resize(instance + 1, NONE);
+            }
+            slotOfInstance[instance] = slot;
+        }
+        if (slot > 0 && depth < depths[slot - 1]) {
+            unsorted = true;
+        }
+        markDirty(slot);
+        return node;
+    }
+
+    uint32_t getNodeCount() const {
+        return static_cast<uint32_t>(nodeOfSlot.size());
+    }
+
+    void setLocalTransform(uint32_t node,
+                           const float position[3],
+                           const float rotation[4],
+                           const float scale[3]) {
+        uint32_t slot = slotOfNode[node];
+        Local& local = locals[slot];
+        std::copy(position, position + 3, local.position);
+        std::copy(rotation, rotation + 4, local.rotation);
+        std::copy(scale, scale + 3, local.scale);
+        markDirty(slot);
+    }
+
+    const vk::TransformMatrixKHR& getWorldTransform(uint32_t node) const {
+        return worlds[slotOfNode[node]];
+    }
+
+    const vk::TransformMatrixKHR& getInstanceTransform(
+        uint32_t instance) const {
+        return worlds[slotOfInstance[instance]];
+    }
+
+    // Recomputes dirty world transforms.
+    // Returns the number of recomputed nodes.
+    uint32_t update() {
+        trace::Scope traceScope{"SceneGraph::update"};
+        if (unsorted) {
+            sortByDepth();
+        }
+        dirtyInstanceRanges.clear();
+        if (firstDirtySlot == NONE) {
+            return 0;
+        }
+
+        // Parents precede children, so a dirty parent has already been
+        // recomputed when its children are visited
+        uint32_t slotCount = getNodeCount();
+        uint32_t updatedCount = 0;
+        dirtyInstances.clear();
+        for (uint32_t slot = firstDirtySlot; slot < slotCount; slot++) {
+            uint32_t parent = parents[slot];
+            if (parent != NONE && dirty[parent]) {
+                dirty[slot] = 1;
+            }
+            if (!dirty[slot]) {
+                continue;
+            }
+
+            const Local& local = locals[slot];
+            vk::TransformMatrixKHR transform;
+            composeTransform(local.position, local.rotation, local.scale,
+                             transform);
+            worlds[slot] = parent == NONE
+                               ? transform
+                               : multiplyTransforms(worlds[parent], transform);
+            if (instances[slot] != NONE) {
+                dirtyInstances.push_back(instances[slot]);
+            }
+            updatedCount++;
+        }
+        std::fill(dirty.begin() + firstDirtySlot, dirty.end(), 0);
+        firstDirtySlot = NONE;
+
+        // Merge moved instances into ranges
+        std::sort(dirtyInstances.begin(), dirtyInstances.end());
+        for (uint32_t instance : dirtyInstances) {
+            if (!dirtyInstanceRanges.empty()) {
+                InstanceRange& last = dirtyInstanceRanges.back();
+                if (last.first + last.count == instance) {
+                    last.count++;
+                    continue;
+                }
+            }
+            dirtyInstanceRanges.push_back({instance, 1});
+        }
+        return updatedCount;
+    }
+
+    // Instances whose world transform changed in the last update()
+    const std::vector<InstanceRange>& getDirtyInstanceRanges() const {
+        return dirtyInstanceRanges;
+    }
+
+    // Instances whose world transform changed in the last update(), sorted
+    const std::vector<uint32_t>& getDirtyInstances() const {
+        return dirtyInstances;
+    }
+
+    // Copies the world transforms of dirty instances [begin, end) into
+    // dst. Only the transforms change. dst is written with streaming
+    // stores, so it should be write-combined or not read back by the CPU.
+    void writeDirtyInstances(vk::AccelerationStructureInstanceKHR* dst,
+                             uint32_t begin,
+                             uint32_t end) const {
+        for (uint32_t k = begin; k < end; k++) {
+            uint32_t instance = dirtyInstances[k];
+            streamTransform(getInstanceTransform(instance),
+                            dst[instance].transform);
+        }
+        finishStreamingStores();
+    }
+
+    // Copies all dirty instances, one chunk per job
+    void writeDirtyInstances(JobSystem& jobSystem,
+                             vk::AccelerationStructureInstanceKHR* dst) const {
+        trace::Scope traceScope{"SceneGraph::writeDirtyInstances"};
+        uint32_t count = static_cast<uint32_t>(dirtyInstances.size());
+        jobSystem.parallelFor(count, CHUNK_SIZE,
+                              [&](uint32_t begin, uint32_t end) {
+                                  writeDirtyInstances(dst, begin, end);
+                              });
+    }
+
+private:
+    struct Local {
+        float position[3] = {0.0f, 0.0f, 0.0f};
+        float rotation[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+        float scale[3] = {1.0f, 1.0f, 1.0f};
+    };
+
+    // Indexed by node id / instance index
+    std::vector<uint32_t> slotOfNode;
+    std::vector<uint32_t> slotOfInstance;
+
+    // Indexed by slot (sorted by depth)
+    std::vector<uint32_t> nodeOfSlot;
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> depths;
+    std::vector<uint32_t> instances;
+    std::vector<Local> locals;
+    std::vector<vk::TransformMatrixKHR> worlds;
+    std::vector<uint8_t> dirty;
+
+    uint32_t firstDirtySlot = NONE;
+    bool unsorted = false;
+
+    std::vector<uint32_t> dirtyInstances;
+    std::vector<InstanceRange> dirtyInstanceRanges;
+
+    void markDirty(uint32_t slot) {
+        dirty[slot] = 1;
+        firstDirtySlot = std::min(firstDirtySlot, slot);
+    }
+
+    template <typename T>
+    static void permute(std::vector<T>& values,
+                        const std::vector<uint32_t>& order) {
+        std::vector<T> sorted(values.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sorted[i] = values[order[i]];
+        }
+        values.swap(sorted);
+    }
+
+    void sortByDepth() {
+        uint32_t slotCount = getNodeCount();
+        std::vector<uint32_t> order(slotCount);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t a, uint32_t b) {
+                             return depths[a] < depths[b];
+                         });
+
+        std::vector<uint32_t> newSlot(slotCount);
+        for (uint32_t i = 0; i < slotCount; i++) {
+            newSlot[order[i]] = i;
+        }
+        for (uint32_t& parent : parents) {
+            if (parent != NONE) {
+                parent = newSlot[parent];
+            }
+        }
+        permute(nodeOfSlot, order);
+        permute(parents, order);
+        permute(depths, order);
+        permute(instances, order);
+        permute(locals, order);
+        permute(worlds, order);
+        permute(dirty, order);
+
+        for (uint32_t slot = 0; slot < slotCount; slot++) {
+            slotOfNode[nodeOfSlot[slot]] = slot;
+            if (instances[slot] != NONE) {
+                slotOfInstance[instances[slot]] = slot;
+            }
+        }
+        firstDirtySlot = NONE;
+        for (uint32_t slot = 0; slot < slotCount; slot++) {
+            if (dirty[slot]) {
+                firstDirtySlot = slot;
+                break;
+            }
+        }
+        unsorted = false;
+    }
+};
+
+// Measures update() with a fraction of the nodes changing every frame,
+// against recomputing every node
+inline void benchmarkSceneGraph(uint32_t nodeCount = 100000,
+                                float changeRatio = 0.05f,
+                                uint32_t frameCount = 100) {
+    // Random forest: each node is an instance and picks a parent among
+    // the nodes created before it, or becomes a root
+    std::mt19937 random{1234};
+    SceneGraph graph;
+    for (uint32_t i = 0; i < nodeCount; i++) {
+        uint32_t parent = SceneGraph::NONE;
+        if (i >= 64 && random() % 8 != 0) {
+            parent = random() % i;
+        }
+        graph.addNode(parent, i);
+    }
+    graph.update();
+
+    const float position[3] = {0.0f, 1.0f, 0.0f};
+    const float scale[3] = {1.0f, 1.0f, 1.0f};
+    uint32_t changeCount = static_cast<uint32_t>(nodeCount * changeRatio);
+
+    auto run = [&](uint32_t changesPerFrame, uint64_t& updatedCount,
+                   uint64_t& rangeCount) {
+        updatedCount = 0;
+        rangeCount = 0;
+        double totalMs = 0.0;
+        for (uint32_t frame = 0; frame < frameCount; frame++) {
+            float angle = 0.01f * frame;
+            const float rotation[4] = {0.0f, std::sin(angle), 0.0f,
+                                       std::cos(angle)};
+            for (uint32_t i = 0; i < changesPerFrame; i++) {
+                uint32_t node = changesPerFrame == nodeCount
+                                    ? i
+                                    : static_cast<uint32_t>(random() %
+                                                            nodeCount);
+                graph.setLocalTransform(node, position, rotation, scale);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            updatedCount += graph.update();
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            totalMs += elapsed.count();
+            rangeCount += graph.getDirtyInstanceRanges().size();
+        }
+        return totalMs / frameCount;
+    };
+
+    uint64_t fullUpdated, fullRanges, partialUpdated, partialRanges;
+    double fullMs = run(nodeCount, fullUpdated, fullRanges);
+    double partialMs = run(changeCount, partialUpdated, partialRanges);
+
+    std::cout << nodeCount << " nodes, " << changeCount
+              << " changed per frame\n";
+    std::cout << "update        ms/frame  nodes/frame  ranges/frame\n";
+    auto print = [&](const char* name, double ms, uint64_t updated,
+                     uint64_t ranges) {
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::fixed << std::setprecision(3) << std::setw(12)
+                  << ms << std::setw(13) << updated / frameCount
+                  << std::setw(14) << ranges / frameCount << "\n";
+    };
+    print("all", fullMs, fullUpdated, fullRanges);
+    print("dirty", partialMs, partialUpdated, partialRanges);
+    std::cout.unsetf(std::ios::floatfield);
+}
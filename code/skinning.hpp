@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "mesh.hpp"
+#include "scene_graph.hpp"
+
+// Must match SkinVertex in shaders/skinning.comp
+struct SkinVertex {
+    float pos[3];
+
+    // 4 joint indices of 8 bits
+    uint32_t joints;
+    float weights[4];
+};
+
+// Must match push constants in shaders/skinning.comp
+struct SkinPushConstants {
+    vk::DeviceAddress vertices;
+    vk::DeviceAddress joints;
+    vk::DeviceAddress positions;
+    uint32_t vertexCount;
+    uint32_t characterCount;
+    uint32_t jointCount;
+};
+
+// Rigs a mesh with a chain of joints along its Y axis. Each vertex is
+// bound to the two joints around its height, so the bind pose is the
+// identity for every joint.
+inline std::vector<SkinVertex> createSkinVertices(const Mesh& mesh,
+                                                  uint32_t jointCount) {
+    float minY = mesh.bounds.min[1];
+    float height = mesh.bounds.max[1] - minY;
+    std::vector<SkinVertex> vertices(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); i++) {
+        SkinVertex& vertex = vertices[i];
+        std::copy(mesh.vertices[i].pos, mesh.vertices[i].pos + 3, vertex.pos);
+
+        float t = height > 0.0f ? (vertex.pos[1] - minY) / height : 0.0f;
+        float segment = t * (jointCount - 1);
+        uint32_t lower = std::min(static_cast<uint32_t>(segment),
+                                  jointCount > 1 ? jointCount - 2 : 0);
+        uint32_t upper = std::min(lower + 1, jointCount - 1);
+        float weight = std::clamp(segment - lower, 0.0f, 1.0f);
+        vertex.joints = lower | (upper << 8);
+        vertex.weights[0] = 1.0f - weight;
+        vertex.weights[1] = upper != lower ? weight : 0.0f;
+        vertex.weights[2] = 0.0f;
+        vertex.weights[3] = 0.0f;
+    }
+    return vertices;
+}
+
+// Writes the skinning matrices of a swaying chain: each joint bends
+// around Z at its pivot on the Y axis of the bounds, relative to its
+// parent. phase offsets the animation of each character.
+inline void computeJointTransforms(const Aabb& bounds,
+                                   uint32_t jointCount,
+                                   float time,
+                                   float phase,
+                                   vk::TransformMatrixKHR* transforms) {
+    constexpr float AMPLITUDE = 0.35f;
+    float centerX = 0.5f * (bounds.min[0] + bounds.max[0]);
+    float height = bounds.max[1] - bounds.min[1];
+
+    vk::TransformMatrixKHR parent{};
+    for (int axis = 0; axis < 3; axis++) {
+        parent.matrix[axis][axis] = 1.0f;
+    }
+    for (uint32_t joint = 0; joint < jointCount; joint++) {
+        float pivot[2] = {centerX,
+                          bounds.min[1] + height * joint /
+                                              std::max(1u, jointCount - 1)};
+        float angle = AMPLITUDE * std::sin(2.0f * time + phase + joint);
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+
+        // Rotation around Z through the pivot
+        vk::TransformMatrixKHR bend{};
+        bend.matrix[0][0] = c;
+        bend.matrix[0][1] = -s;
+        bend.matrix[0][3] = pivot[0] - (c * pivot[0] - s * pivot[1]);
+        bend.matrix[1][0] = s;
+        bend.matrix[1][1] = c;
+        bend.matrix[1][3] = pivot[1] - (s * pivot[0] + c * pivot[1]);
+        bend.matrix[2][2] = 1.0f;
+
+        transforms[joint] = multiplyTransforms(parent, bend);
+        parent = transforms[joint];
+    }
+}
+
+// Upper bound of how far any vertex moved between two poses, relative to
+// the diagonal of the bounds. A skinned vertex is a convex combination
+// of its joint transforms, and the displacement of an affine transform
+// within a box is largest at a corner.
+inline float measureDeformation(const Aabb& bounds,
+                                uint32_t jointCount,
+                                const vk::TransformMatrixKHR* current,
+                                const vk::TransformMatrixKHR* reference) {
+    float diagonal = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.max[axis] - bounds.min[axis];
+        diagonal += extent * extent;
+    }
+    diagonal = std::sqrt(diagonal);
+    if (diagonal <= 0.0f) {
+        return 0.0f;
+    }
+
+    float maxDistance = 0.0f;
+    for (uint32_t joint = 0; joint < jointCount; joint++) {
+        for (uint32_t corner = 0; corner < 8; corner++) {
+            float p[3];
+            for (int axis = 0; axis < 3; axis++) {
+                p[axis] = corner & (1 << axis) ? bounds.max[axis]
+                                               : bounds.min[axis];
+            }
+            float distance = 0.0f;
+            for (int row = 0; row < 3; row++) {
+                const float* a = current[joint].matrix[row];
+                const float* b = reference[joint].matrix[row];
+                float d = (a[0] - b[0]) * p[0] + (a[1] - b[1]) * p[1] +
+                          (a[2] - b[2]) * p[2] + (a[3] - b[3]);
+                distance += d * d;
+            }
+            maxDistance = std::max(maxDistance, distance);
+        }
+    }
+    return std::sqrt(maxDistance) / diagonal;
+}
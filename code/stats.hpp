@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Must match RAY_TYPE_* in shaders/raystats.glsl
+enum RayType : uint32_t {
+    RAY_TYPE_PRIMARY,
+    RAY_TYPE_BOUNCE,
+    RAY_TYPE_SHADOW,
+    RAY_TYPE_AO,
+    RAY_TYPE_COUNT,
+};
+
+inline const char* rayTypeName(uint32_t type) {
+    constexpr const char* names[RAY_TYPE_COUNT] = {
+        "primary",
+        "bounce",
+        "shadow",
+        "ao",
+    };
+    return names[type];
+}
+
+struct FrameStats {
+    uint64_t frame = 0;
+    double cpuTimeMs = 0.0;
+
+    // Duration of the trace pass on the GPU (0 if not measured)
+    double gpuTimeMs = 0.0;
+
+    // Skinning and BLAS refit of the characters on the GPU, and the
+    // number of character BLAS rebuilt instead of refit
+    double deformGpuTimeMs = 0.0;
+    uint32_t blasRebuildCount = 0;
+
+    // Frame graph synchronization and transient memory
+    uint32_t barrierCount = 0;
+    uint32_t dependencyCount = 0;
+    uint64_t transientBytes = 0;
+    uint64_t dedicatedBytes = 0;
+
+    // Filled in later by the asynchronous ray counter readback
+    bool raysValid = false;
+    std::array<uint64_t, RAY_TYPE_COUNT> rays{};
+
+    uint64_t totalRays() const {
+        uint64_t total = 0;
+        for (uint64_t count : rays) {
+            total += count;
+        }
+        return total;
+    }
+
+    // Uses the GPU trace time if measured, otherwise the CPU frame time
+    double raysPerSecond() const {
+        double timeMs = gpuTimeMs > 0.0 ? gpuTimeMs : cpuTimeMs;
+        if (!raysValid || timeMs <= 0.0) {
+            return 0.0;
+        }
+        return static_cast<double>(totalRays()) * 1000.0 / timeMs;
+    }
+};
+
+// Keeps the stats of the last CAPACITY frames
+class FrameStatsRing {
+public:
+    static constexpr uint32_t CAPACITY = 256;
+
+    FrameStats& push(uint64_t frame) {
+        FrameStats& stats = entries[frame % CAPACITY];
+        stats = FrameStats{};
+        stats.frame = frame;
+        if (count < CAPACITY) {
+            count++;
+        }
+        latestFrame = frame;
+        return stats;
+    }
+
+    // Returns nullptr if the frame has already been overwritten
+    FrameStats* find(uint64_t frame) {
+        FrameStats& stats = entries[frame % CAPACITY];
+        if (count == 0 || stats.frame != frame || frame > latestFrame) {
+            return nullptr;
+        }
+        return &stats;
+    }
+
+    uint32_t size() const { return count; }
+
+    // Index 0 is the oldest frame
+    const FrameStats& operator[](uint32_t index) const {
+        uint64_t frame = latestFrame + 1 - count + index;
+        return entries[frame % CAPACITY];
+    }
+
+    double averageCpuTimeMs() const {
+        double sum = 0.0;
+        for (uint32_t i = 0; i < count; i++) {
+            sum += (*this)[i].cpuTimeMs;
+        }
+        return count > 0 ? sum / count : 0.0;
+    }
+
+    double averageRaysPerSecond() const {
+        double sum = 0.0;
+        uint32_t validCount = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if ((*this)[i].raysValid) {
+                sum += (*this)[i].raysPerSecond();
+                validCount++;
+            }
+        }
+        return validCount > 0 ? sum / validCount : 0.0;
+    }
+
+    void writeBenchmarkJson(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open " << filename << "\n";
+            return;
+        }
+
+        file << "{\n";
+        file << "  \"frames\": " << count << ",\n";
+        file << "  \"avgFrameMs\": " << averageCpuTimeMs() << ",\n";
+        file << "  \"avgRaysPerSecond\": " << averageRaysPerSecond() << ",\n";
+        file << "  \"samples\": [\n";
+        for (uint32_t i = 0; i < count; i++) {
+            const FrameStats& stats = (*this)[i];
+            file << "    {\"frame\": " << stats.frame
+                 << ", \"cpuMs\": " << stats.cpuTimeMs
+                 << ", \"gpuMs\": " << stats.gpuTimeMs
+                 << ", \"deformGpuMs\": " << stats.deformGpuTimeMs
+                 << ", \"blasRebuilds\": " << stats.blasRebuildCount
+                 << ", \"barriers\": " << stats.barrierCount
+                 << ", \"dependencies\": " << stats.dependencyCount
+                 << ", \"transientBytes\": " << stats.transientBytes
+                 << ", \"dedicatedBytes\": " << stats.dedicatedBytes;
+            if (stats.raysValid) {
+                for (uint32_t type = 0; type < RAY_TYPE_COUNT; type++) {
+                    file << ", \"" << rayTypeName(type)
+                         << "Rays\": " << stats.rays[type];
+                }
+                file << ", \"raysPerSecond\": " << stats.raysPerSecond();
+            }
+            file << "}" << (i + 1 < count ? "," : "") << "\n";
+        }
+        file << "  ]\n";
+        file << "}\n";
+    }
+
+private:
+    std::array<FrameStats, CAPACITY> entries{};
+    uint32_t count = 0;
+    uint64_t latestFrame = 0;
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline tracing of CPU and GPU work, exported as Chrome/Perfetto trace
+// JSON. Each thread writes into its own event ring without locking. The
+// rings are only read by writeChromeTrace(), which must be called once the
+// traced threads are idle.
+namespace trace {
+
+struct Event {
+    const char* name;
+    const char* category;
+    int64_t startNs;
+    int64_t durationNs;
+};
+
+class EventBuffer {
+public:
+    static constexpr uint32_t CAPACITY = 1 << 16;
+
+    EventBuffer(uint32_t pid, uint32_t tid, std::string threadName)
+        : pid{pid},
+          tid{tid},
+          threadName{std::move(threadName)},
+          events{std::make_unique<Event[]>(CAPACITY)} {}
+
+    // Only called by the owning thread
+    void push(const Event& event) {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        events[index % CAPACITY] = event;
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    uint32_t pid;
+    uint32_t tid;
+    std::string threadName;
+
+private:
+    friend class Tracer;
+
+    std::unique_ptr<Event[]> events;
+    std::atomic<uint64_t> head{0};
+};
+
+class Tracer {
+public:
+    static constexpr uint32_t CPU_PID = 1;
+    static constexpr uint32_t GPU_PID = 2;
+
+    static Tracer& get() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // Host clock used by all events (GPU timestamps are calibrated to it)
+    static int64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void setEnabled(bool value) {
+        enabled.store(value, std::memory_order_relaxed);
+    }
+
+    bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // Names the calling thread in the trace
+    void setThreadName(const std::string& name) {
+        EventBuffer& buffer = threadBuffer();
+        std::lock_guard<std::mutex> lock{mutex};
+        buffer.threadName = name;
+    }
+
+    void addEvent(const char* name,
+                  const char* category,
+                  int64_t startNs,
+                  int64_t endNs) {
+        if (isEnabled()) {
+            threadBuffer().push({name, category, startNs, endNs - startNs});
+        }
+    }
+
+    // GPU events are written by the thread that resolves the queries
+    EventBuffer& gpuTrack(const std::string& name) {
+        std::lock_guard<std::mutex> lock{mutex};
+        for (auto& buffer : buffers) {
+            if (buffer->pid == GPU_PID && buffer->threadName == name) {
+                return *buffer;
+            }
+        }
+        uint32_t tid = static_cast<uint32_t>(buffers.size()) + 1;
+        buffers.push_back(std::make_unique<EventBuffer>(GPU_PID, tid, name));
+        return *buffers.back();
+    }
+
+    void writeChromeTrace(const std::string& filename) {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open " << filename << "\n";
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        file << std::fixed << std::setprecision(3);
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        file << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "
+             << CPU_PID << ", \"args\": {\"name\": \"CPU\"}},\n";
+        file << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "
+             << GPU_PID << ", \"args\": {\"name\": \"GPU\"}}";
+        for (const auto& buffer : buffers) {
+            file << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": "
+                 << buffer->pid << ", \"tid\": " << buffer->tid
+                 << ", \"args\": {\"name\": \"" << buffer->threadName
+                 << "\"}}";
+
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t first =
+                head > EventBuffer::CAPACITY ? head - EventBuffer::CAPACITY : 0;
+            for (uint64_t i = first; i < head; i++) {
+                const Event& event = buffer->events[i % EventBuffer::CAPACITY];
+                file << ",\n  {\"name\": \"" << event.name
+                     << "\", \"cat\": \"" << event.category
+                     << "\", \"ph\": \"X\", \"ts\": "
+                     << (event.startNs - originNs) / 1000.0
+                     << ", \"dur\": " << event.durationNs / 1000.0
+                     << ", \"pid\": " << buffer->pid
+                     << ", \"tid\": " << buffer->tid << "}";
+            }
+        }
+        file << "\n]}\n";
+    }
+
+private:
+    Tracer() : originNs{nowNs()} {}
+
+    EventBuffer& threadBuffer() {
+        thread_local EventBuffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lock{mutex};
+            uint32_t tid = static_cast<uint32_t>(buffers.size()) + 1;
+            buffers.push_back(std::make_unique<EventBuffer>(
+                CPU_PID, tid, "Thread " + std::to_string(tid)));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    int64_t originNs;
+    std::atomic<bool> enabled{false};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<EventBuffer>> buffers;
+};
+
+// Records a CPU event covering the lifetime of the scope
+class Scope {
+public:
+    explicit Scope(const char* name, const char* category = "cpu")
+        : name{name},
+          category{category},
+          startNs{Tracer::get().isEnabled() ? Tracer::nowNs() : 0} {}
+
+    ~Scope() {
+        if (startNs != 0) {
+            Tracer::get().addEvent(name, category, startNs, Tracer::nowNs());
+        }
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    int64_t startNs;
+};
+
+}  // namespace trace
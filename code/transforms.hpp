@@ -0,0 +1,328 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define TRANSFORMS_USE_SSE
+#endif
+
+#include <vulkan/vulkan.hpp>
+
+#include "jobs.hpp"
+#include "tracer.hpp"
+
+static_assert(sizeof(vk::AccelerationStructureInstanceKHR) == 64,
+              "unexpected instance layout");
+
+// Composes translation * rotation * scale into a row-major 3x4 matrix.
+// rotation is a unit quaternion (x, y, z, w).
+inline void composeTransform(const float position[3],
+                             const float rotation[4],
+                             const float scale[3],
+                             vk::TransformMatrixKHR& transform) {
+    float x = rotation[0], y = rotation[1], z = rotation[2], w = rotation[3];
+    float xx = x * x, yy = y * y, zz = z * z;
+    float xy = x * y, xz = x * z, yz = y * z;
+    float wx = w * x, wy = w * y, wz = w * z;
+
+    float(&m)[3][4] = transform.matrix;
+    m[0][0] = (1.0f - 2.0f * (yy + zz)) * scale[0];
+    m[0][1] = 2.0f * (xy - wz) * scale[1];
+    m[0][2] = 2.0f * (xz + wy) * scale[2];
+    m[0][3] = position[0];
+    m[1][0] = 2.0f * (xy + wz) * scale[0];
+    m[1][1] = (1.0f - 2.0f * (xx + zz)) * scale[1];
+    m[1][2] = 2.0f * (yz - wx) * scale[2];
+    m[1][3] = position[1];
+    m[2][0] = 2.0f * (xz - wy) * scale[0];
+    m[2][1] = 2.0f * (yz + wx) * scale[1];
+    m[2][2] = (1.0f - 2.0f * (xx + yy)) * scale[2];
+    m[2][3] = position[2];
+}
+
+// Copies a 3x4 matrix with streaming stores when dst is 16-byte aligned.
+// Call finishStreamingStores() after the last copy of a batch.
+inline void streamTransform(const vk::TransformMatrixKHR& src,
+                            vk::TransformMatrixKHR& dst) {
+#ifdef TRANSFORMS_USE_SSE
+    float* out = &dst.matrix[0][0];
+    if (reinterpret_cast<uintptr_t>(out) % 16 == 0) {
+        const float* in = &src.matrix[0][0];
+        _mm_stream_ps(out + 0, _mm_loadu_ps(in + 0));
+        _mm_stream_ps(out + 4, _mm_loadu_ps(in + 4));
+        _mm_stream_ps(out + 8, _mm_loadu_ps(in + 8));
+        return;
+    }
+#endif
+    dst = src;
+}
+
+// Orders the streaming stores before later stores of this thread
+inline void finishStreamingStores() {
+#ifdef TRANSFORMS_USE_SSE
+    _mm_sfence();
+#endif
+}
+
+// Instance transforms stored as structure of arrays.
+// Each instance has a position, a rotation quaternion (x, y, z, w) and a
+// scale. writeInstances() composes the 3x4 matrices four instances at a
+// time and writes them straight into a (mapped) instance buffer.
+// It writes whole instances when the TLAS input is created. Per-frame
+// moves come from the scene graph, whose world transforms are full
+// matrices: SceneGraph::writeDirtyInstances copies just the moved ones.
+class TransformSystem {
+public:
+    // Instances are written in chunks of this size, one job per chunk.
+    // Must be a multiple of 4.
+    static constexpr uint32_t CHUNK_SIZE = 4096;
+
+    // Shared by all instances
+    uint32_t mask = 0xFF;
+    vk::GeometryInstanceFlagsKHR flags =
+        vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable;
+
+    // sbtRecordOffset selects the hit group of the instance
+    uint32_t add(uint64_t accelReference,
+                 uint32_t customIndex,
+                 uint32_t sbtRecordOffset = 0) {
+        uint32_t index = size();
+        posX.push_back(0.0f);
+        posY.push_back(0.0f);
+        posZ.push_back(0.0f);
+        rotX.push_back(0.0f);
+        rotY.push_back(0.0f);
+        rotZ.push_back(0.0f);
+        rotW.push_back(1.0f);
+        scaleX.push_back(1.0f);
+        scaleY.push_back(1.0f);
+        scaleZ.push_back(1.0f);
+        customIndices.push_back(customIndex);
+        sbtRecordOffsets.push_back(sbtRecordOffset);
+        accelReferences.push_back(accelReference);
+        return index;
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(posX.size()); }
+
+    void setPosition(uint32_t index, float x, float y, float z) {
+        posX[index] = x;
+        posY[index] = y;
+        posZ[index] = z;
+    }
+
+    // Expects a unit quaternion
+    void setRotation(uint32_t index, float x, float y, float z, float w) {
+        rotX[index] = x;
+        rotY[index] = y;
+        rotZ[index] = z;
+        rotW[index] = w;
+    }
+
+    void setScale(uint32_t index, float x, float y, float z) {
+        scaleX[index] = x;
+        scaleY[index] = y;
+        scaleZ[index] = z;
+    }
+
+    // Writes instances [begin, end) to dst[begin, end).
+    // dst is written with streaming stores, so it should be write-combined
+    // or otherwise not read back by the CPU.
+    void writeInstances(vk::AccelerationStructureInstanceKHR* dst,
+                        uint32_t begin,
+                        uint32_t end) const {
+        uint32_t i = begin;
+#ifdef TRANSFORMS_USE_SSE
+        // Streaming stores need 16-byte aligned rows
+        if (reinterpret_cast<uintptr_t>(dst) % 16 == 0) {
+            for (; i + 4 <= end; i += 4) {
+                writeInstances4(dst, i);
+            }
+            _mm_sfence();
+        }
+#endif
+        for (; i < end; i++) {
+            writeInstance(dst, i);
+        }
+    }
+
+    // Writes all instances, one chunk per job
+    void writeInstances(JobSystem& jobSystem,
+                        vk::AccelerationStructureInstanceKHR* dst) const {
+        trace::Scope traceScope{"TransformSystem::writeInstances"};
+        jobSystem.parallelFor(size(), CHUNK_SIZE,
+                              [&](uint32_t begin, uint32_t end) {
+                                  writeInstances(dst, begin, end);
+                              });
+    }
+
+    // One instance at a time from the same arrays. Baseline of the
+    // benchmark and used for single instances.
+    void writeInstancesScalar(vk::AccelerationStructureInstanceKHR* dst,
+                              uint32_t begin,
+                              uint32_t end) const {
+        for (uint32_t i = begin; i < end; i++) {
+            writeInstance(dst, i);
+        }
+    }
+
+private:
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> rotX, rotY, rotZ, rotW;
+    std::vector<float> scaleX, scaleY, scaleZ;
+    std::vector<uint32_t> customIndices;
+    std::vector<uint32_t> sbtRecordOffsets;
+    std::vector<uint64_t> accelReferences;
+
+    uint32_t packFlags(uint32_t i) const {
+        return (sbtRecordOffsets[i] & 0xFFFFFF) |
+               (static_cast<uint32_t>(flags) << 24);
+    }
+
+    void writeInstance(vk::AccelerationStructureInstanceKHR* dst,
+                       uint32_t i) const {
+        float position[3] = {posX[i], posY[i], posZ[i]};
+        float rotation[4] = {rotX[i], rotY[i], rotZ[i], rotW[i]};
+        float scale[3] = {scaleX[i], scaleY[i], scaleZ[i]};
+
+        vk::AccelerationStructureInstanceKHR& instance = dst[i];
+        composeTransform(position, rotation, scale, instance.transform);
+        instance.setInstanceCustomIndex(customIndices[i]);
+        instance.setMask(mask);
+        instance.setInstanceShaderBindingTableRecordOffset(
+            sbtRecordOffsets[i]);
+        instance.setFlags(flags);
+        instance.setAccelerationStructureReference(accelReferences[i]);
+    }
+
+#ifdef TRANSFORMS_USE_SSE
+    // Composes 4 instances with one lane per instance, then transposes
+    // the lanes into rows so every 16-byte row is one streaming store
+    void writeInstances4(vk::AccelerationStructureInstanceKHR* dst,
+                         uint32_t i) const {
+        __m128 x = _mm_loadu_ps(&rotX[i]);
+        __m128 y = _mm_loadu_ps(&rotY[i]);
+        __m128 z = _mm_loadu_ps(&rotZ[i]);
+        __m128 w = _mm_loadu_ps(&rotW[i]);
+        __m128 sx = _mm_loadu_ps(&scaleX[i]);
+        __m128 sy = _mm_loadu_ps(&scaleY[i]);
+        __m128 sz = _mm_loadu_ps(&scaleZ[i]);
+
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 two = _mm_set1_ps(2.0f);
+        __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y);
+        __m128 zz = _mm_mul_ps(z, z);
+        __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z);
+        __m128 yz = _mm_mul_ps(y, z);
+        __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y);
+        __m128 wz = _mm_mul_ps(w, z);
+
+        auto diagonal = [&](__m128 a, __m128 b, __m128 s) {
+            return _mm_mul_ps(
+                _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(a, b))), s);
+        };
+        auto sum = [&](__m128 a, __m128 b, __m128 s) {
+            return _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(a, b)), s);
+        };
+        auto difference = [&](__m128 a, __m128 b, __m128 s) {
+            return _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(a, b)), s);
+        };
+
+        __m128 row0[4] = {diagonal(yy, zz, sx), difference(xy, wz, sy),
+                          sum(xz, wy, sz), _mm_loadu_ps(&posX[i])};
+        __m128 row1[4] = {sum(xy, wz, sx), diagonal(xx, zz, sy),
+                          difference(yz, wx, sz), _mm_loadu_ps(&posY[i])};
+        __m128 row2[4] = {difference(xz, wy, sx), sum(yz, wx, sy),
+                          diagonal(xx, yy, sz), _mm_loadu_ps(&posZ[i])};
+        _MM_TRANSPOSE4_PS(row0[0], row0[1], row0[2], row0[3]);
+        _MM_TRANSPOSE4_PS(row1[0], row1[1], row1[2], row1[3]);
+        _MM_TRANSPOSE4_PS(row2[0], row2[1], row2[2], row2[3]);
+
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            float* out = &dst[i + lane].transform.matrix[0][0];
+            _mm_stream_ps(out + 0, row0[lane]);
+            _mm_stream_ps(out + 4, row1[lane]);
+            _mm_stream_ps(out + 8, row2[lane]);
+
+            // customIndex:24 | mask:8, sbtOffset:24 | flags:8, reference
+            uint64_t reference = accelReferences[i + lane];
+            __m128i tail = _mm_set_epi32(
+                static_cast<int>(reference >> 32),
+                static_cast<int>(reference & 0xFFFFFFFF),
+                static_cast<int>(packFlags(i + lane)),
+                static_cast<int>((customIndices[i + lane] & 0xFFFFFF) |
+                                 (mask << 24)));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(out + 12), tail);
+        }
+    }
+#endif
+};
+
+// Measures instance writes per millisecond for the scalar path and the
+// SIMD path on 1 and all threads
+inline void benchmarkInstanceTransforms(uint32_t workerCount,
+                                        uint32_t instanceCount = 1000000,
+                                        uint32_t repeatCount = 10) {
+    TransformSystem transforms;
+    for (uint32_t i = 0; i < instanceCount; i++) {
+        transforms.add(0x1000 + i, i);
+        float angle = 0.001f * i;
+        transforms.setPosition(i, float(i % 1000), float(i / 1000), 0.0f);
+        transforms.setRotation(i, 0.0f, std::sin(angle), 0.0f,
+                               std::cos(angle));
+        transforms.setScale(i, 1.0f, 2.0f, 1.0f);
+    }
+
+    // Stands in for the mapped instance buffer
+    size_t bytes = sizeof(vk::AccelerationStructureInstanceKHR) *
+                   static_cast<size_t>(instanceCount);
+    std::vector<vk::AccelerationStructureInstanceKHR> dst(instanceCount);
+
+    auto measure = [&](const auto& write) {
+        double bestMs = 0.0;
+        for (uint32_t i = 0; i < repeatCount; i++) {
+            auto start = std::chrono::steady_clock::now();
+            write();
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            if (i == 0 || elapsed.count() < bestMs) {
+                bestMs = elapsed.count();
+            }
+        }
+        return bestMs;
+    };
+
+    JobSystem jobSystem{workerCount};
+    double scalarMs = measure([&] {
+        transforms.writeInstancesScalar(dst.data(), 0, instanceCount);
+    });
+    double simdMs = measure(
+        [&] { transforms.writeInstances(dst.data(), 0, instanceCount); });
+    double parallelMs =
+        measure([&] { transforms.writeInstances(jobSystem, dst.data()); });
+
+    std::cout << instanceCount << " instances (" << bytes / (1024 * 1024)
+              << " MiB)\n";
+    std::cout << "path                    ms  instances/ms\n";
+    auto print = [&](const char* name, double ms) {
+        std::cout << std::left << std::setw(18) << name << std::right
+                  << std::fixed << std::setprecision(3) << std::setw(10)
+                  << ms << std::setprecision(0) << std::setw(14)
+                  << instanceCount / ms << "\n";
+    };
+    print("scalar", scalarMs);
+    print("simd", simdMs);
+    std::string parallelName =
+        "simd x" + std::to_string(jobSystem.getThreadCount());
+    print(parallelName.c_str(), parallelMs);
+    std::cout.unsetf(std::ios::floatfield);
+}
@@ -45,13 +45,15 @@ inline bool checkLayerSupport(const std::vector<const char*>& layers) {
     return true;
 }
 
-inline std::vector<const char*> getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions =
-        glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions,
-                                        glfwExtensions + glfwExtensionCount);
+// Headless instances have no window surface extensions
+inline std::vector<const char*> getRequiredExtensions(bool headless) {
+    std::vector<const char*> extensions;
+    if (!headless) {
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions =
+            glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
     extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
     return extensions;
 }
@@ -71,7 +73,8 @@ inline vk::DebugUtilsMessengerCreateInfoEXT createDebugCreateInfo() {
 
 inline vk::UniqueInstance createInstance(
     uint32_t apiVersion,
-    const std::vector<const char*>& layers) {
+    const std::vector<const char*>& layers,
+    bool headless = false) {
     std::cout << "Create instance\n";
 
     // Setup dynamic loader
@@ -90,7 +93,7 @@ inline vk::UniqueInstance createInstance(
     vk::ApplicationInfo appInfo{};
     appInfo.setApiVersion(apiVersion);
 
-    std::vector<const char*> extensions = getRequiredExtensions();
+    std::vector<const char*> extensions = getRequiredExtensions(headless);
 
     vk::DebugUtilsMessengerCreateInfoEXT debugCreateInfo =
         createDebugCreateInfo();
@@ -124,12 +127,13 @@ inline vk::UniqueSurfaceKHR createSurface(vk::Instance instance,
     return vk::UniqueSurfaceKHR{vk::SurfaceKHR(_surface), {instance}};
 }
 
+// Without a surface, presentation support is not required
 inline uint32_t findGeneralQueueFamily(vk::PhysicalDevice physicalDevice,
                                        vk::SurfaceKHR surface) {
     auto queueFamilies = physicalDevice.getQueueFamilyProperties();
     for (uint32_t i = 0; i < queueFamilies.size(); i++) {
         vk::Bool32 presentSupport =
-            physicalDevice.getSurfaceSupportKHR(i, surface);
+            !surface || physicalDevice.getSurfaceSupportKHR(i, surface);
         if (queueFamilies[i].queueFlags & vk::QueueFlagBits::eGraphics &&
             presentSupport) {
             return i;
@@ -156,8 +160,9 @@ inline bool isDeviceSuitable(vk::PhysicalDevice physicalDevice,
     if (!checkDeviceExtensionSupport(physicalDevice, deviceExtensions)) {
         return false;
     }
-    if (physicalDevice.getSurfaceFormatsKHR(surface).empty() ||
-        physicalDevice.getSurfacePresentModesKHR(surface).empty()) {
+    if (surface &&
+        (physicalDevice.getSurfaceFormatsKHR(surface).empty() ||
+         physicalDevice.getSurfacePresentModesKHR(surface).empty())) {
         return false;
     }
     return true;
@@ -186,10 +191,103 @@ inline auto getRayTracingProps(vk::PhysicalDevice physicalDevice) {
         .get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
 }
 
+inline auto getAccelStructProps(vk::PhysicalDevice physicalDevice) {
+    auto deviceProperties = physicalDevice.getProperties2<
+        vk::PhysicalDeviceProperties2,
+        vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+    return deviceProperties
+        .get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+}
+
+inline bool checkRayTracingMaintenance1Support(
+    vk::PhysicalDevice physicalDevice) {
+    if (!checkDeviceExtensionSupport(
+            physicalDevice,
+            {VK_KHR_RAY_TRACING_MAINTENANCE_1_EXTENSION_NAME})) {
+        return false;
+    }
+    auto features = physicalDevice.getFeatures2<
+        vk::PhysicalDeviceFeatures2,
+        vk::PhysicalDeviceRayTracingMaintenance1FeaturesKHR>();
+    return features.get<vk::PhysicalDeviceRayTracingMaintenance1FeaturesKHR>()
+        .rayTracingMaintenance1;
+}
+
+inline bool checkRayTracingMotionBlurSupport(
+    vk::PhysicalDevice physicalDevice) {
+    if (!checkDeviceExtensionSupport(
+            physicalDevice, {VK_NV_RAY_TRACING_MOTION_BLUR_EXTENSION_NAME})) {
+        return false;
+    }
+    auto features = physicalDevice.getFeatures2<
+        vk::PhysicalDeviceFeatures2,
+        vk::PhysicalDeviceRayTracingMotionBlurFeaturesNV>();
+    return features.get<vk::PhysicalDeviceRayTracingMotionBlurFeaturesNV>()
+        .rayTracingMotionBlur;
+}
+
+inline bool checkShaderClockSupport(vk::PhysicalDevice physicalDevice) {
+    if (!checkDeviceExtensionSupport(physicalDevice,
+                                     {VK_KHR_SHADER_CLOCK_EXTENSION_NAME})) {
+        return false;
+    }
+    auto features =
+        physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                    vk::PhysicalDeviceShaderClockFeaturesKHR>();
+    return features.get<vk::PhysicalDeviceShaderClockFeaturesKHR>()
+        .shaderDeviceClock;
+}
+
+inline bool checkSubgroupSupport(vk::PhysicalDevice physicalDevice,
+                                 vk::ShaderStageFlags stages,
+                                 vk::SubgroupFeatureFlags operations) {
+    auto properties = physicalDevice.getProperties2<
+        vk::PhysicalDeviceProperties2, vk::PhysicalDeviceSubgroupProperties>();
+    const auto& subgroupProperties =
+        properties.get<vk::PhysicalDeviceSubgroupProperties>();
+    return (subgroupProperties.supportedStages & stages) == stages &&
+           (subgroupProperties.supportedOperations & operations) == operations;
+}
+
+// Whether images with these parameters and semaphores can be shared with
+// other processes as opaque file descriptors
+inline bool checkExternalFdSupport(vk::PhysicalDevice physicalDevice,
+                                   vk::Format format,
+                                   vk::ImageUsageFlags usage) {
+    vk::PhysicalDeviceExternalImageFormatInfo externalInfo{
+        vk::ExternalMemoryHandleTypeFlagBits::eOpaqueFd};
+    vk::PhysicalDeviceImageFormatInfo2 formatInfo{
+        format, vk::ImageType::e2D, vk::ImageTiling::eOptimal, usage};
+    formatInfo.setPNext(&externalInfo);
+    vk::ExternalImageFormatProperties externalProperties{};
+    vk::ImageFormatProperties2 properties{};
+    properties.setPNext(&externalProperties);
+
+    // Unsupported combinations are an error code, not an exception
+    VkResult result =
+        VULKAN_HPP_DEFAULT_DISPATCHER.vkGetPhysicalDeviceImageFormatProperties2(
+            physicalDevice,
+            reinterpret_cast<const VkPhysicalDeviceImageFormatInfo2*>(
+                &formatInfo),
+            reinterpret_cast<VkImageFormatProperties2*>(&properties));
+    if (result != VK_SUCCESS) {
+        return false;
+    }
+    vk::ExternalSemaphoreProperties semaphoreProperties =
+        physicalDevice.getExternalSemaphoreProperties(
+            {vk::ExternalSemaphoreHandleTypeFlagBits::eOpaqueFd});
+    return (externalProperties.externalMemoryProperties
+                .externalMemoryFeatures &
+            vk::ExternalMemoryFeatureFlagBits::eExportable) &&
+           (semaphoreProperties.externalSemaphoreFeatures &
+            vk::ExternalSemaphoreFeatureFlagBits::eExportable);
+}
+
 inline vk::UniqueDevice createLogicalDevice(
     vk::PhysicalDevice physicalDevice,
     uint32_t queueFamilyIndex,
-    const std::vector<const char*>& deviceExtensions) {
+    const std::vector<const char*>& deviceExtensions,
+    void* additionalFeatures = nullptr) {
     std::cout << "Create device\n";
 
     float queuePriority = 1.0f;
@@ -207,6 +305,10 @@ inline vk::UniqueDevice createLogicalDevice(
         vk::PhysicalDeviceBufferDeviceAddressFeatures{VK_TRUE},
     };
 
+    // Append optional feature structs (e.g. shader clock)
+    createInfoChain.get<vk::PhysicalDeviceBufferDeviceAddressFeatures>()
+        .setPNext(additionalFeatures);
+
     vk::UniqueDevice device = physicalDevice.createDeviceUnique(
         createInfoChain.get<vk::DeviceCreateInfo>());
     VULKAN_HPP_DEFAULT_DISPATCHER.init(device.get());
@@ -352,10 +454,11 @@ inline void oneTimeSubmit(vk::Device device,
 
 inline vk::UniqueCommandBuffer createCommandBuffer(
     vk::Device device,
-    vk::CommandPool commandPool) {
+    vk::CommandPool commandPool,
+    vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary) {
     vk::CommandBufferAllocateInfo allocateInfo{};
     allocateInfo.setCommandPool(commandPool);
-    allocateInfo.setLevel(vk::CommandBufferLevel::ePrimary);
+    allocateInfo.setLevel(level);
     allocateInfo.setCommandBufferCount(1);
     return std::move(device.allocateCommandBuffersUnique(allocateInfo).front());
 }
@@ -469,7 +572,50 @@ inline void setImageLayout(vk::CommandBuffer commandBuffer,
                                   {}, {}, {}, imageMemoryBarrier);
 }
 
+// Object names and command labels for GPU captures.
+// These compile down to nothing in release builds.
+#ifndef NDEBUG
+template <typename T>
+inline void setObjectName(vk::Device device, T object, const char* name) {
+    vk::DebugUtilsObjectNameInfoEXT nameInfo{};
+    nameInfo.setObjectType(T::objectType);
+    nameInfo.setObjectHandle(
+        (uint64_t) static_cast<typename T::CType>(object));
+    nameInfo.setPObjectName(name);
+    device.setDebugUtilsObjectNameEXT(nameInfo);
+}
+
+class DebugLabel {
+public:
+    DebugLabel(vk::CommandBuffer commandBuffer, const char* name)
+        : commandBuffer{commandBuffer} {
+        vk::DebugUtilsLabelEXT label{};
+        label.setPLabelName(name);
+        commandBuffer.beginDebugUtilsLabelEXT(label);
+    }
+    ~DebugLabel() { commandBuffer.endDebugUtilsLabelEXT(); }
+
+    DebugLabel(const DebugLabel&) = delete;
+    DebugLabel& operator=(const DebugLabel&) = delete;
+
+private:
+    vk::CommandBuffer commandBuffer;
+};
+#else
+template <typename T>
+inline void setObjectName(vk::Device, T, const char*) {}
+
+class DebugLabel {
+public:
+    DebugLabel(vk::CommandBuffer, const char*) {}
+};
+#endif
+
 inline uint32_t alignUp(uint32_t size, uint32_t alignment) {
     return (size + alignment - 1) & ~(alignment - 1);
 }
+
+inline vk::DeviceSize alignUp(vk::DeviceSize size, vk::DeviceSize alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
 }  // namespace vkutils
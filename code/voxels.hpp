@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mesh.hpp"
+
+// Voxels are stored in bricks of 8x8x8 with one occupancy bit each.
+// The brick at coordinates c covers voxels c * 8 to c * 8 + 7 of the grid,
+// and voxel (x, y, z) of a brick is bit (z * 8 + y) * 8 + x.
+constexpr int32_t BRICK_SIZE = 8;
+constexpr uint32_t BRICK_WORDS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE / 32;
+
+struct VoxelBrick {
+    int32_t coord[3];
+    uint32_t occupancy[BRICK_WORDS];
+
+    bool get(int32_t x, int32_t y, int32_t z) const {
+        uint32_t bit = (z * BRICK_SIZE + y) * BRICK_SIZE + x;
+        return (occupancy[bit >> 5] >> (bit & 31)) & 1;
+    }
+
+    void set(int32_t x, int32_t y, int32_t z) {
+        uint32_t bit = (z * BRICK_SIZE + y) * BRICK_SIZE + x;
+        occupancy[bit >> 5] |= 1u << (bit & 31);
+    }
+
+    uint32_t getVoxelCount() const {
+        uint32_t count = 0;
+        for (uint32_t word : occupancy) {
+            count += static_cast<uint32_t>(std::bitset<32>{word}.count());
+        }
+        return count;
+    }
+};
+
+static_assert(sizeof(VoxelBrick) == 76, "unexpected brick layout");
+
+// Must match Brick in shaders/voxels.rint
+struct GpuBrick {
+    float origin[3];  // object space corner of voxel (0, 0, 0)
+    float voxelSize;
+    uint32_t occupancy[BRICK_WORDS];
+};
+
+// Sparse voxel grid of the non-empty bricks. Voxel (0, 0, 0) of the grid
+// spans [0, voxelSize] on every axis in object space.
+struct VoxelGrid {
+    std::string name;
+    float voxelSize = 1.0f;
+    std::vector<VoxelBrick> bricks;
+    Aabb bounds;
+
+    uint64_t getVoxelCount() const {
+        uint64_t count = 0;
+        for (const auto& brick : bricks) {
+            count += brick.getVoxelCount();
+        }
+        return count;
+    }
+
+    // Bounds of the occupied voxels of every brick, one AABB primitive of
+    // the BLAS per brick. Tight bounds let traversal skip the empty part
+    // of a brick before the intersection shader runs.
+    std::vector<Aabb> computeBrickBounds() const {
+        std::vector<Aabb> boxes(bricks.size());
+        for (size_t i = 0; i < bricks.size(); i++) {
+            const VoxelBrick& brick = bricks[i];
+            int32_t lo[3] = {BRICK_SIZE, BRICK_SIZE, BRICK_SIZE};
+            int32_t hi[3] = {0, 0, 0};
+            for (int32_t z = 0; z < BRICK_SIZE; z++) {
+                for (int32_t y = 0; y < BRICK_SIZE; y++) {
+                    for (int32_t x = 0; x < BRICK_SIZE; x++) {
+                        if (!brick.get(x, y, z)) {
+                            continue;
+                        }
+                        int32_t voxel[3] = {x, y, z};
+                        for (int axis = 0; axis < 3; axis++) {
+                            lo[axis] = std::min(lo[axis], voxel[axis]);
+                            hi[axis] = std::max(hi[axis], voxel[axis] + 1);
+                        }
+                    }
+                }
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                float origin = brick.coord[axis] * BRICK_SIZE * voxelSize;
+                boxes[i].min[axis] = origin + lo[axis] * voxelSize;
+                boxes[i].max[axis] = origin + hi[axis] * voxelSize;
+            }
+        }
+        return boxes;
+    }
+
+    std::vector<GpuBrick> getGpuBricks() const {
+        std::vector<GpuBrick> gpuBricks(bricks.size());
+        for (size_t i = 0; i < bricks.size(); i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                gpuBricks[i].origin[axis] =
+                    bricks[i].coord[axis] * BRICK_SIZE * voxelSize;
+            }
+            gpuBricks[i].voxelSize = voxelSize;
+            std::memcpy(gpuBricks[i].occupancy, bricks[i].occupancy,
+                        sizeof(bricks[i].occupancy));
+        }
+        return gpuBricks;
+    }
+};
+
+// Brick coordinates as a hash key, 21 bits per axis
+inline uint64_t packBrickCoord(int32_t x, int32_t y, int32_t z) {
+    auto bias = [](int32_t value) {
+        return static_cast<uint64_t>(value + (1 << 20)) & 0x1FFFFF;
+    };
+    return bias(x) | bias(y) << 21 | bias(z) << 42;
+}
+
+inline void computeBounds(VoxelGrid& grid) {
+    grid.bounds = Aabb{};
+    for (const Aabb& box : grid.computeBrickBounds()) {
+        grid.bounds.extend(box);
+    }
+}
+
+// Reads a brick file:
+//   char magic[4]         "BRK1"
+//   uint32_t brickCount
+//   float voxelSize
+//   brickCount times
+//     int32_t coord[3]
+//     uint32_t occupancy[16]
+// in little-endian byte order. Empty bricks are dropped.
+inline VoxelGrid loadBricks(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << filename << "\n";
+        std::abort();
+    }
+
+    char magic[4] = {};
+    uint32_t brickCount = 0;
+    VoxelGrid grid;
+    grid.name = filename;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&brickCount), sizeof(brickCount));
+    file.read(reinterpret_cast<char*>(&grid.voxelSize),
+              sizeof(grid.voxelSize));
+    if (!file || std::memcmp(magic, "BRK1", 4) != 0 ||
+        !(grid.voxelSize > 0.0f)) {
+        std::cerr << filename << " is not a brick file.\n";
+        std::abort();
+    }
+
+    grid.bricks.resize(brickCount);
+    file.read(reinterpret_cast<char*>(grid.bricks.data()),
+              static_cast<std::streamsize>(sizeof(VoxelBrick) * brickCount));
+    if (!file) {
+        std::cerr << filename << " is truncated.\n";
+        std::abort();
+    }
+    grid.bricks.erase(
+        std::remove_if(grid.bricks.begin(), grid.bricks.end(),
+                       [](const VoxelBrick& brick) {
+                           return brick.getVoxelCount() == 0;
+                       }),
+        grid.bricks.end());
+    computeBounds(grid);
+    return grid;
+}
+
+inline bool writeBricks(const std::string& filename, const VoxelGrid& grid) {
+    std::ofstream file(filename, std::ios::binary);
+    uint32_t brickCount = static_cast<uint32_t>(grid.bricks.size());
+    file.write("BRK1", 4);
+    file.write(reinterpret_cast<const char*>(&brickCount), sizeof(brickCount));
+    file.write(reinterpret_cast<const char*>(&grid.voxelSize),
+               sizeof(grid.voxelSize));
+    file.write(reinterpret_cast<const char*>(grid.bricks.data()),
+               static_cast<std::streamsize>(sizeof(VoxelBrick) * brickCount));
+    return static_cast<bool>(file);
+}
+
+// Solid sphere of radius 1 around the origin with resolution voxels across,
+// its surface dented by a few octaves of waves so that the exposed faces do
+// not form large flat areas
+inline VoxelGrid createTestVoxelGrid(int32_t resolution = 128) {
+    VoxelGrid grid;
+    grid.name = "Voxel sphere";
+    grid.voxelSize = 2.0f / resolution;
+
+    int32_t brickCount = (resolution + BRICK_SIZE - 1) / BRICK_SIZE;
+    int32_t first = -brickCount / 2;
+    for (int32_t bz = first; bz < first + brickCount; bz++) {
+        for (int32_t by = first; by < first + brickCount; by++) {
+            for (int32_t bx = first; bx < first + brickCount; bx++) {
+                VoxelBrick brick{{bx, by, bz}, {}};
+                for (int32_t z = 0; z < BRICK_SIZE; z++) {
+                    for (int32_t y = 0; y < BRICK_SIZE; y++) {
+                        for (int32_t x = 0; x < BRICK_SIZE; x++) {
+                            float p[3] = {
+                                (bx * BRICK_SIZE + x + 0.5f) * grid.voxelSize,
+                                (by * BRICK_SIZE + y + 0.5f) * grid.voxelSize,
+                                (bz * BRICK_SIZE + z + 0.5f) * grid.voxelSize,
+                            };
+                            float radius = 0.9f;
+                            for (int octave = 1; octave <= 3; octave++) {
+                                float f = 4.0f * octave;
+                                radius += 0.04f / octave *
+                                          std::sin(f * p[0]) *
+                                          std::sin(f * p[1] + 1.0f) *
+                                          std::sin(f * p[2] + 2.0f);
+                            }
+                            if (p[0] * p[0] + p[1] * p[1] + p[2] * p[2] <
+                                radius * radius) {
+                                brick.set(x, y, z);
+                            }
+                        }
+                    }
+                }
+                if (brick.getVoxelCount() > 0) {
+                    grid.bricks.push_back(brick);
+                }
+            }
+        }
+    }
+    computeBounds(grid);
+    return grid;
+}
+
+// Converts the grid into the triangles of its exposed voxel faces, two per
+// face, for comparison with tracing the bricks directly. Call optimizeMesh()
+// to share the corners of neighbouring faces.
+inline Mesh meshVoxelGrid(const VoxelGrid& grid) {
+    std::unordered_map<uint64_t, uint32_t> brickIndices;
+    for (uint32_t i = 0; i < grid.bricks.size(); i++) {
+        const int32_t* c = grid.bricks[i].coord;
+        brickIndices.emplace(packBrickCoord(c[0], c[1], c[2]), i);
+    }
+
+    // Voxel at grid coordinates, which may lie in a neighbouring brick
+    auto isOccupied = [&](int32_t x, int32_t y, int32_t z) {
+        auto floorDiv = [](int32_t value) {
+            return value >= 0 ? value / BRICK_SIZE
+                              : (value - BRICK_SIZE + 1) / BRICK_SIZE;
+        };
+        int32_t bx = floorDiv(x), by = floorDiv(y), bz = floorDiv(z);
+        auto it = brickIndices.find(packBrickCoord(bx, by, bz));
+        return it != brickIndices.end() &&
+               grid.bricks[it->second].get(x - bx * BRICK_SIZE,
+                                           y - by * BRICK_SIZE,
+                                           z - bz * BRICK_SIZE);
+    };
+
+    Mesh mesh;
+    mesh.name = grid.name + " (meshed)";
+    for (const auto& brick : grid.bricks) {
+        for (int32_t z = 0; z < BRICK_SIZE; z++) {
+            for (int32_t y = 0; y < BRICK_SIZE; y++) {
+                for (int32_t x = 0; x < BRICK_SIZE; x++) {
+                    if (!brick.get(x, y, z)) {
+                        continue;
+                    }
+                    int32_t voxel[3] = {brick.coord[0] * BRICK_SIZE + x,
+                                        brick.coord[1] * BRICK_SIZE + y,
+                                        brick.coord[2] * BRICK_SIZE + z};
+                    for (int axis = 0; axis < 3; axis++) {
+                        for (int32_t side = 0; side < 2; side++) {
+                            int32_t neighbour[3] = {voxel[0], voxel[1],
+                                                    voxel[2]};
+                            neighbour[axis] += side * 2 - 1;
+                            if (isOccupied(neighbour[0], neighbour[1],
+                                           neighbour[2])) {
+                                continue;
+                            }
+
+                            // Corners of the face in the plane of axis
+                            int u = (axis + 1) % 3;
+                            int v = (axis + 2) % 3;
+                            uint32_t base =
+                                static_cast<uint32_t>(mesh.vertices.size());
+                            for (int corner = 0; corner < 4; corner++) {
+                                int32_t p[3] = {voxel[0], voxel[1], voxel[2]};
+                                p[axis] += side;
+                                p[u] += corner & 1;
+                                p[v] += corner >> 1;
+                                Vertex vertex{};
+                                for (int k = 0; k < 3; k++) {
+                                    vertex.pos[k] = p[k] * grid.voxelSize;
+                                }
+                                mesh.vertices.push_back(vertex);
+                            }
+                            mesh.indices.insert(
+                                mesh.indices.end(),
+                                {base, base + 1, base + 3, base, base + 3,
+                                 base + 2});
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return mesh;
+}
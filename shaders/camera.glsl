@@ -0,0 +1,112 @@
+// Push constants and primary rays of the raygen shaders
+
+// Must match PushConstants in code/10_draw_triangle.hpp
+layout(push_constant) uniform PushConstants {
+    uint debugMode;
+    float heatmapScale;
+    uint sampleCount;
+    uint sampleSeed;
+
+    // Primary rays go through forward + right * x + down * y
+    // for x, y in [-1, 1] from the top left of the image
+    vec4 cameraOrigin;
+    vec4 cameraForward;
+    vec4 cameraRight;
+    vec4 cameraDown;
+
+    // Buffer addresses read by voxels.rint and curves.rint
+    uvec2 voxelBricks;
+    uvec2 curveSegments;
+    uvec2 curvePieces;
+
+    // Thin lens and TLAS time slices
+    float lensRadius;
+    float focusDistance;
+    uint timeSliceCount;
+
+    // EyeCamera[eyeCount * 2] of stereo and motion blurred frames, eye i
+    // at shutter open and close at 2 * i and 2 * i + 1, read by app_raygen
+    uvec2 cameras;
+} pc;
+
+// Must match EyeCamera in code/10_draw_triangle.hpp
+struct EyeCamera {
+    vec4 origin;
+    vec4 forward;
+    vec4 right;
+    vec4 down;
+};
+
+// The camera of the push constants
+EyeCamera getCamera()
+{
+    return EyeCamera(pc.cameraOrigin, pc.cameraForward, pc.cameraRight,
+                     pc.cameraDown);
+}
+
+// uv is in [0, 1] from the top left of the image
+vec3 getPrimaryDirection(EyeCamera camera, vec2 uv)
+{
+    vec2 xy = uv * 2.0 - 1.0;
+    return normalize(camera.forward.xyz + camera.right.xyz * xy.x +
+                     camera.down.xyz * xy.y);
+}
+
+vec3 getPrimaryDirection(vec2 uv)
+{
+    return getPrimaryDirection(getCamera(), uv);
+}
+
+// PCG hash, advances the state and returns a float in [0, 1)
+float nextRandom(inout uint state)
+{
+    state = state * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return float((word >> 22u) ^ word) / 4294967296.0;
+}
+
+// Thin lens: moves origin to a random point of the lens and turns
+// direction towards where it would have met the plane in focus
+void sampleLens(EyeCamera camera,
+                inout vec3 origin,
+                inout vec3 direction,
+                inout uint seed)
+{
+    if (pc.lensRadius <= 0.0) {
+        return;
+    }
+    vec3 forward = normalize(camera.forward.xyz);
+    vec3 focus =
+        origin + direction * (pc.focusDistance / dot(direction, forward));
+    float radius = pc.lensRadius * sqrt(nextRandom(seed));
+    float angle = 6.28318531 * nextRandom(seed);
+    origin += normalize(camera.right.xyz) * (radius * cos(angle)) +
+              normalize(camera.down.xyz) * (radius * sin(angle));
+    direction = normalize(focus - origin);
+}
+
+// Time in [0, 1) of the shutter of a sample. Times are stratified over
+// the samples of a pixel and shifted by timeOffset in [0, 1) per pixel.
+float getSampleTime(uint sampleIndex, float timeOffset, inout uint seed)
+{
+    return fract((float(sampleIndex) + nextRandom(seed)) /
+                     float(pc.sampleCount) +
+                 timeOffset);
+}
+
+// Cull mask of a TLAS time slice at time. Slice i holds the instances at
+// time i / (timeSliceCount - 1), and one of the two slices around time
+// is picked with a probability that falls with its distance, so that
+// the samples interpolate them.
+uint getTimeSliceMask(float time, inout uint seed)
+{
+    if (pc.timeSliceCount <= 1) {
+        return 0xffu;
+    }
+    float position = time * float(pc.timeSliceCount - 1u);
+    uint slice = uint(position);
+    if (nextRandom(seed) < position - float(slice)) {
+        slice++;
+    }
+    return 1u << min(slice, pc.timeSliceCount - 1u);
+}
@@ -0,0 +1,29 @@
+// Per-ray-type counters. Compiled in only when RAY_STATS is defined.
+
+// Must match RayType in code/stats.hpp
+#define RAY_TYPE_PRIMARY 0
+#define RAY_TYPE_BOUNCE 1
+#define RAY_TYPE_SHADOW 2
+#define RAY_TYPE_AO 3
+
+#ifdef RAY_STATS
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+
+layout(binding = 3) buffer RayStats {
+    uint rays[4];
+} rayStats;
+
+void countRays(uint type, uint count)
+{
+    // Aggregate within the subgroup so that only one lane issues the atomic
+    uint total = subgroupAdd(count);
+    if (subgroupElect()) {
+        atomicAdd(rayStats.rays[type], total);
+    }
+}
+
+#define COUNT_RAY(type) countRays(type, 1)
+#else
+#define COUNT_RAY(type)
+#endif